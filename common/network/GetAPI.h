@@ -22,10 +22,15 @@
 #include <kasmpasswd.h>
 #include <pthread.h>
 #include <network/GetAPIEnums.h>
+#include <rfb/FrameStore.h>
 #include <rfb/PixelBuffer.h>
 #include <rfb/PixelFormat.h>
+#include <rfb/Region.h>
 #include <stdint.h>
+#include <future>
+#include <list>
 #include <map>
+#include <memory>
 #include <string>
 #include <vector>
 #include <mutex>
@@ -37,7 +42,7 @@ namespace network {
     GetAPIMessager(const char *passwdfile_);
 
     // from main thread
-    void mainUpdateScreen(rfb::PixelBuffer *pb);
+    void mainUpdateScreen(rfb::FrameStore *store);
     void mainUpdateBottleneckStats(const char userid[], const char stats[]);
     void mainClearBottleneckStats(const char userid[]);
     void mainUpdateServerFrameStats(uint8_t changedPerc, uint32_t all,
@@ -45,7 +50,7 @@ namespace network {
                                     uint32_t jpegarea, uint32_t webparea,
                                     uint16_t njpeg, uint16_t nwebp,
                                     uint16_t enc, uint16_t scale, uint16_t shot,
-                                    uint16_t w, uint16_t h);
+                                    uint16_t w, uint16_t h, uint32_t inputLatency);
     void mainUpdateClientFrameStats(const char userid[], uint32_t render, uint32_t all,
                                     uint32_t ping);
     void mainUpdateUserInfo(const uint8_t ownerConn, const uint8_t numUsers);
@@ -55,7 +60,9 @@ namespace network {
     // from network threads
     uint8_t *netGetScreenshot(uint16_t w, uint16_t h,
                               const uint8_t q, const bool dedup,
-                              uint32_t &len, uint8_t *staging);
+                              const SCREENSHOT_FORMAT format,
+                              uint32_t &len);
+    uint32_t netWaitScreenChange(const uint32_t generation, const unsigned timeoutMs);
     uint8_t netAddUser(const char name[], const char pw[],
                        const bool read, const bool write, const bool owner);
     uint8_t netRemoveUser(const char name[]);
@@ -66,6 +73,9 @@ namespace network {
     void netGetUsers(const char **ptr);
 
     const std::string_view netGetSessions();
+    std::string netGetMetrics();
+    void netSetTracing(const bool enabled);
+    std::string netGetTrace();
     void netGetBottleneckStats(char *buf, uint32_t len);
     void netGetFrameStats(char *buf, uint32_t len);
     void netResetFrameStatsCall();
@@ -105,14 +115,33 @@ namespace network {
   private:
     const char *passwdfile;
 
+    typedef std::shared_ptr<const std::vector<uint8_t> > encodedShot_t;
+
+    // The result is a future so that concurrent requests for the same
+    // image, such as many watchers of one stream, share a single encode.
+    struct cachedShot_t {
+      uint16_t w, h;
+      uint8_t q;
+      SCREENSHOT_FORMAT format;
+      uint32_t generation;
+      std::shared_future<encodedShot_t> data;
+    };
+
+    encodedShot_t encodeScreenshot(const rfb::PixelBuffer &pb, uint16_t w, uint16_t h,
+                       const uint8_t q, const SCREENSHOT_FORMAT format) const;
+    uint64_t screenHash(const rfb::PixelBuffer &pb, const uint32_t generation);
+
+    // Screenshots borrow immutable snapshots of the server's frame store,
+    // so neither side copies the screen or waits for the other
     pthread_mutex_t screenMutex;
-    rfb::ManagedPixelBuffer screenPb;
-    uint16_t screenW, screenH;
-    uint64_t screenHash;
+    pthread_cond_t screenCond;
+    rfb::FrameStore *frameStore;
+    uint32_t screenGeneration;
+    uint64_t shotHash;
+    uint32_t shotHashGeneration;
 
-    std::vector<uint8_t> cachedJpeg;
-    uint16_t cachedW, cachedH;
-    uint8_t cachedQ;
+    // Most recently used first
+    std::list<cachedShot_t> shotCache;
 
     std::map<std::string, std::string> bottleneckStats;
     pthread_mutex_t statMutex;
@@ -129,6 +158,7 @@ namespace network {
       uint32_t analysis;
       uint32_t jpegarea;
       uint32_t webparea;
+      uint32_t inputLatency;
       uint16_t njpeg;
       uint16_t nwebp;
       uint16_t enc;
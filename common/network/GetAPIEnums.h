@@ -27,4 +27,10 @@ enum USER_UPDATE_MASK {
 	USER_UPDATE_READ_MASK = 1 << 3,
 };
 
+enum SCREENSHOT_FORMAT {
+	SCREENSHOT_FORMAT_JPEG,
+	SCREENSHOT_FORMAT_WEBP,
+	SCREENSHOT_FORMAT_PNG,
+};
+
 #endif
@@ -25,9 +25,14 @@
 #include <rfb/EncodeManager.h>
 #include <rfb/LogWriter.h>
 #include <rfb/JpegCompressor.h>
+#include <rfb/Metrics.h>
+#include <rfb/Trace.h>
 #include <rfb/xxhash.h>
+#include <png.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <webp/encode.h>
+#include <memory>
 #include <string>
 #include <utility>
 
@@ -55,12 +60,13 @@ static const struct TightJPEGConfiguration conf[10] = {
 };
 
 GetAPIMessager::GetAPIMessager(const char *passwdfile_): passwdfile(passwdfile_),
-					screenW(0), screenH(0), screenHash(0),
-					cachedW(0), cachedH(0), cachedQ(0),
+					frameStore(NULL), screenGeneration(0),
+					shotHash(0), shotHashGeneration(0),
 					ownerConnected(0), activeUsers(0),
 					sessionsInfo( "{\"users\":[]}"){
 
 	pthread_mutex_init(&screenMutex, NULL);
+	pthread_cond_init(&screenCond, NULL);
 	pthread_mutex_init(&userMutex, NULL);
 	pthread_mutex_init(&statMutex, NULL);
 	pthread_mutex_init(&frameStatMutex, NULL);
@@ -70,33 +76,21 @@ GetAPIMessager::GetAPIMessager(const char *passwdfile_): passwdfile(passwdfile_)
 }
 
 // from main thread
-void GetAPIMessager::mainUpdateScreen(rfb::PixelBuffer *pb) {
-	if (pthread_mutex_trylock(&screenMutex))
+void GetAPIMessager::mainUpdateScreen(rfb::FrameStore *store) {
+	if (pthread_mutex_lock(&screenMutex))
 		return;
 
-	int stride;
-	const rdr::U8 * const buf = pb->getBuffer(pb->getRect(), &stride);
-
-	if (pb->width() != screenW || pb->height() != screenH) {
-		screenHash = 0;
-		screenW = pb->width();
-		screenH = pb->height();
-		screenPb.setPF(pb->getPF());
-		screenPb.setSize(screenW, screenH);
+	frameStore = store;
 
-		cachedW = cachedH = cachedQ = 0;
-		cachedJpeg.clear();
-	}
+	// The store only moves to a new generation when pixels changed
+	const uint32_t generation = store->getGeneration();
+	if (generation != screenGeneration) {
+		screenGeneration = generation;
 
-	const uint64_t newHash = XXH64(buf, pb->area() * 4, 0);
-	if (newHash != screenHash) {
-		cachedW = cachedH = cachedQ = 0;
-		cachedJpeg.clear();
+		// Results for older generations can never be returned again
+		shotCache.clear();
 
-		screenHash = newHash;
-		rdr::U8 *rw = screenPb.getBufferRW(screenPb.getRect(), &stride);
-		memcpy(rw, buf, screenW * screenH * 4);
-		screenPb.commitBufferRW(screenPb.getRect());
+		pthread_cond_broadcast(&screenCond);
 	}
 
 	pthread_mutex_unlock(&screenMutex);
@@ -125,7 +119,7 @@ void GetAPIMessager::mainUpdateServerFrameStats(uint8_t changedPerc,
 	uint32_t jpegarea, uint32_t webparea,
 	uint16_t njpeg, uint16_t nwebp,
 	uint16_t enc, uint16_t scale, uint16_t shot,
-	uint16_t w, uint16_t h) {
+	uint16_t w, uint16_t h, uint32_t inputLatency) {
 
 	if (pthread_mutex_lock(&frameStatMutex))
 		return;
@@ -144,6 +138,7 @@ void GetAPIMessager::mainUpdateServerFrameStats(uint8_t changedPerc,
 	serverFrameStats.shot = shot;
 	serverFrameStats.w = w;
 	serverFrameStats.h = h;
+	serverFrameStats.inputLatency = inputLatency;
 
 	pthread_mutex_unlock(&frameStatMutex);
 }
@@ -183,94 +178,289 @@ void GetAPIMessager::mainUpdateSessionsInfo(std::string newSessionsInfo)
 	lock.unlock();
 }
 
+static void pngWrite(png_structp png_ptr, png_bytep data, png_size_t length) {
+	std::vector<uint8_t> *out = (std::vector<uint8_t> *) png_get_io_ptr(png_ptr);
+	out->insert(out->end(), data, data + length);
+}
+
+static void pngFlush(png_structp png_ptr) {
+}
+
+static bool compressPNG(const PixelBuffer *pb, std::vector<uint8_t> &out) {
+	png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (!png_ptr)
+		return false;
+	png_infop info = png_create_info_struct(png_ptr);
+	if (!info) {
+		png_destroy_write_struct(&png_ptr, NULL);
+		return false;
+	}
+
+	const unsigned w = pb->width(), h = pb->height();
+	std::vector<rdr::U8> row(w * 3);
+
+	if (setjmp(png_jmpbuf(png_ptr))) {
+		png_destroy_write_struct(&png_ptr, &info);
+		return false;
+	}
+
+	png_set_write_fn(png_ptr, &out, pngWrite, pngFlush);
+	png_set_IHDR(png_ptr, info, w, h, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+	             PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	// Screenshots are requested interactively, favor speed over size
+	png_set_compression_level(png_ptr, 3);
+	png_write_info(png_ptr, info);
+
+	int stride;
+	const rdr::U8 * const buf = pb->getBuffer(pb->getRect(), &stride);
+	const unsigned bytesPerPixel = pb->getPF().bpp / 8;
+	for (unsigned y = 0; y < h; y++) {
+		pb->getPF().rgbFromBuffer(&row[0], buf + y * stride * bytesPerPixel, w);
+		png_write_row(png_ptr, &row[0]);
+	}
+
+	png_write_end(png_ptr, NULL);
+	png_destroy_write_struct(&png_ptr, &info);
+
+	return true;
+}
+
+static bool compressWEBP(const PixelBuffer *pb, const int quality,
+                         std::vector<uint8_t> &out) {
+	const unsigned w = pb->width(), h = pb->height();
+	std::vector<rdr::U8> rgb(w * h * 3);
+
+	int stride;
+	const rdr::U8 * const buf = pb->getBuffer(pb->getRect(), &stride);
+	pb->getPF().rgbFromBuffer(&rgb[0], buf, w, stride, h);
+
+	uint8_t *webp;
+	const size_t size = WebPEncodeRGB(&rgb[0], w, h, w * 3, quality, &webp);
+	if (!size)
+		return false;
+
+	out.assign(webp, webp + size);
+	WebPFree(webp);
+
+	return true;
+}
+
+GetAPIMessager::encodedShot_t
+GetAPIMessager::encodeScreenshot(const PixelBuffer &pb, uint16_t w, uint16_t h,
+                                 const uint8_t q, const SCREENSHOT_FORMAT format) const {
+
+	std::shared_ptr<std::vector<uint8_t> > out = std::make_shared<std::vector<uint8_t> >();
+	const PixelBuffer *src = &pb;
+	std::unique_ptr<PixelBuffer> scaled;
+
+	if (w != pb.width() || h != pb.height()) {
+		float xdiff = w / (float) pb.width();
+		float ydiff = h / (float) pb.height();
+		const float diff = xdiff < ydiff ? xdiff : ydiff;
+
+		const uint16_t neww = pb.width() * diff;
+		const uint16_t newh = pb.height() * diff;
+
+		scaled.reset(progressiveBilinearScale(&pb, neww, newh, diff));
+		src = scaled.get();
+	}
+
+	bool ok = true;
+
+	switch (format) {
+	case SCREENSHOT_FORMAT_JPEG: {
+		JpegCompressor jc;
+		int stride;
+		const rdr::U8 * const buf = src->getBuffer(src->getRect(), &stride);
+
+		jc.clear();
+		jc.compress(buf, stride, src->getRect(), src->getPF(),
+		            conf[q].quality, conf[q].subsampling);
+
+		out->assign((const uint8_t *) jc.data(), (const uint8_t *) jc.data() + jc.length());
+		break;
+	}
+	case SCREENSHOT_FORMAT_WEBP:
+		ok = compressWEBP(src, conf[q].quality, *out);
+		break;
+	case SCREENSHOT_FORMAT_PNG:
+		ok = compressPNG(src, *out);
+		break;
+	}
+
+	if (!ok) {
+		vlog.error("Failed to encode screenshot");
+		return NULL;
+	}
+
+	vlog.debug("Encoded %s%s screenshot", scaled ? "scaled " : "",
+	          format == SCREENSHOT_FORMAT_PNG ? "png" :
+	          format == SCREENSHOT_FORMAT_WEBP ? "webp" : "jpeg");
+
+	return out;
+}
+
 // from network threads
 uint8_t *GetAPIMessager::netGetScreenshot(uint16_t w, uint16_t h,
-	const uint8_t q, const bool dedup,
-	uint32_t &len, uint8_t *staging) {
+	const uint8_t q_, const bool dedup,
+	const SCREENSHOT_FORMAT format,
+	uint32_t &len) {
+
+	// Small enough to keep a few sizes for a couple of dashboards around
+	static const unsigned maxCachedShots = 8;
 
 	uint8_t *ret = NULL;
 	len = 0;
 
-	if (w > screenW)
-		w = screenW;
-	if (h > screenH)
-		h = screenH;
-
-	if (!screenW || !screenH)
-		vlog.error("Screenshot requested but no screenshot exists (screen hasn't been viewed)");
+	// The quality level doesn't apply to lossless output
+	const uint8_t q = format == SCREENSHOT_FORMAT_PNG ? 0 : q_;
 
-	if (!w || !h || q > 9 || !staging)
+	if (!w || !h || q > 9)
 		return NULL;
 
 	if (pthread_mutex_lock(&screenMutex))
 		return NULL;
 
-	if (w == cachedW && h == cachedH && q == cachedQ) {
-		if (dedup) {
-			// Return the hash of the unchanged image
-			sprintf((char *) staging, "%" PRIx64, screenHash);
-			ret = staging;
-			len = 16;
-		} else {
-			// Return the cached image
-			len = cachedJpeg.size();
-			ret = staging;
-			memcpy(ret, &cachedJpeg[0], len);
+	uint32_t generation = 0;
+	rfb::FrameStore::Snapshot snap;
+	if (frameStore)
+		snap = frameStore->snapshot(&generation);
+	if (!snap || snap->getRect().is_empty()) {
+		pthread_mutex_unlock(&screenMutex);
+		vlog.error("Screenshot requested but no screenshot exists (screen hasn't been viewed)");
+		return NULL;
+	}
 
-			vlog.info("Returning cached screenshot");
+	if (w > snap->width())
+		w = snap->width();
+	if (h > snap->height())
+		h = snap->height();
+
+	std::shared_future<encodedShot_t> pending;
+	std::promise<encodedShot_t> encoding;
+	std::list<cachedShot_t>::iterator it;
+	for (it = shotCache.begin(); it != shotCache.end(); it++) {
+		if (it->w == w && it->h == h && it->q == q && it->format == format &&
+		    it->generation == generation) {
+			pending = it->data;
+			shotCache.splice(shotCache.begin(), shotCache, it);
+			break;
 		}
-	} else {
-		// Encode the new JPEG, cache it
-		JpegCompressor jc;
-		int quality, subsampling;
+	}
 
-		quality = conf[q].quality;
-		subsampling = conf[q].subsampling;
+	const bool cached = pending.valid();
+	if (!cached) {
+		// Claim this encode, later requests will wait on our result
+		cachedShot_t entry;
+		entry.w = w;
+		entry.h = h;
+		entry.q = q;
+		entry.format = format;
+		entry.generation = generation;
+		entry.data = pending = encoding.get_future().share();
+
+		shotCache.push_front(entry);
+		while (shotCache.size() > maxCachedShots)
+			shotCache.pop_back();
+	}
 
-		jc.clear();
-		int stride;
+	pthread_mutex_unlock(&screenMutex);
 
-		if (w != screenW || h != screenH) {
-			float xdiff = w / (float) screenW;
-			float ydiff = h / (float) screenH;
-			const float diff = xdiff < ydiff ? xdiff : ydiff;
+	if (cached && dedup) {
+		// Return the hash of the unchanged image
+		ret = (uint8_t *) malloc(17);
+		if (!ret)
+			return NULL;
+		sprintf((char *) ret, "%016" PRIx64, screenHash(*snap, generation));
+		len = 16;
+		return ret;
+	}
 
-			const uint16_t neww = screenW * diff;
-			const uint16_t newh = screenH * diff;
+	if (!cached) {
+		// Encode without holding the lock, the snapshot is immutable.
+		// Other requests wait on this result, so it has to be set even
+		// if encoding fails.
+		encodedShot_t shot;
+		try {
+			shot = encodeScreenshot(*snap, w, h, q, format);
+		} catch (rdr::Exception &e) {
+			vlog.error("Failed to encode screenshot: %s", e.str());
+		} catch (std::exception &e) {
+			vlog.error("Failed to encode screenshot: %s", e.what());
+		}
+		encoding.set_value(shot);
+	} else {
+		vlog.debug("Returning cached screenshot");
+	}
 
-			const PixelBuffer *scaled = progressiveBilinearScale(&screenPb, neww, newh, diff);
-			const rdr::U8 * const buf = scaled->getBuffer(scaled->getRect(), &stride);
+	const encodedShot_t data = pending.get();
+	if (!data) {
+		if (!cached && !pthread_mutex_lock(&screenMutex)) {
+			// Let the next request retry instead of sharing the failure
+			for (it = shotCache.begin(); it != shotCache.end(); it++) {
+				if (it->generation == generation && it->w == w && it->h == h &&
+				    it->q == q && it->format == format) {
+					shotCache.erase(it);
+					break;
+				}
+			}
+			pthread_mutex_unlock(&screenMutex);
+		}
+		return NULL;
+	}
 
-			jc.compress(buf, stride, scaled->getRect(),
-					scaled->getPF(), quality, subsampling);
+	ret = (uint8_t *) malloc(data->size());
+	if (!ret)
+		return NULL;
+	len = data->size();
+	memcpy(ret, &(*data)[0], len);
 
-			cachedJpeg.resize(jc.length());
-			memcpy(&cachedJpeg[0], jc.data(), jc.length());
+	return ret;
+}
 
-			delete scaled;
+uint64_t GetAPIMessager::screenHash(const PixelBuffer &pb, const uint32_t generation) {
+	if (!pthread_mutex_lock(&screenMutex)) {
+		const bool known = shotHashGeneration == generation;
+		const uint64_t hash = shotHash;
+		pthread_mutex_unlock(&screenMutex);
+		if (known)
+			return hash;
+	}
 
-			vlog.info("Returning scaled screenshot");
-		} else {
-			const rdr::U8 * const buf = screenPb.getBuffer(screenPb.getRect(), &stride);
+	// Only dedup requests need it, so hash lazily and off the main thread
+	int stride;
+	const rdr::U8 * const buf = pb.getBuffer(pb.getRect(), &stride);
+	const uint64_t hash = XXH64(buf, (size_t) stride * pb.height() * (pb.getPF().bpp / 8), 0);
 
-			jc.compress(buf, stride, screenPb.getRect(),
-					screenPb.getPF(), quality, subsampling);
+	if (!pthread_mutex_lock(&screenMutex)) {
+		shotHash = hash;
+		shotHashGeneration = generation;
+		pthread_mutex_unlock(&screenMutex);
+	}
 
-			cachedJpeg.resize(jc.length());
-			memcpy(&cachedJpeg[0], jc.data(), jc.length());
+	return hash;
+}
 
-			vlog.info("Returning normal screenshot");
-		}
+uint32_t GetAPIMessager::netWaitScreenChange(const uint32_t generation,
+                                             const unsigned timeoutMs) {
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeoutMs / 1000;
+	deadline.tv_nsec += (timeoutMs % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
 
-		cachedQ = q;
-		cachedW = w;
-		cachedH = h;
+	if (pthread_mutex_lock(&screenMutex))
+		return generation;
 
-		len = cachedJpeg.size();
-		ret = staging;
-		memcpy(ret, &cachedJpeg[0], len);
+	while (screenGeneration == generation) {
+		if (pthread_cond_timedwait(&screenCond, &screenMutex, &deadline))
+			break;
 	}
 
+	const uint32_t ret = screenGeneration;
 	pthread_mutex_unlock(&screenMutex);
 
 	return ret;
@@ -532,6 +722,21 @@ const std::string_view GetAPIMessager::netGetSessions()
 	return sessionsInfo;
 }
 
+std::string GetAPIMessager::netGetMetrics()
+{
+	return metrics::registry.format();
+}
+
+void GetAPIMessager::netSetTracing(const bool enabled)
+{
+	trace::setEnabled(enabled);
+}
+
+std::string GetAPIMessager::netGetTrace()
+{
+	return trace::dump();
+}
+
 void GetAPIMessager::netGetBottleneckStats(char *buf, uint32_t len) {
 /*
 {
@@ -650,12 +855,14 @@ void GetAPIMessager::netGetFrameStats(char *buf, uint32_t len) {
 	           "\t\t\"resx\": %u,\n"
 	           "\t\t\"resy\": %u,\n"
 	           "\t\t\"changed\": %u,\n"
-	           "\t\t\"server_time\": %u\n"
+	           "\t\t\"server_time\": %u,\n"
+	           "\t\t\"input_latency\": %u\n"
 	           "\t},\n",
 	           serverFrameStats.w,
 	           serverFrameStats.h,
 	           serverFrameStats.changedPerc,
-	           serverFrameStats.all);
+	           serverFrameStats.all,
+	           serverFrameStats.inputLatency);
 
 	fprintf(f, "\t\"server_side\" : [\n"
 	           "\t\t{ \"process_name\": \"Analysis\", \"time\": %u },\n"
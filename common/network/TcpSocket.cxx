@@ -54,6 +54,8 @@
 #include <rfb/Configuration.h>
 #include <rfb/ServerCore.h>
 
+#include <exception>
+
 #ifdef WIN32
 #include <os/winerrno.h>
 #endif
@@ -439,11 +441,38 @@ int TcpListener::getMyPort() {
 extern settings_t settings;
 
 static uint8_t *screenshotCb(void *messager, uint16_t w, uint16_t h, const uint8_t q,
-                             const uint8_t dedup,
-                             uint32_t *len, uint8_t *staging)
+                             const uint8_t dedup, const uint8_t format,
+                             uint32_t *len)
 {
   GetAPIMessager *msgr = (GetAPIMessager *) messager;
-  return msgr->netGetScreenshot(w, h, q, dedup, *len, staging);
+
+  // Called from C, nothing may be thrown past here
+  try {
+    return msgr->netGetScreenshot(w, h, q, dedup, (SCREENSHOT_FORMAT) format, *len);
+  } catch (rdr::Exception& e) {
+    vlog.error("Screenshot failed: %s", e.str());
+  } catch (std::exception& e) {
+    vlog.error("Screenshot failed: %s", e.what());
+  } catch (...) {
+    vlog.error("Screenshot failed");
+  }
+
+  *len = 0;
+  return NULL;
+}
+
+static uint32_t waitScreenChangeCb(void *messager, const uint32_t generation,
+                                   const unsigned timeoutMs)
+{
+  GetAPIMessager *msgr = (GetAPIMessager *) messager;
+
+  try {
+    return msgr->netWaitScreenChange(generation, timeoutMs);
+  } catch (...) {
+    vlog.error("Waiting for a screen change failed");
+  }
+
+  return generation;
 }
 
 static uint8_t adduserCb(void *messager, const char name[], const char pw[],
@@ -563,6 +592,24 @@ static void getSessionsCb(void *messager,  char **ptr)
   *ptr = sessionInfo;
 }
 
+static void metricsCb(void *messager, char **ptr)
+{
+  GetAPIMessager *msgr = (GetAPIMessager *) messager;
+  *ptr = strdup(msgr->netGetMetrics().c_str());
+}
+
+static void setTracingCb(void *messager, const uint8_t enabled)
+{
+  GetAPIMessager *msgr = (GetAPIMessager *) messager;
+  msgr->netSetTracing(enabled);
+}
+
+static void getTraceCb(void *messager, char **ptr)
+{
+  GetAPIMessager *msgr = (GetAPIMessager *) messager;
+  *ptr = strdup(msgr->netGetTrace().c_str());
+}
+
 #if OPENSSL_VERSION_NUMBER < 0x1010000f
 
 static pthread_mutex_t *sslmutex;
@@ -692,6 +739,7 @@ WebsocketListener::WebsocketListener(const struct sockaddr *listenaddr,
 
   settings.messager = messager = new GetAPIMessager(settings.passwdfile);
   settings.screenshotCb = screenshotCb;
+  settings.waitScreenChangeCb = waitScreenChangeCb;
   settings.adduserCb = adduserCb;
   settings.removeCb = removeCb;
   settings.updateUserCb = updateUserCb;
@@ -713,6 +761,9 @@ WebsocketListener::WebsocketListener(const struct sockaddr *listenaddr,
 
   settings.clearClipboardCb = clearClipboardCb;
   settings.getSessionsCb = getSessionsCb;
+  settings.metricsCb = metricsCb;
+  settings.setTracingCb = setTracingCb;
+  settings.getTraceCb = getTraceCb;
 
   openssl_threads();
 
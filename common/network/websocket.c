@@ -27,6 +27,7 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <fcntl.h>  // daemonizing
+#include <poll.h>
 #include <pwd.h>
 #include <grp.h>
 #include <wordexp.h>
@@ -72,6 +73,10 @@ void fatal(char *msg)
 
 #define WS_MAX_BUF_SIZE 4096
 
+// Limits for the screenshot stream, it's meant for thumbnails
+#define STREAM_MAX_DIM 1920
+#define STREAM_MAX_FPS 15
+
 // 2022-05-18 19:51:26,810 [INFO] websocket 0: 71.62.44.0 172.12.15.5 - "GET /api/get_frame_stats?client=auto HTTP/1.1" 403 2
 static void weblog(const unsigned code, const unsigned websocket,
                    const uint8_t debug,
@@ -95,6 +100,29 @@ static void weblog(const unsigned code, const unsigned websocket,
             get ? "GET" : "POST", url, code, len);
 }
 
+static unsigned ms_since(const struct timeval *start)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    return (now.tv_sec - start->tv_sec) * 1000 +
+           (now.tv_usec - start->tv_usec) / 1000;
+}
+
+// Whether the other end hung up on a connection we only write to
+static uint8_t peer_closed(ws_ctx_t *ctx)
+{
+    struct pollfd pfd = { ctx->sockfd, POLLIN, 0 };
+    char c;
+
+    if (poll(&pfd, 1, 0) <= 0)
+        return 0;
+    if (pfd.revents & (POLLHUP | POLLERR))
+        return 1;
+
+    return recv(ctx->sockfd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+}
+
 void wslog(char *logbuf, const unsigned websocket, const uint8_t debug)
 {
     struct timeval tv;
@@ -1285,8 +1313,9 @@ static uint8_t ownerapi(ws_ctx_t *ws_ctx, const char *in, const char * const use
     const char *param;
 
     entry("/api/get_screenshot") {
-        uint8_t q = 7, dedup = 0;
+        uint8_t q = 7, dedup = 0, format = SCREENSHOT_FORMAT_JPEG;
         uint16_t w = 4096, h = 4096;
+        const char *mime = "image/jpeg";
 
         param = parse_get(args, "width", &len);
         if (len && isdigit(param[0]))
@@ -1306,11 +1335,24 @@ static uint8_t ownerapi(ws_ctx_t *ws_ctx, const char *in, const char * const use
                 dedup = 1;
         }
 
-        uint8_t *staging = malloc(1024 * 1024 * 8);
+        param = parse_get(args, "format", &len);
+        if (len && isalpha(param[0])) {
+            if (!strncmp(param, "webp", len)) {
+                format = SCREENSHOT_FORMAT_WEBP;
+                mime = "image/webp";
+            } else if (!strncmp(param, "png", len)) {
+                format = SCREENSHOT_FORMAT_PNG;
+                mime = "image/png";
+            } else if (strncmp(param, "jpeg", len)) {
+                handler_msg("Unknown screenshot format\n");
+                goto nope;
+            }
+        }
 
-        settings.screenshotCb(settings.messager, w, h, q, dedup, &len, staging);
+        uint8_t *shot = settings.screenshotCb(settings.messager, w, h, q, dedup,
+                                              format, &len);
 
-        if (len == 16) {
+        if (shot && len == 16) {
             sprintf(buf, "HTTP/1.1 200 OK\r\n"
                      "Server: KasmVNC/4.0\r\n"
                      "Connection: close\r\n"
@@ -1319,33 +1361,136 @@ static uint8_t ownerapi(ws_ctx_t *ws_ctx, const char *in, const char * const use
                      "%s"
                      "\r\n", len, extra_headers ? extra_headers : "");
             ws_send(ws_ctx, buf, strlen(buf));
-            ws_send(ws_ctx, staging, len);
+            ws_send(ws_ctx, shot, len);
             weblog(200, wsthread_handler_id, 0, origip, ip, user, 1, origpath, strlen(buf) + len);
 
             handler_msg("Screenshot hadn't changed and dedup was requested, sent hash\n");
             ret = 1;
-        } else if (len) {
+        } else if (shot && len) {
             sprintf(buf, "HTTP/1.1 200 OK\r\n"
                      "Server: KasmVNC/4.0\r\n"
                      "Connection: close\r\n"
-                     "Content-type: image/jpeg\r\n"
+                     "Content-type: %s\r\n"
                      "Content-length: %u\r\n"
                      "%s"
-                     "\r\n", len, extra_headers ? extra_headers : "");
+                     "\r\n", mime, len, extra_headers ? extra_headers : "");
             ws_send(ws_ctx, buf, strlen(buf));
-            ws_send(ws_ctx, staging, len);
+            ws_send(ws_ctx, shot, len);
             weblog(200, wsthread_handler_id, 0, origip, ip, user, 1, origpath, strlen(buf) + len);
 
             handler_msg("Sent screenshot %u bytes\n", len);
             ret = 1;
         }
 
-        free(staging);
+        free(shot);
 
-        if (!len) {
+        if (!ret) {
             handler_msg("Invalid params to screenshot\n");
             goto nope;
         }
+    } else entry("/api/get_screenshot_stream") {
+        // A multipart/x-mixed-replace stream, viewable directly in an <img> tag.
+        // Frames are only sent when the screen changed, at most fps per second.
+        uint8_t q = 5, fps = 2, format = SCREENSHOT_FORMAT_JPEG;
+        uint16_t w = 640, h = 360;
+        const char *mime = "image/jpeg";
+
+        param = parse_get(args, "width", &len);
+        if (len && isdigit(param[0]))
+            w = atoi(param);
+
+        param = parse_get(args, "height", &len);
+        if (len && isdigit(param[0]))
+            h = atoi(param);
+
+        param = parse_get(args, "quality", &len);
+        if (len && isdigit(param[0]))
+            q = atoi(param);
+
+        param = parse_get(args, "fps", &len);
+        if (len && isdigit(param[0]))
+            fps = atoi(param);
+
+        param = parse_get(args, "format", &len);
+        if (len && isalpha(param[0])) {
+            if (!strncmp(param, "webp", len)) {
+                format = SCREENSHOT_FORMAT_WEBP;
+                mime = "image/webp";
+            } else if (strncmp(param, "jpeg", len)) {
+                handler_msg("Unknown screenshot stream format\n");
+                goto nope;
+            }
+        }
+
+        if (w > STREAM_MAX_DIM)
+            w = STREAM_MAX_DIM;
+        if (h > STREAM_MAX_DIM)
+            h = STREAM_MAX_DIM;
+        if (fps > STREAM_MAX_FPS)
+            fps = STREAM_MAX_FPS;
+
+        if (!w || !h || !fps || q > 9) {
+            handler_msg("Invalid params to screenshot stream\n");
+            goto nope;
+        }
+
+        sprintf(buf, "HTTP/1.1 200 OK\r\n"
+                 "Server: KasmVNC/4.0\r\n"
+                 "Connection: close\r\n"
+                 "Cache-Control: no-cache, no-store\r\n"
+                 "Content-type: multipart/x-mixed-replace; boundary=kasmframe\r\n"
+                 "%s"
+                 "\r\n", extra_headers ? extra_headers : "");
+        if (ws_send(ws_ctx, buf, strlen(buf)) <= 0)
+            return 1;
+
+        handler_msg("Starting screenshot stream %ux%u at %u fps\n", w, h, fps);
+
+        uint32_t generation = 0, frames = 0;
+        uint64_t sent = strlen(buf);
+        const unsigned frameMs = 1000 / fps;
+
+        while (1) {
+            const uint32_t newgen = settings.waitScreenChangeCb(settings.messager,
+                                                                generation, 1000);
+            if (peer_closed(ws_ctx))
+                break;
+            if (newgen == generation)
+                continue;
+            generation = newgen;
+
+            struct timeval start;
+            gettimeofday(&start, NULL);
+
+            uint8_t *shot = settings.screenshotCb(settings.messager, w, h, q, 0,
+                                                  format, &len);
+            if (!shot)
+                continue;
+
+            sprintf(buf, "--kasmframe\r\n"
+                     "Content-type: %s\r\n"
+                     "Content-length: %u\r\n"
+                     "\r\n", mime, len);
+
+            const uint8_t ok = ws_send(ws_ctx, buf, strlen(buf)) > 0 &&
+                               ws_send(ws_ctx, shot, len) > 0 &&
+                               ws_send(ws_ctx, "\r\n", 2) > 0;
+            free(shot);
+            if (!ok)
+                break;
+
+            sent += strlen(buf) + len + 2;
+            frames++;
+
+            const unsigned elapsed = ms_since(&start);
+            if (elapsed < frameMs)
+                usleep((frameMs - elapsed) * 1000);
+        }
+
+        handler_msg("Screenshot stream ended after %u frames\n", frames);
+        weblog(200, wsthread_handler_id, 0, origip, ip, user, 1, origpath, sent);
+
+        ret = 1;
     } else entry("/api/create_user") {
         char decname[1024] = "", decpw[1024] = "";
         uint8_t read = 0, write = 0, owner = 0;
@@ -1551,6 +1696,72 @@ static uint8_t ownerapi(ws_ctx_t *ws_ctx, const char *in, const char * const use
 
         handler_msg("Sent session list to API caller\n");
         ret = 1;
+    } else entry("/api/metrics") {
+        char *metrics;
+        settings.metricsCb(settings.messager, &metrics);
+
+        sprintf(buf, "HTTP/1.1 200 OK\r\n"
+                 "Server: KasmVNC/4.0\r\n"
+                 "Connection: close\r\n"
+                 "Content-type: text/plain; version=0.0.4\r\n"
+                 "Content-length: %lu\r\n"
+                 "%s"
+                 "\r\n", strlen(metrics), extra_headers ? extra_headers : "");
+        ws_send(ws_ctx, buf, strlen(buf));
+        ws_send(ws_ctx, metrics, strlen(metrics));
+        weblog(200, wsthread_handler_id, 1, origip, ip, user, 1, origpath, strlen(buf) + strlen(metrics));
+
+        free(metrics);
+
+        handler_msg("Sent metrics to API caller\n");
+        ret = 1;
+    } else entry("/api/trace") {
+        uint8_t enable;
+
+        param = parse_get(args, "action", &len);
+        if (len == 5 && !strncmp(param, "start", len)) {
+            enable = 1;
+        } else if (len == 4 && !strncmp(param, "stop", len)) {
+            enable = 0;
+        } else {
+            handler_msg("action param must be start or stop\n");
+            goto nope;
+        }
+
+        settings.setTracingCb(settings.messager, enable);
+
+        sprintf(buf, "HTTP/1.1 200 OK\r\n"
+                 "Server: KasmVNC/4.0\r\n"
+                 "Connection: close\r\n"
+                 "Content-type: text/plain\r\n"
+                 "Content-length: 6\r\n"
+                 "%s"
+                 "\r\n"
+                 "200 OK", extra_headers ? extra_headers : "");
+        ws_send(ws_ctx, buf, strlen(buf));
+        weblog(200, wsthread_handler_id, 0, origip, ip, user, 1, origpath, strlen(buf));
+
+        handler_msg("Pipeline tracing %s by API caller\n", enable ? "started" : "stopped");
+        ret = 1;
+    } else entry("/api/get_trace") {
+        char *trace;
+        settings.getTraceCb(settings.messager, &trace);
+
+        sprintf(buf, "HTTP/1.1 200 OK\r\n"
+                 "Server: KasmVNC/4.0\r\n"
+                 "Connection: close\r\n"
+                 "Content-type: application/json\r\n"
+                 "Content-length: %lu\r\n"
+                 "%s"
+                 "\r\n", strlen(trace), extra_headers ? extra_headers : "");
+        ws_send(ws_ctx, buf, strlen(buf));
+        ws_send(ws_ctx, trace, strlen(trace));
+        weblog(200, wsthread_handler_id, 1, origip, ip, user, 1, origpath, strlen(buf) + strlen(trace));
+
+        free(trace);
+
+        handler_msg("Sent pipeline trace to API caller\n");
+        ret = 1;
     } else entry("/api/get_frame_stats") {
         char statbuf[4096], decname[1024];
         unsigned waitfor;
@@ -82,9 +82,13 @@ typedef struct {
     const char *httpdir;
 
     void *messager;
+    // Returns a malloc'd buffer, to be freed by the caller
     uint8_t *(*screenshotCb)(void *messager, uint16_t w, uint16_t h, const uint8_t q,
-                             const uint8_t dedup,
-                             uint32_t *len, uint8_t *staging);
+                             const uint8_t dedup, const uint8_t format,
+                             uint32_t *len);
+    // Blocks until the screen differs from the given generation or timeout
+    uint32_t (*waitScreenChangeCb)(void *messager, const uint32_t generation,
+                                   const unsigned timeoutMs);
     uint8_t (*adduserCb)(void *messager, const char name[], const char pw[],
                           const uint8_t read, const uint8_t write, const uint8_t owner);
     uint8_t (*removeCb)(void *messager, const char name[]);
@@ -110,6 +114,9 @@ typedef struct {
     void (*clearClipboardCb)(void *messager);
 
     void (*getSessionsCb)(void *messager, char **buf);
+    void (*metricsCb)(void *messager, char **buf);
+    void (*setTracingCb)(void *messager, const uint8_t enabled);
+    void (*getTraceCb)(void *messager, char **buf);
 } settings_t;
 
 #ifdef __cplusplus
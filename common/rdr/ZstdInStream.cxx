@@ -0,0 +1,120 @@
+/* Copyright (C) 2026 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <rdr/ZstdInStream.h>
+#include <rdr/Exception.h>
+
+#ifdef HAVE_ZSTD
+
+#include <zstd.h>
+
+using namespace rdr;
+
+ZstdInStream::ZstdInStream()
+  : underlying(0), bytesIn(0)
+{
+  dctx = ZSTD_createDCtx();
+  if (dctx == NULL)
+    throw Exception("ZstdInStream: ZSTD_createDCtx failed");
+}
+
+ZstdInStream::~ZstdInStream()
+{
+  ZSTD_freeDCtx(dctx);
+}
+
+void ZstdInStream::setUnderlying(InStream* is, size_t bytesIn_)
+{
+  underlying = is;
+  bytesIn = bytesIn_;
+  skip(avail());
+}
+
+void ZstdInStream::flushUnderlying()
+{
+  // The tail of a flushed block can be input that gives no output, so
+  // keep going until every byte of the rect has been fed to the decoder
+  while (bytesIn > 0) {
+    check(1);
+    skip(avail());
+  }
+
+  setUnderlying(NULL, 0);
+}
+
+void ZstdInStream::reset()
+{
+  size_t rc;
+
+  setUnderlying(NULL, 0);
+
+  rc = ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+  if (ZSTD_isError(rc))
+    throw Exception("ZstdInStream: ZSTD_DCtx_reset failed: %s",
+                    ZSTD_getErrorName(rc));
+}
+
+bool ZstdInStream::fillBuffer(size_t maxSize, bool wait)
+{
+  ZSTD_inBuffer in;
+  ZSTD_outBuffer out;
+  size_t rc;
+
+  if (!underlying)
+    throw Exception("ZstdInStream overrun: no underlying stream");
+
+  // The decoder can hold on to output after it has eaten all of the
+  // input, so keep draining it even when there is nothing left to feed
+  in.src = NULL;
+  in.size = 0;
+  in.pos = 0;
+
+  if (bytesIn > 0) {
+    size_t n = underlying->check(1, wait);
+    if (n == 0) return false;
+
+    in.src = underlying->getptr();
+    in.size = underlying->avail();
+    if (in.size > bytesIn)
+      in.size = bytesIn;
+  }
+
+  out.dst = (U8*)end;
+  out.size = maxSize;
+  out.pos = 0;
+
+  rc = ZSTD_decompressStream(dctx, &out, &in);
+  if (ZSTD_isError(rc))
+    throw Exception("ZstdInStream: ZSTD_decompressStream failed: %s",
+                    ZSTD_getErrorName(rc));
+
+  if ((in.pos == 0) && (out.pos == 0))
+    throw Exception("ZstdInStream: compressed data ended early");
+
+  bytesIn -= in.pos;
+  end += out.pos;
+  if (in.pos)
+    underlying->setptr(underlying->getptr() + in.pos);
+  return true;
+}
+
+#endif
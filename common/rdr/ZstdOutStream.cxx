@@ -0,0 +1,147 @@
+/* Copyright (C) 2026 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <rdr/ZstdOutStream.h>
+#include <rdr/Exception.h>
+
+#ifdef HAVE_ZSTD
+
+#include <zstd.h>
+
+using namespace rdr;
+
+enum { DEFAULT_BUF_SIZE = 16384 };
+
+ZstdOutStream::ZstdOutStream(OutStream* os, int compressLevel)
+  : underlying(os), compressionLevel(0), bufSize(DEFAULT_BUF_SIZE), offset(0)
+{
+  cctx = ZSTD_createCCtx();
+  if (cctx == NULL)
+    throw Exception("ZstdOutStream: ZSTD_createCCtx failed");
+
+  setCompressionLevel(compressLevel);
+
+  ptr = start = new U8[bufSize];
+  end = start + bufSize;
+}
+
+ZstdOutStream::~ZstdOutStream()
+{
+  try {
+    flush();
+  } catch (Exception&) {
+  }
+  delete [] start;
+  ZSTD_freeCCtx(cctx);
+}
+
+void ZstdOutStream::setUnderlying(OutStream* os)
+{
+  underlying = os;
+}
+
+void ZstdOutStream::setCompressionLevel(int level)
+{
+  size_t rc;
+
+  if (level == compressionLevel)
+    return;
+
+  // zstd allows the level to change in the middle of a frame
+  rc = ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+  if (ZSTD_isError(rc))
+    throw Exception("ZstdOutStream: ZSTD_CCtx_setParameter failed: %s",
+                    ZSTD_getErrorName(rc));
+
+  compressionLevel = level;
+}
+
+size_t ZstdOutStream::length()
+{
+  return offset + ptr - start;
+}
+
+void ZstdOutStream::flush()
+{
+  // Force out everything from the zstd encoder
+  compress(true);
+
+  offset += ptr - start;
+  ptr = start;
+}
+
+void ZstdOutStream::reset()
+{
+  size_t rc;
+
+  rc = ZSTD_CCtx_reset(cctx, ZSTD_reset_session_only);
+  if (ZSTD_isError(rc))
+    throw Exception("ZstdOutStream: ZSTD_CCtx_reset failed: %s",
+                    ZSTD_getErrorName(rc));
+}
+
+void ZstdOutStream::overrun(size_t needed)
+{
+  if (needed > bufSize)
+    throw Exception("ZstdOutStream overrun: buffer size exceeded");
+
+  // zstd always takes all of the input, so one round is enough
+  compress(false);
+
+  offset += ptr - start;
+  ptr = start;
+}
+
+void ZstdOutStream::compress(bool flush)
+{
+  ZSTD_inBuffer in;
+  size_t rc;
+
+  if (!underlying)
+    throw Exception("ZstdOutStream: underlying OutStream has not been set");
+
+  in.src = start;
+  in.size = ptr - start;
+  in.pos = 0;
+
+  if (!flush && (in.size == 0))
+    return;
+
+  do {
+    ZSTD_outBuffer out;
+
+    underlying->check(1);
+    out.dst = underlying->getptr();
+    out.size = underlying->avail();
+    out.pos = 0;
+
+    rc = ZSTD_compressStream2(cctx, &out, &in,
+                              flush ? ZSTD_e_flush : ZSTD_e_continue);
+    if (ZSTD_isError(rc))
+      throw Exception("ZstdOutStream: ZSTD_compressStream2 failed: %s",
+                      ZSTD_getErrorName(rc));
+
+    underlying->setptr((U8*)out.dst + out.pos);
+  } while (flush ? (rc != 0) : (in.pos < in.size));
+}
+
+#endif
@@ -0,0 +1,72 @@
+/* Copyright (C) 2026 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+//
+// ZstdOutStream streams to a compressed data stream (underlying), compressing
+// with zstd on the fly. It is used like ZlibOutStream.
+//
+
+#ifndef __RDR_ZSTDOUTSTREAM_H__
+#define __RDR_ZSTDOUTSTREAM_H__
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_ZSTD
+
+#include <rdr/OutStream.h>
+
+struct ZSTD_CCtx_s;
+
+namespace rdr {
+
+  class ZstdOutStream : public OutStream {
+
+  public:
+
+    ZstdOutStream(OutStream* os=0, int compressionLevel=3);
+    virtual ~ZstdOutStream();
+
+    void setUnderlying(OutStream* os);
+    void setCompressionLevel(int level);
+    void flush();
+    size_t length();
+
+    // Starts a new zstd frame, which must be matched by a reset() of
+    // the ZstdInStream on the other end
+    void reset();
+
+  private:
+
+    virtual void overrun(size_t needed);
+    void compress(bool flush);
+
+    OutStream* underlying;
+    int compressionLevel;
+    size_t bufSize;
+    size_t offset;
+    ZSTD_CCtx_s* cctx;
+    U8* start;
+  };
+
+} // end of namespace rdr
+
+#endif
+
+#endif
@@ -345,6 +345,19 @@ void CConnection::dataRect(const Rect& r, int encoding)
   decoder.decodeRect(r, encoding, framebuffer);
 }
 
+void CConnection::cacheRect(const Rect& r, int op, rdr::U32 id)
+{
+  decoder.cacheRect(r, op, id, framebuffer);
+}
+
+void CConnection::tightZstd()
+{
+  // Tight rects still queued were sent with zlib
+  decoder.flush();
+
+  CMsgHandler::tightZstd();
+}
+
 void CConnection::serverCutText(const char* str)
 {
   hasLocalClipboard = false;
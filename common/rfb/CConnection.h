@@ -106,6 +106,8 @@ namespace rfb {
     virtual void framebufferUpdateStart();
     virtual void framebufferUpdateEnd();
     virtual void dataRect(const Rect& r, int encoding);
+    virtual void cacheRect(const Rect& r, int op, rdr::U32 id);
+    virtual void tightZstd();
 
     virtual void serverCutText(const char* str);
 
@@ -80,6 +80,11 @@ void CMsgHandler::supportsQEMUKeyEvent()
   cp.supportsQEMUKeyEvent = true;
 }
 
+void CMsgHandler::tightZstd()
+{
+  cp.tightZstd = true;
+}
+
 void CMsgHandler::framebufferUpdateStart()
 {
 }
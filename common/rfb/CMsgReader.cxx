@@ -24,6 +24,7 @@
 #include <rdr/InStream.h>
 #include <rfb/Exception.h>
 #include <rfb/util.h>
+#include <rfb/CacheRect.h>
 #include <rfb/CMsgHandler.h>
 #include <rfb/CMsgReader.h>
 
@@ -114,6 +115,12 @@ void CMsgReader::readMsg()
     case pseudoEncodingQEMUKeyEvent:
       handler->supportsQEMUKeyEvent();
       break;
+    case pseudoEncodingCacheRect:
+      readCacheRect(Rect(x, y, x+w, y+h));
+      break;
+    case pseudoEncodingTightZstd:
+      handler->tightZstd();
+      break;
     default:
       readRect(Rect(x, y, x+w, y+h), encoding);
       break;
@@ -205,6 +212,19 @@ void CMsgReader::readRect(const Rect& r, int encoding)
   handler->dataRect(r, encoding);
 }
 
+void CMsgReader::readCacheRect(const Rect& r)
+{
+  int op = is->readU8();
+  rdr::U32 id = is->readU32();
+
+  if (op != cacheRectReset &&
+      ((r.br.x > handler->cp.width) || (r.br.y > handler->cp.height) ||
+       r.is_empty()))
+    throw Exception("Cache rect outside the framebuffer");
+
+  handler->cacheRect(r, op, id);
+}
+
 void CMsgReader::readSetXCursor(int width, int height, const Point& hotspot)
 {
   if (width > maxCursorSize || height > maxCursorSize)
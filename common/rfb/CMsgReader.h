@@ -59,6 +59,7 @@ namespace rfb {
     void readFramebufferUpdate();
 
     void readRect(const Rect& r, int encoding);
+    void readCacheRect(const Rect& r);
 
     void readSetXCursor(int width, int height, const Point& hotspot);
     void readSetCursor(int width, int height, const Point& hotspot);
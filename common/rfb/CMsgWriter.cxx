@@ -89,6 +89,17 @@ void CMsgWriter::writeSetEncodings(int preferredEncoding, bool useCopyRect)
     encodings[nEncodings++] = pseudoEncodingDesktopName;
   if (cp->supportsLEDState)
     encodings[nEncodings++] = pseudoEncodingLEDState;
+  if (cp->supportsCacheRect) {
+    int level = 0;
+    while (level < pseudoEncodingCacheRectSize7 - pseudoEncodingCacheRectSize0 &&
+           ((size_t)1024 * 1024 << level) < cp->cacheRectSize)
+      level++;
+    encodings[nEncodings++] = pseudoEncodingCacheRectSize0 + level;
+  }
+  if (cp->supportsTightZstd)
+    encodings[nEncodings++] = pseudoEncodingTightZstd;
+  if (cp->supportsTightDelta)
+    encodings[nEncodings++] = pseudoEncodingTightDelta;
 
   encodings[nEncodings++] = pseudoEncodingLastRect;
   encodings[nEncodings++] = pseudoEncodingContinuousUpdates;
@@ -0,0 +1,221 @@
+/* Copyright (C) 2026 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#include <rdr/Exception.h>
+#include <rfb/CacheRect.h>
+#include <rfb/PixelBuffer.h>
+
+using namespace rfb;
+
+CacheRectLRU::CacheRectLRU() : maxPixels(0), usedPixels(0)
+{
+}
+
+CacheRectLRU::~CacheRectLRU()
+{
+}
+
+void CacheRectLRU::reset(size_t pixels)
+{
+  maxPixels = pixels;
+  usedPixels = 0;
+  lru.clear();
+  entries.clear();
+}
+
+void CacheRectLRU::store(rdr::U32 id, int area)
+{
+  Entry entry;
+
+  if (area <= 0 || (size_t)area > maxPixels)
+    throw rdr::Exception("Cache rect does not fit in the cache");
+  if (entries.find(id) != entries.end())
+    throw rdr::Exception("Cache rect id already in use");
+
+  while (usedPixels + area > maxPixels) {
+    rdr::U32 victim = lru.back();
+
+    usedPixels -= entries[victim].area;
+    entries.erase(victim);
+    lru.pop_back();
+
+    evicted(victim);
+  }
+
+  lru.push_front(id);
+  entry.area = area;
+  entry.pos = lru.begin();
+  entries[id] = entry;
+  usedPixels += area;
+}
+
+bool CacheRectLRU::touch(rdr::U32 id)
+{
+  std::unordered_map<rdr::U32, Entry>::iterator it;
+
+  it = entries.find(id);
+  if (it == entries.end())
+    return false;
+
+  lru.splice(lru.begin(), lru, it->second.pos);
+
+  return true;
+}
+
+CacheRectIndex::CacheRectIndex() : nextId(0)
+{
+}
+
+void CacheRectIndex::reset(size_t pixels)
+{
+  CacheRectLRU::reset(pixels);
+  index.clear();
+  info.clear();
+}
+
+bool CacheRectIndex::lookup(uint64_t hash, int w, int h, rdr::U32 *id) const
+{
+  std::unordered_map<Key, rdr::U32, KeyHash>::const_iterator it;
+
+  it = index.find(Key{hash, w, h});
+  if (it == index.end())
+    return false;
+
+  *id = it->second;
+
+  return true;
+}
+
+rdr::U32 CacheRectIndex::insert(uint64_t hash, int w, int h)
+{
+  const Key key{hash, w, h};
+  rdr::U32 id;
+
+  id = nextId++;
+
+  store(id, w * h);
+  index[key] = id;
+  info[id] = Info{key, true};
+
+  return id;
+}
+
+bool CacheRectIndex::isLossy(rdr::U32 id) const
+{
+  std::unordered_map<rdr::U32, Info>::const_iterator it;
+
+  it = info.find(id);
+  if (it == info.end())
+    return true;
+
+  return it->second.lossy;
+}
+
+void CacheRectIndex::setLossy(rdr::U32 id, bool lossy)
+{
+  std::unordered_map<rdr::U32, Info>::iterator it;
+
+  it = info.find(id);
+  if (it != info.end())
+    it->second.lossy = lossy;
+}
+
+void CacheRectIndex::evicted(rdr::U32 id)
+{
+  std::unordered_map<rdr::U32, Info>::iterator it;
+  std::unordered_map<Key, rdr::U32, KeyHash>::iterator entry;
+
+  it = info.find(id);
+  if (it == info.end())
+    return;
+
+  // The pixels may have been stored again under a newer id
+  entry = index.find(it->second.key);
+  if (entry != index.end() && entry->second == id)
+    index.erase(entry);
+
+  info.erase(it);
+}
+
+CacheRectStore::CacheRectStore()
+{
+}
+
+CacheRectStore::~CacheRectStore()
+{
+  reset(0);
+}
+
+void CacheRectStore::reset(size_t pixels)
+{
+  std::map<rdr::U32, ManagedPixelBuffer*>::iterator it;
+
+  CacheRectLRU::reset(pixels);
+
+  for (it = tiles.begin(); it != tiles.end(); ++it)
+    delete it->second;
+  tiles.clear();
+}
+
+void CacheRectStore::store(rdr::U32 id, const Rect& r,
+                           const ModifiablePixelBuffer* pb)
+{
+  ManagedPixelBuffer *tile;
+  rdr::U8 *buffer;
+  int stride;
+
+  CacheRectLRU::store(id, r.area());
+
+  tile = new ManagedPixelBuffer(pb->getPF(), r.width(), r.height());
+  buffer = tile->getBufferRW(tile->getRect(), &stride);
+  pb->getImage(buffer, r, stride);
+  tile->commitBufferRW(tile->getRect());
+
+  tiles[id] = tile;
+}
+
+void CacheRectStore::draw(rdr::U32 id, const Rect& r,
+                          ModifiablePixelBuffer* pb)
+{
+  std::map<rdr::U32, ManagedPixelBuffer*>::iterator it;
+  const rdr::U8 *buffer;
+  int stride;
+
+  it = tiles.find(id);
+  if (it == tiles.end() || !touch(id))
+    throw rdr::Exception("Unknown cache rect id");
+
+  if (it->second->width() != r.width() ||
+      it->second->height() != r.height())
+    throw rdr::Exception("Cache rect size mismatch");
+
+  buffer = it->second->getBuffer(it->second->getRect(), &stride);
+  pb->imageRect(it->second->getPF(), r, buffer, stride);
+}
+
+void CacheRectStore::evicted(rdr::U32 id)
+{
+  std::map<rdr::U32, ManagedPixelBuffer*>::iterator it;
+
+  it = tiles.find(id);
+  if (it == tiles.end())
+    return;
+
+  delete it->second;
+  tiles.erase(it);
+}
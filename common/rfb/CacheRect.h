@@ -0,0 +1,152 @@
+/* Copyright (C) 2026 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+//
+// CacheRect - tiles kept by the client for the CacheRect pseudo-encoding.
+//
+// The server stores tiles on the client and later asks it to draw them
+// again, by id, instead of resending their pixels. Both sides run the
+// same CacheRectLRU over the same sequence of operations, so they evict
+// the same entries without having to tell each other.
+//
+
+#ifndef __RFB_CACHERECT_H__
+#define __RFB_CACHERECT_H__
+
+#include <list>
+#include <map>
+#include <unordered_map>
+
+#include <rdr/types.h>
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace rfb {
+
+  class ManagedPixelBuffer;
+  class ModifiablePixelBuffer;
+  struct Rect;
+
+  // Operations in a pseudoEncodingCacheRect rect. Each is a U8 followed
+  // by a U32 argument:
+  //  store - copy the rect's current pixels into a new entry with this id
+  //  draw  - draw the entry with this id, of the same size, into the rect
+  //  reset - drop all entries and set the size to this many pixels
+  enum CacheRectOp {
+    cacheRectStore = 0,
+    cacheRectDraw = 1,
+    cacheRectReset = 2,
+  };
+
+  // Smaller tiles are cheaper to send than to track
+  static const int cacheRectMinArea = 64 * 64;
+
+  class CacheRectLRU {
+  public:
+    CacheRectLRU();
+    virtual ~CacheRectLRU();
+
+    // Drops all entries and sets the size limit in pixels
+    void reset(size_t pixels);
+    size_t limit() const { return maxPixels; }
+
+    // Evicts the least recently used entries until the new one fits
+    void store(rdr::U32 id, int area);
+    // Marks an entry as most recently used, false if it isn't there
+    bool touch(rdr::U32 id);
+
+  protected:
+    virtual void evicted(rdr::U32 id) {}
+
+  private:
+    struct Entry {
+      size_t area;
+      std::list<rdr::U32>::iterator pos;
+    };
+
+    size_t maxPixels, usedPixels;
+    std::list<rdr::U32> lru; // Most recently used first
+    std::unordered_map<rdr::U32, Entry> entries;
+  };
+
+  // Server side, finds the entry that holds given pixels
+  class CacheRectIndex : public CacheRectLRU {
+  public:
+    CacheRectIndex();
+
+    void reset(size_t pixels);
+
+    // Returns true and the entry's id if these pixels are stored. Call
+    // touch() only if the entry is then drawn.
+    bool lookup(uint64_t hash, int w, int h, rdr::U32 *id) const;
+    // Adds an entry for these pixels, replacing any older one, and
+    // returns its id
+    rdr::U32 insert(uint64_t hash, int w, int h);
+
+    // Whether an entry was stored from lossy pixels
+    bool isLossy(rdr::U32 id) const;
+    void setLossy(rdr::U32 id, bool lossy);
+
+  protected:
+    void evicted(rdr::U32 id) override;
+
+  private:
+    struct Key {
+      uint64_t hash;
+      int w, h;
+
+      bool operator ==(const Key &other) const {
+        return hash == other.hash && w == other.w && h == other.h;
+      }
+    };
+
+    struct KeyHash {
+      size_t operator ()(const Key &key) const { return key.hash; }
+    };
+
+    struct Info {
+      Key key;
+      bool lossy;
+    };
+
+    rdr::U32 nextId;
+    std::unordered_map<Key, rdr::U32, KeyHash> index;
+    std::unordered_map<rdr::U32, Info> info;
+  };
+
+  // Client side, holds the pixels of each entry
+  class CacheRectStore : public CacheRectLRU {
+  public:
+    CacheRectStore();
+    ~CacheRectStore();
+
+    void reset(size_t pixels);
+
+    void store(rdr::U32 id, const Rect& r, const ModifiablePixelBuffer* pb);
+    void draw(rdr::U32 id, const Rect& r, ModifiablePixelBuffer* pb);
+
+  protected:
+    void evicted(rdr::U32 id) override;
+
+  private:
+    std::map<rdr::U32, ManagedPixelBuffer*> tiles;
+  };
+}
+
+#endif
@@ -670,11 +670,15 @@ public:
 	}
 };
 
-ComparingUpdateTracker::ComparingUpdateTracker(PixelBuffer* buffer)
-  : fb(buffer), oldFb(fb->getPF(), 0, 0), firstCompare(true),
-    enabled(true), detectScroll(false), totalPixels(0), missedPixels(0),
-    scrollHasher(NULL)
+ComparingUpdateTracker::ComparingUpdateTracker(PixelBuffer* buffer,
+                                               FrameStore* store_)
+  : fb(buffer), store(store_), ownStore(store_ == NULL), firstCompare(true),
+    enabled(true), alwaysSync(false), detectScroll(false), totalPixels(0),
+    missedPixels(0), scrollHasher(NULL)
 {
+    if (ownStore)
+      store = new FrameStore();
+
     changed.assign_union(fb->getRect());
     if (Server::detectHorizontal)
       scrollHasher = new scrollHasher_bothDir_t;
@@ -685,6 +689,8 @@ ComparingUpdateTracker::ComparingUpdateTracker(PixelBuffer* buffer)
 ComparingUpdateTracker::~ComparingUpdateTracker()
 {
     delete scrollHasher;
+    if (ownStore)
+      delete store;
 }
 
 
@@ -697,12 +703,17 @@ bool ComparingUpdateTracker::compare(bool skipScrollDetection, const Region &ski
 
   changedPerc = 100;
 
-  if (!enabled)
+  if (!enabled && !alwaysSync)
     return false;
 
+  FrameStore::WriteLock lock(store);
+
   if (firstCompare) {
     // NB: We leave the change region untouched on this iteration,
     // since in effect the entire framebuffer has changed.
+    ManagedPixelBuffer &oldFb = lock.buffer();
+    if (!oldFb.getPF().equal(fb->getPF()))
+      oldFb.setPF(fb->getPF());
     oldFb.setSize(fb->width(), fb->height());
 
     for (int y=0; y<fb->height(); y+=BLOCK_SIZE) {
@@ -713,10 +724,43 @@ bool ComparingUpdateTracker::compare(bool skipScrollDetection, const Region &ski
     }
 
     firstCompare = false;
+    lock.publish();
 
     return false;
   }
 
+  if (!enabled) {
+    // Just mirror the changes so the store stays current
+    ManagedPixelBuffer &oldFb = lock.buffer();
+
+    copied.get_rects(&rects, copy_delta.x<=0, copy_delta.y<=0);
+    for (i = rects.begin(); i != rects.end(); i++)
+      oldFb.copyRect(*i, copy_delta);
+
+    changed.get_rects(&rects);
+    for (i = rects.begin(); i != rects.end(); i++) {
+      const Rect r = i->intersect(fb->getRect());
+      if (r.is_empty())
+        continue;
+      int srcStride;
+      const rdr::U8* srcData = fb->getBuffer(r, &srcStride);
+      oldFb.imageRect(r, srcData, srcStride);
+    }
+
+    if (!changed.is_empty() || !copied.is_empty())
+      lock.publish();
+
+    return false;
+  }
+
+  if (changed.is_empty() && copied.is_empty()) {
+    // Leave the store alone, so borrowed snapshots stay valid
+    changedPerc = 0;
+    return false;
+  }
+
+  ManagedPixelBuffer &oldFb = lock.buffer();
+
   copied.get_rects(&rects, copy_delta.x<=0, copy_delta.y<=0);
   for (i = rects.begin(); i != rects.end(); i++)
     oldFb.copyRect(*i, copy_delta);
@@ -745,7 +789,7 @@ bool ComparingUpdateTracker::compare(bool skipScrollDetection, const Region &ski
 
   Region newChanged;
   for (i = rects.begin(); i != rects.end(); i++)
-    compareRect(*i, &newChanged, skipCursorArea);
+    compareRect(*i, &newChanged, skipCursorArea, oldFb);
 
   changed.get_rects(&rects);
   for (i = rects.begin(); i != rects.end(); i++)
@@ -759,6 +803,9 @@ bool ComparingUpdateTracker::compare(bool skipScrollDetection, const Region &ski
 
   changedPerc = newchangedarea * 100 / fb->area();
 
+  if (!newChanged.is_empty() || !copied.is_empty() || !copyPassRects.empty())
+    lock.publish();
+
   if (changed.equals(newChanged))
     return false;
 
@@ -777,7 +824,17 @@ void ComparingUpdateTracker::disable()
   enabled = false;
 
   // Make sure we update the framebuffer next time we get enabled
-  firstCompare = true;
+  if (!alwaysSync)
+    firstCompare = true;
+}
+
+void ComparingUpdateTracker::setAlwaysSync(bool sync)
+{
+  alwaysSync = sync;
+
+  // Nobody keeps the store current from here on
+  if (!alwaysSync && !enabled)
+    firstCompare = true;
 }
 
 static void tryMerge(std::vector<CopyPassRect> &copyPassRects,
@@ -821,7 +878,8 @@ static void tryMerge(std::vector<CopyPassRect> &copyPassRects,
 }
 
 void ComparingUpdateTracker::compareRect(const Rect& inr, Region* newChanged,
-                                         const Region &skipCursorArea)
+                                         const Region &skipCursorArea,
+                                         ManagedPixelBuffer &oldFb)
 {
     Rect r = inr;
     if (detectScroll && !Server::detectHorizontal)
@@ -832,7 +890,7 @@ void ComparingUpdateTracker::compareRect(const Rect& inr, Region* newChanged,
     // Crop the rect and try again
     safe = r.intersect(fb->getRect());
     if (!safe.is_empty())
-      compareRect(safe, newChanged, skipCursorArea);
+      compareRect(safe, newChanged, skipCursorArea, oldFb);
     return;
   }
 
@@ -19,6 +19,7 @@
 #ifndef __RFB_COMPARINGUPDATETRACKER_H__
 #define __RFB_COMPARINGUPDATETRACKER_H__
 
+#include <rfb/FrameStore.h>
 #include <rfb/UpdateTracker.h>
 
 class scrollHasher_t;
@@ -27,7 +28,9 @@ namespace rfb {
 
   class ComparingUpdateTracker : public SimpleUpdateTracker {
   public:
-    ComparingUpdateTracker(PixelBuffer* buffer);
+    // The previous frame is kept in store, which others may borrow
+    // snapshots from. A private one is used if none is given.
+    ComparingUpdateTracker(PixelBuffer* buffer, FrameStore* store_=NULL);
     ~ComparingUpdateTracker();
 
     // compare() does the comparison and reduces its changed and copied regions
@@ -43,6 +46,10 @@ namespace rfb {
     virtual void enable();
     virtual void disable();
 
+    // Keep the store current even while comparison is disabled, for
+    // when something else reads it
+    void setAlwaysSync(bool sync);
+
     void logStats();
 
     virtual void getUpdateInfo(UpdateInfo* info, const Region& cliprgn);
@@ -51,11 +58,14 @@ namespace rfb {
     rdr::U8 changedPerc;
 
   private:
-    void compareRect(const Rect& r, Region* newchanged, const Region &skipCursorArea);
+    void compareRect(const Rect& r, Region* newchanged, const Region &skipCursorArea,
+                     ManagedPixelBuffer &oldFb);
     PixelBuffer* fb;
-    ManagedPixelBuffer oldFb;
+    FrameStore* store;
+    bool ownStore;
     bool firstCompare;
     bool enabled;
+    bool alwaysSync;
     bool detectScroll;
 
     rdr::U32 totalPixels, missedPixels;
@@ -56,13 +56,15 @@ ConnParams::ConnParams()
     supportsDesktopResize(false), supportsExtendedDesktopSize(false),
     supportsDesktopRename(false), supportsLastRect(false),
     supportsLEDState(false), supportsQEMUKeyEvent(false),
-    supportsWEBP(false), supportsQOI(false),
+    supportsWEBP(false), supportsQOI(false), supportsCacheRect(false),
+    supportsTightZstd(false), supportsTightDelta(false),
     supportsSetDesktopSize(false), supportsFence(false),
     supportsContinuousUpdates(false), supportsExtendedClipboard(false),
     supportsDisconnectNotify(false),
-    supportsUdp(false),
+    supportsUdp(false), tightZstd(false),
     compressLevel(2), qualityLevel(-1), fineQualityLevel(-1),
-    subsampling(subsampleUndefined), name_(0), cursorPos_(0, 0), verStrPos(0),
+    subsampling(subsampleUndefined), cacheRectSize(0),
+    name_(0), cursorPos_(0, 0), verStrPos(0),
     ledState_(ledUnknown), shandler(NULL)
 {
   memset(kasmPassed, 0, KASM_NUM_SETTINGS);
@@ -148,6 +150,9 @@ void ConnParams::setEncodings(int nEncodings, const rdr::S32* encodings)
   supportsQEMUKeyEvent = false;
   supportsWEBP = false;
   supportsQOI = false;
+  supportsCacheRect = false;
+  supportsTightZstd = false;
+  supportsTightDelta = false;
   supportsDisconnectNotify = false;
   compressLevel = -1;
   qualityLevel = -1;
@@ -217,6 +222,14 @@ void ConnParams::setEncodings(int nEncodings, const rdr::S32* encodings)
       supportsQOI = true;
       clientparlog("qoi", true);
       break;
+    case pseudoEncodingTightZstd:
+      supportsTightZstd = true;
+      clientparlog("tightZstd", true);
+      break;
+    case pseudoEncodingTightDelta:
+      supportsTightDelta = true;
+      clientparlog("tightDelta", true);
+      break;
     case pseudoEncodingKasmDisconnectNotify:
       supportsDisconnectNotify = true;
       clientparlog("disconnectNotify", true);
@@ -277,6 +290,13 @@ void ConnParams::setEncodings(int nEncodings, const rdr::S32* encodings)
       clientparlog("qualityLevel", qualityLevel, true);
     }
 
+    if (encodings[i] >= pseudoEncodingCacheRectSize0 &&
+        encodings[i] <= pseudoEncodingCacheRectSize7) {
+      supportsCacheRect = true;
+      cacheRectSize = (size_t)1024 * 1024 << (encodings[i] - pseudoEncodingCacheRectSize0);
+      clientparlog("cacheRectSize", encodings[i] - pseudoEncodingCacheRectSize0, true);
+    }
+
     if (encodings[i] >= pseudoEncodingFineQualityLevel0 &&
         encodings[i] <= pseudoEncodingFineQualityLevel100) {
       fineQualityLevel = encodings[i] - pseudoEncodingFineQualityLevel0;
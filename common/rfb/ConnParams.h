@@ -112,6 +112,9 @@ namespace rfb {
     bool supportsQEMUKeyEvent;
     bool supportsWEBP;
     bool supportsQOI;
+    bool supportsCacheRect;
+    bool supportsTightZstd;
+    bool supportsTightDelta;
 
     bool supportsSetDesktopSize;
     bool supportsFence;
@@ -121,10 +124,14 @@ namespace rfb {
 
     bool supportsUdp;
 
+    // Tight uses zstd rather than zlib, see pseudoEncodingTightZstd
+    bool tightZstd;
+
     int compressLevel;
     int qualityLevel;
     int fineQualityLevel;
     int subsampling;
+    size_t cacheRectSize; // pixels
 
     // kasm exposed settings, skippable with -IgnoreClientSettingsKasm
     enum {
@@ -0,0 +1,233 @@
+/* Copyright (C) 2026 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <tbb/parallel_for.h>
+
+#include <rfb/ContentMap.h>
+#include <rfb/PixelBuffer.h>
+
+using namespace rfb;
+
+// Brightness steps between neighbours up to this are smooth shading,
+// from EdgeStep up they are the edge of a glyph or a line
+static const int SmoothStep = 6;
+static const int EdgeStep = 64;
+
+// Tiles are converted to this before looking at them
+static const PixelFormat analysePF(32, 24, false, true,
+                                   255, 255, 255, 16, 8, 0);
+
+const char *rfb::contentClassName(ContentClass content)
+{
+  switch (content) {
+  case contentUnknown:
+    return "Unknown";
+  case contentText:
+    return "Text";
+  case contentGradient:
+    return "Gradient";
+  case contentPhoto:
+    return "Photo";
+  case contentClassMax:
+    break;
+  }
+
+  return "Unknown Content Class";
+}
+
+ContentMap::ContentMap()
+  : width_(0), height_(0), tilesX(0), tilesY(0)
+{
+}
+
+void ContentMap::resize(int width, int height)
+{
+  width_ = width;
+  height_ = height;
+  tilesX = (width + tileSize - 1) >> tileShift;
+  tilesY = (height + tileSize - 1) >> tileShift;
+
+  classes.assign((size_t)tilesX * tilesY, contentUnknown);
+  marked.assign((size_t)tilesX * tilesY, 0);
+}
+
+void ContentMap::update(const Region& changed, const PixelBuffer* pb)
+{
+  dirty.clear();
+
+  changed.get_rects(&rects);
+  for (const Rect& r : rects) {
+    const Rect clipped = r.intersect(Rect(0, 0, width_, height_));
+    if (clipped.is_empty())
+      continue;
+
+    const int tx2 = ((clipped.br.x - 1) >> tileShift) + 1;
+    const int ty2 = ((clipped.br.y - 1) >> tileShift) + 1;
+
+    for (int ty = clipped.tl.y >> tileShift; ty < ty2; ty++) {
+      for (int tx = clipped.tl.x >> tileShift; tx < tx2; tx++) {
+        const int idx = ty * tilesX + tx;
+        if (!marked[idx]) {
+          marked[idx] = 1;
+          dirty.push_back(idx);
+        }
+      }
+    }
+  }
+
+  // Every tile is written by a single task
+  tbb::parallel_for(static_cast<size_t>(0), dirty.size(), [&](size_t i) {
+      const int idx = dirty[i];
+      const int x = (idx % tilesX) << tileShift;
+      const int y = (idx / tilesX) << tileShift;
+      const Rect tile = Rect(x, y, x + tileSize, y + tileSize)
+                          .intersect(Rect(0, 0, width_, height_));
+      ContentFeatures features;
+
+      analyse(pb, tile, &features);
+      classes[idx] = classify(features);
+      marked[idx] = 0;
+  });
+}
+
+ContentClass ContentMap::getClass(const Rect& r) const
+{
+  unsigned counts[contentClassMax];
+  int best;
+
+  const Rect clipped = r.intersect(Rect(0, 0, width_, height_));
+  if (clipped.is_empty())
+    return contentUnknown;
+
+  memset(counts, 0, sizeof(counts));
+
+  const int tx2 = ((clipped.br.x - 1) >> tileShift) + 1;
+  const int ty2 = ((clipped.br.y - 1) >> tileShift) + 1;
+
+  for (int ty = clipped.tl.y >> tileShift; ty < ty2; ty++) {
+    const uint8_t *row = &classes[(size_t)ty * tilesX];
+    for (int tx = clipped.tl.x >> tileShift; tx < tx2; tx++)
+      counts[row[tx]]++;
+  }
+
+  best = contentUnknown;
+  for (int i = contentUnknown + 1; i < contentClassMax; i++) {
+    if (counts[i] > counts[best])
+      best = i;
+  }
+
+  return (ContentClass) best;
+}
+
+void ContentMap::analyse(const PixelBuffer* pb, const Rect& r,
+                         ContentFeatures* features)
+{
+  rdr::U32 pixels[tileSize * tileSize];
+  rdr::U8 luma[tileSize * tileSize];
+  rdr::U32 seen[512];
+  unsigned pairs, flat, smooth, edges;
+
+  const int w = r.width() < tileSize ? r.width() : tileSize;
+  const int h = r.height() < tileSize ? r.height() : tileSize;
+
+  memset(features, 0, sizeof(*features));
+  if (w <= 0 || h <= 0)
+    return;
+
+  pb->getImage(analysePF, pixels, Rect(r.tl.x, r.tl.y, r.tl.x + w, r.tl.y + h));
+
+  // Count colours in a small hash set, the top byte is never used by
+  // the pixel format so it marks the empty slots
+  memset(seen, 0xff, sizeof(seen));
+
+  for (int i = 0; i < w * h; i++) {
+    const rdr::U32 p = pixels[i] & 0xffffff;
+
+    luma[i] = (((p >> 16) & 0xff) * 2 + ((p >> 8) & 0xff) * 5 +
+               (p & 0xff)) >> 3;
+
+    if (features->colours > 256)
+      continue;
+
+    unsigned slot = (p * 2654435761U) >> 23;
+    while (seen[slot] != 0xffffffff && seen[slot] != p)
+      slot = (slot + 1) & 511;
+    if (seen[slot] == 0xffffffff) {
+      seen[slot] = p;
+      features->colours++;
+    }
+  }
+
+  pairs = flat = smooth = edges = 0;
+
+  for (int y = 0; y < h; y++) {
+    const rdr::U8 *row = &luma[y * w];
+    for (int x = 0; x < w; x++) {
+      int d[2], n;
+
+      n = 0;
+      if (x + 1 < w)
+        d[n++] = abs(row[x + 1] - row[x]);
+      if (y + 1 < h)
+        d[n++] = abs(row[x + w] - row[x]);
+
+      for (int i = 0; i < n; i++) {
+        if (d[i] == 0)
+          flat++;
+        else if (d[i] <= SmoothStep)
+          smooth++;
+        else if (d[i] >= EdgeStep)
+          edges++;
+      }
+      pairs += n;
+    }
+  }
+
+  if (pairs == 0)
+    return;
+
+  features->flat = (double)flat / pairs;
+  features->smooth = (double)smooth / pairs;
+  features->edges = (double)edges / pairs;
+  features->medium = 1.0 - features->flat - features->smooth -
+                     features->edges;
+}
+
+ContentClass ContentMap::classify(const ContentFeatures& f)
+{
+  if (f.colours <= 1)
+    return contentUnknown;
+
+  // Glyphs and lines: a mostly flat background crossed by sharp edges
+  if (f.flat >= 0.5 && f.edges >= 0.02)
+    return contentText;
+
+  // Shading: many colours but nowhere a big step
+  if (f.colours > 16 && f.edges < 0.005 && f.medium < 0.05 &&
+      f.smooth >= 0.05)
+    return contentGradient;
+
+  // Natural images vary everywhere, and by more than a shade
+  if (f.flat < 0.5 && f.medium >= 0.2)
+    return contentPhoto;
+
+  return contentUnknown;
+}
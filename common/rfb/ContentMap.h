@@ -0,0 +1,91 @@
+/* Copyright (C) 2026 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+//
+// ContentMap - sorts the screen into 64x64 tiles of text, gradients and
+// photos using a few cheap pixel statistics, so each tile can be sent
+// with the encoder that suits it. Only changed tiles are reclassified,
+// the others keep their last result.
+//
+
+#ifndef __RFB_CONTENTMAP_H__
+#define __RFB_CONTENTMAP_H__
+
+#include <stdint.h>
+
+#include <vector>
+
+#include <rfb/Region.h>
+
+namespace rfb {
+
+  class PixelBuffer;
+
+  enum ContentClass {
+    contentUnknown,  // Not classified, flat or mixed
+    contentText,     // Sharp edges on a flat background: text, UI
+    contentGradient, // Smooth shading
+    contentPhoto,    // Natural images, video
+    contentClassMax,
+  };
+
+  const char *contentClassName(ContentClass content);
+
+  struct ContentFeatures {
+    unsigned colours; // Distinct colours, stops counting past 256
+    // Share of neighbouring pixel pairs whose brightness is equal,
+    // differs slightly, differs sharply, or anything in between
+    double flat, smooth, edges, medium;
+  };
+
+  class ContentMap {
+  public:
+    static const int tileShift = 6;
+    static const int tileSize = 1 << tileShift;
+
+    ContentMap();
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+
+    // Sets the screen size and forgets all tiles
+    void resize(int width, int height);
+
+    // Reclassifies the tiles touched by changed, in parallel
+    void update(const Region& changed, const PixelBuffer* pb);
+
+    // The most common class among the tiles r covers
+    ContentClass getClass(const Rect& r) const;
+
+    static void analyse(const PixelBuffer* pb, const Rect& r,
+                        ContentFeatures* features);
+    static ContentClass classify(const ContentFeatures& features);
+
+  private:
+    int width_, height_;
+    int tilesX, tilesY;
+    std::vector<uint8_t> classes;
+
+    std::vector<uint8_t> marked;
+    std::vector<int> dirty;
+    std::vector<Rect> rects;
+  };
+
+}
+
+#endif
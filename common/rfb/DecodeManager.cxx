@@ -199,6 +199,51 @@ void DecodeManager::flush()
   throwThreadException();
 }
 
+void DecodeManager::cacheRect(const Rect& r, int op, rdr::U32 id,
+                              ModifiablePixelBuffer* pb)
+{
+  assert(pb != NULL);
+
+  // Rects before this one that touch the same pixels must be done
+  queueMutex->lock();
+
+  while (queueAffects(r))
+    producerCond->wait();
+
+  queueMutex->unlock();
+
+  throwThreadException();
+
+  switch (op) {
+  case cacheRectStore:
+    cache.store(id, r, pb);
+    break;
+  case cacheRectDraw:
+    cache.draw(id, r, pb);
+    break;
+  case cacheRectReset:
+    if (id > conn->cp.cacheRectSize)
+      throw rdr::Exception("Cache rect size larger than requested");
+    cache.reset(id);
+    break;
+  default:
+    vlog.error("Unknown cache rect operation %d", op);
+    throw rdr::Exception("Unknown cache rect operation");
+  }
+}
+
+bool DecodeManager::queueAffects(const Rect& r)
+{
+  std::list<QueueEntry*>::iterator iter;
+
+  for (iter = workQueue.begin(); iter != workQueue.end(); ++iter) {
+    if (!(*iter)->affectedRegion.intersect(r).is_empty())
+      return true;
+  }
+
+  return false;
+}
+
 void DecodeManager::setThreadException(const rdr::Exception& e)
 {
   os::AutoMutex a(queueMutex);
@@ -23,6 +23,7 @@
 
 #include <os/Thread.h>
 
+#include <rfb/CacheRect.h>
 #include <rfb/Region.h>
 #include <rfb/encodings.h>
 
@@ -49,6 +50,8 @@ namespace rfb {
 
     void decodeRect(const Rect& r, int encoding,
                     ModifiablePixelBuffer* pb);
+    void cacheRect(const Rect& r, int op, rdr::U32 id,
+                   ModifiablePixelBuffer* pb);
 
     void flush();
 
@@ -56,9 +59,12 @@ namespace rfb {
     void setThreadException(const rdr::Exception& e);
     void throwThreadException();
 
+    bool queueAffects(const Rect& r);
+
   private:
     CConnection *conn;
     Decoder *decoders[encodingMax+1];
+    CacheRectStore cache;
 
     struct QueueEntry {
       bool active;
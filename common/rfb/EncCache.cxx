@@ -19,54 +19,101 @@
  * USA.
  */
 #include <rfb/EncCache.h>
+#include <rfb/Metrics.h>
+#include <rfb/PixelBuffer.h>
+#include <rfb/xxhash.h>
 
 using namespace rfb;
 
-EncCache::EncCache() {
-  enabled = false;
+EncCache::EncCache() : limit(0), used(0) {
 }
 
 EncCache::~EncCache() {
 }
 
+uint64_t EncCache::hashRect(const PixelBuffer *pb, const Rect &rect) {
+  const rdr::U8 *data;
+  int stride;
+  uint64_t hash;
+  size_t lineBytes;
+  int y;
+
+  data = pb->getBuffer(rect, &stride);
+  lineBytes = rect.width() * pb->getPF().bpp / 8;
+  stride *= pb->getPF().bpp / 8;
+
+  // Each line is seeded with the previous line's hash, so the result
+  // depends on the order of the lines and not just their contents
+  hash = 0;
+  for (y = 0; y < rect.height(); y++) {
+    hash = XXH64(data, lineBytes, hash);
+    data += stride;
+  }
+
+  return hash;
+}
+
+void EncCache::setLimit(size_t bytes) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  limit = bytes;
+  evict(limit);
+}
+
 void EncCache::clear() {
-  std::map<EncId, const void *>::iterator it;
-  for (it = cache.begin(); it != cache.end(); it++)
-    free((void *) it->second);
+  std::lock_guard<std::mutex> lock(mutex);
 
-  cache.clear();
+  evict(0);
 }
 
-void EncCache::add(uint8_t type, uint16_t x, uint16_t y, uint16_t w, uint16_t h,
-                   uint32_t len, const void *data) {
+void EncCache::evict(size_t target) {
+  while (used > target && !lru.empty()) {
+    Entry &entry = lru.back();
+
+    used -= entry.data.size();
+    metrics::registry.encCacheEvictions.add();
+
+    cache.erase(entry.id);
+    lru.pop_back();
+  }
+
+  metrics::registry.encCacheBytes.set(used);
+}
+
+void EncCache::add(const EncId &id, const EncodedBuffer &data) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  // Entries larger than a quarter of the cache would push out too much
+  if (data.empty() || data.size() > limit / 4)
+    return;
+
+  // Another thread may have compressed the same pixels in parallel
+  if (cache.find(id) != cache.end())
+    return;
 
-  EncId id;
+  evict(limit - data.size());
 
-  id.type = type;
-  id.x = x;
-  id.y = y;
-  id.w = w;
-  id.h = h;
-  id.len = len;
+  lru.push_front(Entry{id, data});
+  cache[id] = lru.begin();
+  used += data.size();
 
-  cache[id] = data;
+  metrics::registry.encCacheBytes.set(used);
 }
 
-const void *EncCache::get(uint8_t type, uint16_t x, uint16_t y, uint16_t w, uint16_t h,
-                          uint32_t &len) const {
+bool EncCache::get(const EncId &id, EncodedBuffer &data) {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::unordered_map<EncId, std::list<Entry>::iterator, EncIdHash>::iterator it;
 
-  EncId id;
+  it = cache.find(id);
+  if (it == cache.end()) {
+    metrics::registry.encCacheMisses.add();
+    return false;
+  }
 
-  id.type = type;
-  id.x = x;
-  id.y = y;
-  id.w = w;
-  id.h = h;
+  lru.splice(lru.begin(), lru, it->second);
+  data = it->second->data;
 
-  std::map<EncId, const void *>::const_iterator it = cache.find(id);
-  if (it == cache.end())
-    return NULL;
+  metrics::registry.encCacheHits.add();
 
-  len = it->first.len;
-  return it->second;
+  return true;
 }
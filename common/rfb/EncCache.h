@@ -18,29 +18,47 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
  * USA.
  */
+
+//
+// EncCache - compressed full colour rects, looked up by pixel content.
+//
+// Entries are keyed by a hash of the source pixels together with the
+// encoder and the settings that affect its output, so a hit can be sent
+// at any position and to any client. The cache is shared by every
+// connection and is used from the encoder threads; all methods lock.
+// The least recently used entries are evicted to stay under the limit.
+//
+
 #ifndef __RFB_ENCCACHE_H__
 #define __RFB_ENCCACHE_H__
 
-#include <map>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 
 #include <rdr/types.h>
+#include <rfb/EncodedBuffer.h>
 
 #include <stdint.h>
 #include <stdlib.h>
 
 namespace rfb {
 
+  class PixelBuffer;
+  struct Rect;
+
   struct EncId {
+    uint64_t hash;
+    uint16_t w, h;
     uint8_t type;
-    uint16_t x, y, w, h;
-    uint32_t len;
-
-    bool operator <(const EncId &other) const {
-      return type < other.type ||
-             x < other.x ||
-             y < other.y ||
-             w < other.w ||
-             h < other.h;
+    uint8_t quality;
+    uint8_t video;
+
+    bool operator ==(const EncId &other) const {
+      return hash == other.hash && w == other.w && h == other.h &&
+             type == other.type && quality == other.quality &&
+             video == other.video;
     }
   };
 
@@ -49,16 +67,34 @@ namespace rfb {
     EncCache();
     ~EncCache();
 
-    void clear();
-    void add(uint8_t type, uint16_t x, uint16_t y, uint16_t w, uint16_t h,
-             uint32_t len, const void *data);
-    const void *get(uint8_t type, uint16_t x, uint16_t y, uint16_t w, uint16_t h,
-                    uint32_t &len) const;
+    // Hash of the given rect of pb, for use in an EncId
+    static uint64_t hashRect(const PixelBuffer *pb, const Rect &rect);
 
-    bool enabled;
+    // Changes the size limit in bytes, 0 disables the cache
+    void setLimit(size_t bytes);
+    bool enabled() const { return limit != 0; }
+
+    void clear();
+    void add(const EncId &id, const EncodedBuffer &data);
+    bool get(const EncId &id, EncodedBuffer &data);
 
   protected:
-    std::map<EncId, const void *> cache;
+    struct EncIdHash {
+      size_t operator ()(const EncId &id) const { return id.hash; }
+    };
+
+    struct Entry {
+      EncId id;
+      EncodedBuffer data;
+    };
+
+    void evict(size_t target);
+
+    size_t limit, used;
+
+    std::mutex mutex;
+    std::list<Entry> lru; // Most recently used first
+    std::unordered_map<EncId, std::list<Entry>::iterator, EncIdHash> cache;
   };
 }
 
@@ -31,6 +31,8 @@
 #include <rfb/SMsgWriter.h>
 #include <rfb/UpdateTracker.h>
 #include <rfb/LogWriter.h>
+#include <rfb/Metrics.h>
+#include <rfb/Trace.h>
 #include <rfb/Exception.h>
 #include <rfb/Watermark.h>
 
@@ -42,6 +44,7 @@
 #include <rfb/TightJPEGEncoder.h>
 #include <rfb/TightWEBPEncoder.h>
 #include <rfb/TightQOIEncoder.h>
+#include <algorithm>
 #include <execution>
 #include <tbb/parallel_for.h>
 
@@ -49,9 +52,6 @@ using namespace rfb;
 
 static LogWriter vlog("EncodeManager");
 
-// If this rect was touched this update, add this to its quality score
-#define SCORE_INCREMENT 32
-
 // Split each rectangle into smaller ones no larger than this area,
 // and no wider than this width.
 static const int SubRectMaxArea = 65536;
@@ -63,6 +63,23 @@ static const int SolidSearchBlock = 16;
 // Don't bother with blocks smaller than this
 static const int SolidBlockMinArea = 2048;
 
+// Smallest rect worth sending as a delta from what the client shows
+static const int DeltaMinArea = 1024;
+
+// How many updates in a row a rect may be put off when over the frame
+// budget, and how close to the focus point rects go first
+static const unsigned MaxDeferUpdates = 4;
+static const int FocusRadius = 128;
+
+// Text is only sent losslessly while its dynamic quality stays this
+// high, i.e. it isn't changing constantly. Gradients and photos with
+// fewer colours than this stay indexed, and dynamic quality doesn't take
+// gradients below this JPEG/WebP quality level, or the top of its range
+// if that is lower.
+static const unsigned TextStableQuality = 64;
+static const int ContentMinColours = 64;
+static const int GradientMinQuality = 8;
+
 namespace rfb {
 
 enum EncoderClass {
@@ -84,6 +101,8 @@ enum EncoderType {
   encoderIndexed,
   encoderIndexedRLE,
   encoderFullColour,
+  encoderFullColourLossless,
+  encoderDelta,
   encoderTypeMax,
 };
 
@@ -92,12 +111,6 @@ struct RectInfo {
   Palette *palette;
 };
 
-struct QualityInfo {
-  struct timeval lastUpdate{};
-  Rect rect;
-  unsigned score{};
-};
-
 };
 
 static const char *encoderClassName(EncoderClass klass)
@@ -141,6 +154,10 @@ static const char *encoderTypeName(EncoderType type)
     return "Indexed RLE";
   case encoderFullColour:
     return "Full Colour";
+  case encoderFullColourLossless:
+    return "Full Colour Lossless";
+  case encoderDelta:
+    return "Delta";
   case encoderTypeMax:
     break;
   }
@@ -148,6 +165,25 @@ static const char *encoderTypeName(EncoderType type)
   return "Unknown Encoder Type";
 }
 
+// Index into rectCost for rects sent with the given settings
+static unsigned rectCostIndex(int klass, int quality)
+{
+  if (quality < 0 || quality > 9)
+    quality = 9;
+  return klass * 10 + quality;
+}
+
+// Squared distance from p to the nearest pixel of r
+static long long distanceSq(const Rect& r, const Point& p)
+{
+  long long dx, dy;
+
+  dx = __rfbmax(__rfbmax(r.tl.x - p.x, p.x - (r.br.x - 1)), 0);
+  dy = __rfbmax(__rfbmax(r.tl.y - p.y, p.y - (r.br.y - 1)), 0);
+
+  return dx * dx + dy * dy;
+}
+
 static void updateMaxVideoRes(uint16_t *x, uint16_t *y) {
   sscanf(Server::maxVideoResolution, "%hux%hu", x, y);
   *x &= ~1;
@@ -165,7 +201,7 @@ EncodeManager::EncodeManager(SConnection* conn_, EncCache *encCache_) : conn(con
   areaCur(0), videoDetected(false), videoTimer(this),
   watermarkStats(0),
   maxEncodingTime(0), framesSinceEncPrint(0),
-  encCache(encCache_)
+  encCache(encCache_), allowLossyUpdate(false)
 {
   StatsVector::iterator iter;
 
@@ -181,6 +217,12 @@ EncodeManager::EncodeManager(SConnection* conn_, EncCache *encCache_) : conn(con
   encoders[encoderTightQOI] = new TightQOIEncoder(conn);
   encoders[encoderZRLE] = new ZRLEEncoder(conn);
 
+  for (int i = 0; i < encoderClassMax; i++)
+    metrics::registry.setEncoderName(i, encoderClassName((EncoderClass) i));
+
+  static std::atomic<uint32_t> nextTraceId{1};
+  traceId = nextTraceId.fetch_add(1, std::memory_order_relaxed);
+
   webpBenchResult = ((TightWEBPEncoder *) encoders[encoderTightWEBP])->benchmark();
   vlog.info("WEBP benchmark result: %u ms", webpBenchResult);
 
@@ -195,6 +237,9 @@ EncodeManager::EncodeManager(SConnection* conn_, EncCache *encCache_) : conn(con
 
   updateMaxVideoRes(&maxVideoX, &maxVideoY);
 
+  deferredAge.resize(MaxDeferUpdates);
+  rectCost.assign(encoderClassMax * 10, 0.0);
+
   updates = 0;
   memset(&copyStats, 0, sizeof(copyStats));
   stats.resize(encoderClassMax);
@@ -225,9 +270,6 @@ EncodeManager::~EncodeManager()
 
   for (iter = encoders.begin();iter != encoders.end();iter++)
     delete *iter;
-
-  for (std::list<QualityInfo*>::iterator it = qualityList.begin(); it != qualityList.end(); it++)
-    delete *it;
 }
 
 void EncodeManager::logStats()
@@ -361,9 +403,11 @@ void EncodeManager::doUpdate(bool allowLossy, const Region& changed_,
                              const RenderedCursor* renderedCursor)
 {
     int nRects;
-    Region changed, cursorRegion;
+    Region changed, cursorRegion, written;
     struct timeval start;
 
+    TRACE_SCOPE("encodeUpdate", traceId);
+
     updates++;
     if (conn->cp.supportsUdp)
       ((network::UdpStream *) conn->getOutStream(conn->cp.supportsUdp))->setFrameNumber(updates);
@@ -384,9 +428,30 @@ void EncodeManager::doUpdate(bool allowLossy, const Region& changed_,
     }
 
     prepareEncoders(allowLossy);
+    allowLossyUpdate = allowLossy;
 
     changed = changed_;
 
+    // Start over if what the client shows can no longer be mirrored
+    if (!useTightDelta()) {
+      deltaValid.clear();
+    } else if (!deltaRef.getPF().equal(conn->cp.pf()) ||
+               deltaRef.width() != pb->width() ||
+               deltaRef.height() != pb->height()) {
+      deltaRef.setPF(conn->cp.pf());
+      deltaRef.setSize(pb->width(), pb->height());
+      deltaValid.clear();
+    }
+    deltaInexact.clear();
+    deferred.clear();
+
+    if (qualityMap.width() != pb->width() ||
+        qualityMap.height() != pb->height())
+      qualityMap.resize(pb->width(), pb->height());
+    if (contentMap.width() != pb->width() ||
+        contentMap.height() != pb->height())
+      contentMap.resize(pb->width(), pb->height());
+
     gettimeofday(&start, NULL);
     memset(&jpegstats, 0, sizeof(codecstats_t));
     memset(&webpstats, 0, sizeof(codecstats_t));
@@ -412,15 +477,34 @@ void EncodeManager::doUpdate(bool allowLossy, const Region& changed_,
       nRects += computeNumRects(changed);
       nRects += computeNumRects(cursorRegion);
 
-      if (watermarkData)
+      if (watermarkData && watermarkDataLen && conn->sendWatermark())
           nRects++;
     }
 
     conn->writer()->writeFramebufferUpdateStart(nRects);
 
+    // The client's cache holds pixels in its old format, or was never
+    // set up, so start over
+    if (useCacheRect() &&
+        (cacheRects.limit() != conn->cp.cacheRectSize ||
+         !cacheRectPF.equal(conn->cp.pf()))) {
+      cacheRects.reset(conn->cp.cacheRectSize);
+      cacheRectPF = conn->cp.pf();
+      conn->writer()->writeCacheRect(Rect(), cacheRectReset,
+                                     conn->cp.cacheRectSize);
+    }
+
+    // Tight rects from here on use zstd, for the rest of the session
+    if (!conn->cp.tightZstd && useTightZstd()) {
+      conn->writer()->writeTightZstd();
+      conn->cp.tightZstd = true;
+    }
+
     writeCopyRects(copied, copyDelta);
     writeCopyPassRects(copypassed);
 
+    written = changed;
+
     /*
      * We start by searching for solid rects, which are then removed
      * from the changed region.
@@ -430,10 +514,13 @@ void EncodeManager::doUpdate(bool allowLossy, const Region& changed_,
 
     writeRects(changed, pb,
                &start, true);
-    if (!videoDetected) // In case detection happened between the calls
+    updateDeltaRef(written.subtract(deferred), pb);
+    if (!videoDetected) { // In case detection happened between the calls
       writeRects(cursorRegion, renderedCursor);
+      updateDeltaRef(cursorRegion, renderedCursor);
+    }
 
-    if (watermarkData && conn->sendWatermark()) {
+    if (watermarkData && watermarkDataLen && conn->sendWatermark()) {
       beforeLength = conn->getOutStream(conn->cp.supportsUdp)->length();
 
       const Rect rect(0, 0, pb->width(), pb->height());
@@ -450,7 +537,7 @@ void EncodeManager::doUpdate(bool allowLossy, const Region& changed_,
       watermarkStats += conn->getOutStream(conn->cp.supportsUdp)->length() - beforeLength;
     }
 
-    updateQualities();
+    qualityMap.decay();
 
     conn->writer()->writeFramebufferUpdateEnd();
 }
@@ -561,6 +648,9 @@ void EncodeManager::prepareEncoders(bool allowLossy)
   activeEncoders[encoderIndexed] = indexed;
   activeEncoders[encoderIndexedRLE] = indexedRLE;
   activeEncoders[encoderFullColour] = fullColour;
+  // The indexed encoders are all lossless and take any number of colours
+  activeEncoders[encoderFullColourLossless] = indexed;
+  activeEncoders[encoderDelta] = encoderTight;
 
   for (iter = activeEncoders.begin(); iter != activeEncoders.end(); ++iter) {
     Encoder *encoder;
@@ -620,6 +710,56 @@ Region EncodeManager::getLosslessRefresh(const Region& req,
   return refresh;
 }
 
+bool EncodeManager::useCacheRect() const
+{
+  // Cache operations must reach the client in order and can't be
+  // counted up front, and watermarks aren't part of the hashed pixels
+  return conn->cp.supportsCacheRect && conn->cp.supportsLastRect &&
+         !conn->cp.supportsUdp && !watermarkData;
+}
+
+bool EncodeManager::useTightZstd() const
+{
+#ifdef HAVE_ZSTD
+  // The switch is a rect of its own that must not get lost
+  return conn->cp.supportsTightZstd && conn->cp.supportsLastRect &&
+         !conn->cp.supportsUdp;
+#else
+  return false;
+#endif
+}
+
+bool EncodeManager::useTightDelta() const
+{
+  // Every rect must arrive for the mirror to stay exact, and the
+  // watermark changes what the client shows
+  return Server::tightDelta && conn->cp.supportsTightDelta &&
+         encoders[encoderTight]->isSupported() &&
+         !conn->cp.supportsUdp && !watermarkData;
+}
+
+bool EncodeManager::parallelLossless() const
+{
+  return Server::parallelLossless && arena.max_concurrency() > 1;
+}
+
+bool EncodeManager::useFrameBudget() const
+{
+  // Lossless refreshes have their own size limit, and video is sent as
+  // a whole. Rects can only be left out when they aren't counted.
+  return Server::frameBudget > 0 && allowLossyUpdate && !videoDetected &&
+         conn->cp.supportsLastRect;
+}
+
+bool EncodeManager::useContentClass() const
+{
+  // Only matters when full colour rects would otherwise be lossy, and
+  // grayscale has to stay JPEG
+  return Server::contentClassify &&
+         (encoders[activeEncoders[encoderFullColour]]->flags & EncoderLossy) &&
+         conn->cp.subsampling != subsampleGray;
+}
+
 int EncodeManager::computeNumRects(const Region& changed)
 {
   int numRects;
@@ -656,7 +796,7 @@ int EncodeManager::computeNumRects(const Region& changed)
 }
 
 Encoder *EncodeManager::startRect(const Rect& rect, int type, const bool trackQuality,
-                                  const uint8_t isWebp)
+                                  const uint8_t isWebp, const int8_t quality)
 {
   Encoder *encoder;
   int klass, equiv;
@@ -673,6 +813,9 @@ Encoder *EncodeManager::startRect(const Rect& rect, int type, const bool trackQu
   equiv = 12 + rect.area() * (conn->cp.pf().bpp/8);
   stats[klass][activeType].equivalent += equiv;
 
+  metrics::registry.encoders[klass].rects.add();
+  metrics::registry.encoders[klass].pixels.add(rect.area());
+
   encoder = encoders[klass];
   conn->writer()->startRect(rect, encoder->encoding);
 
@@ -689,6 +832,19 @@ Encoder *EncodeManager::startRect(const Rect& rect, int type, const bool trackQu
   else
     lossyRegion.assign_subtract(Region(rect));
 
+  // Rects compressed ahead of time say what quality they used
+  if (encoder->flags & EncoderLossy)
+    qualityMap.setLastQuality(rect, quality > -1 ? quality :
+                                    dynamicQualityMin > -1 ?
+                                    (int) scaledQuality(rect) :
+                                    conn->cp.qualityLevel);
+  else if (type != encoderSolid)
+    qualityMap.setLastQuality(rect, -1);
+
+  // Even lossy rects treated as lossless can't be XORed against
+  if (((encoder->flags & EncoderLossy) || videoDetected) && useTightDelta())
+    deltaInexact.assign_union(Region(rect));
+
   return encoder;
 }
 
@@ -705,6 +861,7 @@ void EncodeManager::endRect(const uint8_t isWebp)
   if (isWebp)
     klass = encoderTightWEBP;
   stats[klass][activeType].bytes += length;
+  metrics::registry.encoders[klass].bytes.add(length);
 }
 
 void EncodeManager::writeCopyPassRects(const std::vector<CopyPassRect>& copypassed)
@@ -731,6 +888,20 @@ void EncodeManager::writeCopyPassRects(const std::vector<CopyPassRect>& copypass
     lossyCopy.translate(Point(rect->rect.tl.x - rect->src_x, rect->rect.tl.y - rect->src_y));
     lossyCopy.assign_intersect(tmp);
     lossyRegion.assign_union(lossyCopy);
+
+    if (useTightDelta()) {
+      const Point delta(rect->rect.tl.x - rect->src_x,
+                        rect->rect.tl.y - rect->src_y);
+      Region validCopy;
+
+      deltaRef.copyRect(rect->rect, delta);
+
+      validCopy = deltaValid;
+      validCopy.translate(delta);
+      validCopy.assign_intersect(tmp);
+      deltaValid.assign_subtract(tmp);
+      deltaValid.assign_union(validCopy);
+    }
   }
 
   copyStats.bytes += conn->getOutStream(conn->cp.supportsUdp)->length() - beforeLength;
@@ -756,6 +927,10 @@ void EncodeManager::writeCopyRects(const Region& copied, const Point& delta)
 
     conn->writer()->writeCopyRect(*rect, rect->tl.x - delta.x,
                                    rect->tl.y - delta.y);
+
+    // The client copies in this order as well
+    if (useTightDelta())
+      deltaRef.copyRect(*rect, delta);
   }
 
   copyStats.bytes += conn->getOutStream(conn->cp.supportsUdp)->length() - beforeLength;
@@ -764,6 +939,16 @@ void EncodeManager::writeCopyRects(const Region& copied, const Point& delta)
   lossyCopy.translate(delta);
   lossyCopy.assign_intersect(copied);
   lossyRegion.assign_union(lossyCopy);
+
+  if (useTightDelta()) {
+    Region validCopy;
+
+    validCopy = deltaValid;
+    validCopy.translate(delta);
+    validCopy.assign_intersect(copied);
+    deltaValid.assign_subtract(copied);
+    deltaValid.assign_union(validCopy);
+  }
 }
 
 void EncodeManager::writeSolidRects(Region *changed, const PixelBuffer* pb)
@@ -1112,12 +1297,20 @@ void EncodeManager::writeRects(const Region& changed, const PixelBuffer* pb,
                                const struct timeval *start,
                                const bool mainScreen)
 {
-  std::vector<Rect> rects, subrects, scaledrects;
-  std::vector<uint8_t> encoderTypes;
-  std::vector<uint8_t> isWebp, fromCache;
-  std::vector<Palette> palettes;
-  std::vector<std::vector<uint8_t> > compresseds;
-  std::vector<uint32_t> ms;
+  std::vector<Rect> &rects = scratch.rects;
+  std::vector<Rect> &subrects = scratch.subrects;
+  std::vector<Rect> &scaledrects = scratch.scaledrects;
+  std::vector<uint8_t> &encoderTypes = scratch.encoderTypes;
+  std::vector<uint8_t> &isWebp = scratch.isWebp;
+  std::vector<uint8_t> &fromCache = scratch.fromCache;
+  std::vector<int8_t> &qualities = scratch.qualities;
+  std::vector<Palette> &palettes = scratch.palettes;
+  std::vector<EncodedBuffer> &compresseds = scratch.compresseds;
+  std::vector<uint32_t> &ms = scratch.ms;
+  std::vector<uint32_t> &us = scratch.us;
+  std::vector<uint8_t> &skipped = scratch.skipped;
+  std::vector<int> &cacheOps = scratch.cacheOps;
+  std::vector<rdr::U32> &cacheIds = scratch.cacheIds;
 
   webpTookTooLong.store(false, std::memory_order_relaxed);
   changed.get_rects(&rects);
@@ -1132,6 +1325,7 @@ void EncodeManager::writeRects(const Region& changed, const PixelBuffer* pb,
     rects.push_back(pb->getRect());
   }
 
+  subrects.clear();
   subrects.reserve(rects.size() * 1.5f);
 
   for (const auto& rect : rects) {
@@ -1174,13 +1368,21 @@ void EncodeManager::writeRects(const Region& changed, const PixelBuffer* pb,
 
   const size_t subrects_size = subrects.size();
 
-  encoderTypes.resize(subrects_size);
-  isWebp.resize(subrects_size);
-  fromCache.resize(subrects_size);
+  encoderTypes.assign(subrects_size, 0);
+  skipped.assign(subrects_size, 0);
+  us.assign(subrects_size, 0);
+  isWebp.assign(subrects_size, 0);
+  fromCache.assign(subrects_size, 0);
+  qualities.assign(subrects_size, -1);
   palettes.resize(subrects_size);
-  compresseds.resize(subrects_size);
   scaledrects.resize(subrects_size);
-  ms.resize(subrects_size);
+  ms.assign(subrects_size, 0);
+
+  // Keep the capacity of the output buffers, it usually fits the next
+  // frame as well
+  compresseds.resize(subrects_size);
+  for (uint32_t i = 0; i < subrects_size; ++i)
+    compresseds[i].clear();
 
   // In case the current resolution is above the max video res, and video was detected,
   // scale to that res, keeping aspect ratio
@@ -1237,16 +1439,83 @@ void EncodeManager::writeRects(const Region& changed, const PixelBuffer* pb,
   }
   scalingTime = msSince(&scalestart);
 
+  // What doesn't fit in this frame waits for the next ones
+  if (mainScreen && useFrameBudget()) {
+    scheduleRects(subrects, start, skipped);
+  } else if (mainScreen) {
+    for (unsigned n = 0; n < MaxDeferUpdates; n++)
+      deferredAge[n].clear();
+  }
+
+  // Tiles are reclassified as they change, and each rect then goes to
+  // the encoder that suits what it shows
+  if (mainScreen && !videoDetected && !scaledpb && useContentClass()) {
+    arena.execute([&] {
+        contentMap.update(changed, pb);
+    });
+  }
+
+  // Tiles the client still holds are drawn from its cache, the others
+  // are stored there once they have been sent
+  cacheOps.assign(subrects_size, -1);
+  cacheIds.resize(subrects_size);
+
+  if (mainScreen && !videoDetected && !scaledpb && useCacheRect()) {
+    std::vector<uint64_t> &hashes = scratch.hashes;
+
+    hashes.resize(subrects_size);
+
+    arena.execute([&] {
+        tbb::parallel_for(static_cast<size_t>(0), subrects_size, [&](size_t i) {
+            if (subrects[i].area() >= cacheRectMinArea)
+              hashes[i] = EncCache::hashRect(pb, subrects[i]);
+        });
+    });
+
+    // The client evicts as it sees these operations, so the mirror
+    // must be updated in the order they are written
+    for (uint32_t i = 0; i < subrects_size; ++i) {
+      const int w = subrects[i].width();
+      const int h = subrects[i].height();
+
+      if (skipped[i])
+        continue;
+
+      if (subrects[i].area() < cacheRectMinArea ||
+          (size_t) subrects[i].area() > cacheRects.limit())
+        continue;
+
+      if (cacheRects.lookup(hashes[i], w, h, &cacheIds[i]) &&
+          (allowLossyUpdate || !cacheRects.isLossy(cacheIds[i]))) {
+        cacheRects.touch(cacheIds[i]);
+        cacheOps[i] = cacheRectDraw;
+      } else {
+        cacheIds[i] = cacheRects.insert(hashes[i], w, h);
+        cacheOps[i] = cacheRectStore;
+      }
+    }
+  }
+
     arena.execute([&] {
         tbb::parallel_for(static_cast<size_t>(0), subrects_size, [&](size_t i) {
+            if (cacheOps[i] == cacheRectDraw || skipped[i])
+              return;
+            TRACE_SCOPE("getEncoderType", traceId);
+            const std::chrono::steady_clock::time_point rectStart = std::chrono::steady_clock::now();
             encoderTypes[i] = getEncoderType(subrects[i], pb, &palettes[i], compresseds[i],
-                        &isWebp[i], &fromCache[i],
+                        &isWebp[i], &fromCache[i], &qualities[i],
                         scaledpb, scaledrects[i], ms[i]);
+            us[i] = metrics::usSince(rectStart);
             checkWebpFallback(start);
         });
     });
 
+  if (mainScreen && !videoDetected && !scaledpb)
+    updateRectCosts(subrects, skipped, cacheOps, us);
+
   for (uint32_t i = 0; i < subrects_size; ++i) {
+    if (skipped[i])
+      continue;
     if (encoderTypes[i] == encoderFullColour) {
       if (isWebp[i])
         webpstats.ms += ms[i];
@@ -1277,31 +1546,167 @@ void EncodeManager::writeRects(const Region& changed, const PixelBuffer* pb,
     activeEncoders[encoderFullColour] = encoderTightJPEG;
 
   for (uint32_t i = 0; i < subrects_size; ++i) {
-    if (encCache->enabled && !compresseds[i].empty() && !fromCache[i] &&
-        !encoders[encoderTightQOI]->isSupported()) {
-      void *tmp = malloc(compresseds[i].size());
-      memcpy(tmp, &compresseds[i][0], compresseds[i].size());
-      encCache->add(isWebp[i] ? encoderTightWEBP : encoderTightJPEG,
-                    subrects[i].tl.x, subrects[i].tl.y, subrects[i].width(), subrects[i].height(),
-                    compresseds[i].size(), tmp);
+    if (skipped[i])
+      continue;
+
+    if (cacheOps[i] == cacheRectDraw) {
+      if (cacheRects.isLossy(cacheIds[i]))
+        lossyRegion.assign_union(Region(subrects[i]));
+      else
+        lossyRegion.assign_subtract(Region(subrects[i]));
+
+      conn->writer()->writeCacheRect(subrects[i], cacheRectDraw, cacheIds[i]);
+      metrics::registry.cacheRectDraws.add();
+
+      // The cached pixels may be ones that were only near enough
+      if (useTightDelta())
+        deltaInexact.assign_union(Region(subrects[i]));
+      continue;
     }
 
-    writeSubRect(subrects[i], pb, encoderTypes[i], palettes[i], compresseds[i], isWebp[i]);
+    writeSubRect(subrects[i], pb, encoderTypes[i], palettes[i], compresseds[i],
+                 isWebp[i], qualities[i]);
+
+    if (cacheOps[i] == cacheRectStore) {
+      cacheRects.setLossy(cacheIds[i],
+                          !lossyRegion.intersect(Region(subrects[i])).is_empty());
+      conn->writer()->writeCacheRect(subrects[i], cacheRectStore, cacheIds[i]);
+      metrics::registry.cacheRectStores.add();
+    }
+  }
+
+  // Unusually large outputs, more than a full sub rect sent raw, are
+  // not worth holding on to
+  const size_t maxKept = (size_t) SubRectMaxArea * (conn->cp.pf().bpp / 8);
+  for (uint32_t i = 0; i < subrects_size; ++i) {
+    if (compresseds[i].capacity() > maxKept)
+      EncodedBuffer().swap(compresseds[i]);
   }
 
   if (scaledpb)
     delete scaledpb;
 }
 
+void EncodeManager::scheduleRects(const std::vector<Rect>& subrects,
+                                  const struct timeval *start,
+                                  std::vector<uint8_t>& skipped)
+{
+  const size_t count = subrects.size();
+  const int klass = activeEncoders[encoderFullColour];
+  const Region& overdue = deferredAge[MaxDeferUpdates - 1];
+
+  std::vector<size_t> order(count);
+  std::vector<double> cost(count);
+  std::vector<long long> dist(count);
+  std::vector<uint8_t> rank(count);
+
+  double budget, spent;
+  Region putOff;
+
+  // The rects are compressed on every thread, so the budget is CPU time
+  budget = 1000000.0 / Server::frameRate * Server::frameBudget / 100;
+  if (start)
+    budget -= msSince(start) * 1000.0;
+  budget *= arena.max_concurrency();
+
+  // Overdue rects go first, then those the user is looking at, then
+  // as many of the others as possible, cheapest first
+  for (size_t i = 0; i < count; i++) {
+    int quality;
+
+    quality = dynamicQualityMin > -1 ? (int) scaledQuality(subrects[i]) :
+                                       conn->cp.qualityLevel;
+    cost[i] = subrects[i].area() * rectCost[rectCostIndex(klass, quality)];
+    dist[i] = distanceSq(subrects[i], focus);
+
+    if (!overdue.intersect(Region(subrects[i])).is_empty())
+      rank[i] = 0;
+    else if (dist[i] <= (long long) FocusRadius * FocusRadius)
+      rank[i] = 1;
+    else
+      rank[i] = 2;
+
+    order[i] = i;
+  }
+
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    if (rank[a] != rank[b])
+      return rank[a] < rank[b];
+    if (rank[a] == 1)
+      return dist[a] < dist[b];
+    return cost[a] < cost[b];
+  });
+
+  // Something always goes out, so there is progress even when the
+  // estimates are far off
+  spent = 0;
+  for (size_t n = 0; n < count; n++) {
+    const size_t i = order[n];
+
+    if (rank[i] != 0 && n != 0 && spent + cost[i] > budget) {
+      skipped[i] = 1;
+      putOff.assign_union(Region(subrects[i]));
+      metrics::registry.deferredRects.add();
+      continue;
+    }
+
+    spent += cost[i];
+  }
+
+  for (unsigned n = MaxDeferUpdates - 1; n > 0; n--)
+    deferredAge[n] = putOff.intersect(deferredAge[n - 1]);
+  deferredAge[0] = putOff;
+
+  deferred.assign_union(putOff);
+}
+
+void EncodeManager::updateRectCosts(const std::vector<Rect>& subrects,
+                                    const std::vector<uint8_t>& skipped,
+                                    const std::vector<int>& cacheOps,
+                                    const std::vector<uint32_t>& us)
+{
+  const int klass = activeEncoders[encoderFullColour];
+
+  std::vector<double> time(rectCost.size(), 0), pixels(rectCost.size(), 0);
+
+  for (size_t i = 0; i < subrects.size(); i++) {
+    unsigned idx;
+    int quality;
+
+    if (skipped[i] || cacheOps[i] == cacheRectDraw)
+      continue;
+
+    quality = dynamicQualityMin > -1 ? (int) scaledQuality(subrects[i]) :
+                                       conn->cp.qualityLevel;
+    idx = rectCostIndex(klass, quality);
+
+    time[idx] += us[i];
+    pixels[idx] += subrects[i].area();
+  }
+
+  // A moving average, so that estimates follow the content
+  for (size_t idx = 0; idx < rectCost.size(); idx++) {
+    if (pixels[idx] == 0)
+      continue;
+
+    if (rectCost[idx] == 0)
+      rectCost[idx] = time[idx] / pixels[idx];
+    else
+      rectCost[idx] += (time[idx] / pixels[idx] - rectCost[idx]) / 4;
+  }
+}
+
 uint8_t EncodeManager::getEncoderType(const Rect& rect, const PixelBuffer *pb,
-                                      Palette *pal, std::vector<uint8_t> &compressed,
+                                      Palette *pal, EncodedBuffer &compressed,
                                       uint8_t *isWebp, uint8_t *fromCache,
+                                      int8_t *usedQuality,
                                       const PixelBuffer *scaledpb, const Rect& scaledrect,
                                       uint32_t &ms) const
 {
   struct RectInfo info;
   unsigned int maxColours = 256;
-  PixelBuffer *ppb;
+  OffsetPixelBuffer offsetpb;
+  const PixelBuffer *ppb;
   Encoder *encoder;
 
   bool useRLE;
@@ -1314,12 +1719,16 @@ uint8_t EncodeManager::getEncoderType(const Rect& rect, const PixelBuffer *pb,
   if (maxColours > encoder->maxPaletteSize)
     maxColours = encoder->maxPaletteSize;
 
-  ppb = preparePixelBuffer(rect, pb, true);
+  const std::chrono::steady_clock::time_point analysisStart = std::chrono::steady_clock::now();
+
+  ppb = preparePixelBuffer(rect, pb, true, &offsetpb);
   info.palette = pal;
 
   if (!analyseRect(ppb, &info, maxColours))
     info.palette->clear();
 
+  metrics::registry.analysisTime.observe(metrics::usSince(analysisStart));
+
   // Different encoders might have different RLE overhead, but
   // here we do a guess at RLE being the better choice if reduces
   // the pixel count by 50%.
@@ -1348,89 +1757,279 @@ uint8_t EncodeManager::getEncoderType(const Rect& rect, const PixelBuffer *pb,
   if (scaledpb || conn->cp.supportsQOI)
     type = encoderFullColour;
 
+  // Sharp text in many colours is blurred by JPEG and compresses badly,
+  // while gradients and photos compress badly as indexed colour
+  ContentClass content = contentUnknown;
+  if (!scaledpb && !videoDetected && useContentClass()) {
+    content = contentMap.getClass(rect);
+
+    if (type == encoderFullColour && content == contentText &&
+        qualityMap.getQuality(rect) >= TextStableQuality) {
+      type = encoderFullColourLossless;
+    } else if ((type == encoderIndexed || type == encoderIndexedRLE) &&
+               info.palette->size() > ContentMinColours &&
+               (content == contentGradient || content == contentPhoto)) {
+      type = encoderFullColour;
+      info.palette->clear();
+    }
+  }
+
   *isWebp = 0;
   *fromCache = 0;
   ms = 0;
   if (type == encoderFullColour) {
-    uint32_t len;
-    const void *data;
+    EncId id;
+    bool cacheable;
     struct timeval start;
     gettimeofday(&start, NULL);
+    const std::chrono::steady_clock::time_point encodeStart = std::chrono::steady_clock::now();
+
+    unsigned quality = scaledQuality(rect);
+    // Banding shows on gradients well before blocking does elsewhere
+    if (content == contentGradient && dynamicQualityMin > -1) {
+      const int floor = __rfbmin(GradientMinQuality,
+                                 dynamicQualityMin + dynamicQualityOff);
+      quality = __rfbmax((int) quality, floor);
+    }
+    // Nor is text sent blurrier than the client already shows it while
+    // it keeps changing, until a lossless refresh has sharpened it
+    if (content == contentText && dynamicQualityMin > -1)
+      quality = __rfbmax((int) quality, qualityMap.getLastQuality(rect));
+    *usedQuality = quality;
+
+    id.type = activeEncoders[encoderFullColour];
+    if (id.type != encoderTightQOI && webpTookTooLong)
+      id.type = encoderTightJPEG;
+    // Scaled rects depend on the client's video size, and the cache
+    // holds only native format encodings, so skip it for those
+    cacheable = encCache->enabled() && !scaledpb &&
+                (id.type == encoderTightWEBP || id.type == encoderTightQOI ||
+                 id.type == encoderTightJPEG) &&
+                (encoders[id.type]->flags & EncoderUseNativePF);
+
+    if (cacheable) {
+      id.hash = EncCache::hashRect(pb, rect);
+      id.w = rect.width();
+      id.h = rect.height();
+      id.quality = quality;
+      id.video = videoDetected;
+    }
 
-    if (encCache->enabled &&
-        (data = encCache->get(activeEncoders[encoderFullColour],
-                              rect.tl.x, rect.tl.y, rect.width(), rect.height(),
-                              len))) {
-      compressed.resize(len);
-      memcpy(&compressed[0], data, len);
+    if (cacheable && encCache->get(id, compressed)) {
+      *isWebp = id.type == encoderTightWEBP;
       *fromCache = 1;
-    } else if (activeEncoders[encoderFullColour] == encoderTightWEBP && !webpTookTooLong) {
+    } else if (id.type == encoderTightWEBP) {
       if (scaledpb) {
-        delete ppb;
         ppb = preparePixelBuffer(scaledrect, scaledpb,
                                  encoders[encoderTightWEBP]->flags & EncoderUseNativePF ?
-                                 false : true);
+                                 false : true, &offsetpb);
       } else if (encoders[encoderTightWEBP]->flags & EncoderUseNativePF) {
-        delete ppb;
-        ppb = preparePixelBuffer(rect, pb, false);
+        ppb = preparePixelBuffer(rect, pb, false, &offsetpb);
       }
 
       ((TightWEBPEncoder *) encoders[encoderTightWEBP])->compressOnly(ppb,
-                                                                      scaledQuality(rect),
+                                                                      quality,
                                                                       compressed,
                                                                       videoDetected);
       *isWebp = 1;
-    } else if (activeEncoders[encoderFullColour] == encoderTightQOI) {
+    } else if (id.type == encoderTightQOI) {
       if (scaledpb) {
-        delete ppb;
         ppb = preparePixelBuffer(scaledrect, scaledpb,
                                  encoders[encoderTightQOI]->flags & EncoderUseNativePF ?
-                                 false : true);
+                                 false : true, &offsetpb);
       } else if (encoders[encoderTightQOI]->flags & EncoderUseNativePF) {
-        delete ppb;
-        ppb = preparePixelBuffer(rect, pb, false);
+        ppb = preparePixelBuffer(rect, pb, false, &offsetpb);
       }
 
       ((TightQOIEncoder *) encoders[encoderTightQOI])->compressOnly(ppb,
-                                                                      scaledQuality(rect),
+                                                                      quality,
                                                                       compressed,
                                                                       videoDetected);
-    } else if (activeEncoders[encoderFullColour] == encoderTightJPEG || webpTookTooLong) {
+    } else if (id.type == encoderTightJPEG) {
       if (scaledpb) {
-        delete ppb;
         ppb = preparePixelBuffer(scaledrect, scaledpb,
                                  encoders[encoderTightJPEG]->flags & EncoderUseNativePF ?
-                                 false : true);
+                                 false : true, &offsetpb);
       } else if (encoders[encoderTightJPEG]->flags & EncoderUseNativePF) {
-        delete ppb;
-        ppb = preparePixelBuffer(rect, pb, false);
+        ppb = preparePixelBuffer(rect, pb, false, &offsetpb);
       }
 
       ((TightJPEGEncoder *) encoders[encoderTightJPEG])->compressOnly(ppb,
-                                                                      scaledQuality(rect),
+                                                                      quality,
                                                                       compressed,
                                                                       videoDetected);
     }
 
     ms = msSince(&start);
+
+    if (cacheable && !*fromCache)
+      encCache->add(id, compressed);
+
+    if (!*fromCache) {
+      int klass = activeEncoders[encoderFullColour];
+      if (*isWebp)
+        klass = encoderTightWEBP;
+      else if (klass == encoderTightWEBP)
+        klass = encoderTightJPEG; // WEBP took too long, fell back
+      metrics::registry.encoders[klass].encodeTime.observe(metrics::usSince(encodeStart));
+    }
   }
 
-  delete ppb;
+  if (compressed.empty() && type != encoderSolid && parallelLossless()) {
+    const std::chrono::steady_clock::time_point encodeStart = std::chrono::steady_clock::now();
+
+    ppb = preparePixelBuffer(rect, pb, true, &offsetpb);
+
+    if (activeEncoders[type] == encoderTight) {
+      ((TightEncoder *) encoders[encoderTight])->compressOnly(ppb, *pal, compressed);
+      metrics::registry.encoders[encoderTight].encodeTime.observe(
+        metrics::usSince(encodeStart));
+    } else if (activeEncoders[type] == encoderZRLE) {
+      ((ZRLEEncoder *) encoders[encoderZRLE])->compressOnly(ppb, *pal, compressed);
+      metrics::registry.encoders[encoderZRLE].encodeTime.observe(
+        metrics::usSince(encodeStart));
+    }
+  }
+
+  // When the client already shows most of these pixels exactly, sending
+  // only what changed is lossless and usually smaller than either
+  if (type != encoderSolid && !scaledpb && !videoDetected && useTightDelta()) {
+    static thread_local EncodedBuffer delta;
+    const std::chrono::steady_clock::time_point encodeStart = std::chrono::steady_clock::now();
+
+    if (encodeDelta(rect, pb, delta) &&
+        (compressed.empty() || delta.size() < compressed.size())) {
+      compressed.swap(delta);
+      type = encoderDelta;
+      *isWebp = 0;
+      *fromCache = 0;
+    }
+
+    metrics::registry.encoders[encoderTight].encodeTime.observe(
+      metrics::usSince(encodeStart));
+  }
 
   return type;
 }
 
+bool EncodeManager::encodeDelta(const Rect& rect, const PixelBuffer *pb,
+                                EncodedBuffer &out) const
+{
+  static thread_local ManagedPixelBuffer diff;
+  OffsetPixelBuffer offsetpb;
+  const PixelBuffer *ppb;
+  const rdr::U8 *cur, *ref;
+  rdr::U8 *dst;
+  int curStride, refStride, dstStride;
+  size_t bpp, rowBytes;
+  int changed;
+
+  if (rect.area() < DeltaMinArea)
+    return false;
+  if (!deltaValid.intersect(Region(rect)).equals(Region(rect)))
+    return false;
+
+  ppb = preparePixelBuffer(rect, pb, true, &offsetpb);
+
+  diff.setPF(ppb->getPF());
+  diff.setSize(rect.width(), rect.height());
+
+  cur = ppb->getBuffer(ppb->getRect(), &curStride);
+  ref = deltaRef.getBuffer(rect, &refStride);
+  dst = diff.getBufferRW(diff.getRect(), &dstStride);
+
+  bpp = ppb->getPF().bpp/8;
+  rowBytes = rect.width() * bpp;
+
+  changed = 0;
+  for (int y = 0; y < rect.height(); y++) {
+    if (memcmp(cur, ref, rowBytes) == 0) {
+      memset(dst, 0, rowBytes);
+    } else {
+      for (size_t x = 0; x < rowBytes; x += bpp) {
+        rdr::U8 differs = 0;
+        for (size_t i = 0; i < bpp; i++) {
+          dst[x + i] = cur[x + i] ^ ref[x + i];
+          differs |= dst[x + i];
+        }
+        if (differs)
+          changed++;
+      }
+    }
+
+    cur += curStride * bpp;
+    ref += refStride * bpp;
+    dst += dstStride * bpp;
+  }
+
+  diff.commitBufferRW(diff.getRect());
+
+  // Mostly new content compresses better the usual way
+  if (changed > rect.area() / 2)
+    return false;
+
+  ((TightEncoder *) encoders[encoderTight])->compressDelta(&diff, out);
+
+  return true;
+}
+
+void EncodeManager::updateDeltaRef(const Region& written, const PixelBuffer* pb)
+{
+  std::vector<Rect> rects;
+  std::vector<Rect>::const_iterator rect;
+  Region exact;
+
+  if (!useTightDelta())
+    return;
+
+  // Everything went out scaled or lossy
+  if (videoDetected) {
+    deltaValid.clear();
+    deltaInexact.clear();
+    return;
+  }
+
+  exact = written.subtract(deltaInexact);
+
+  exact.get_rects(&rects);
+  for (rect = rects.begin(); rect != rects.end(); ++rect) {
+    rdr::U8* buffer;
+    int stride;
+
+    buffer = deltaRef.getBufferRW(*rect, &stride);
+    pb->getImage(deltaRef.getPF(), buffer, *rect, stride);
+    deltaRef.commitBufferRW(*rect);
+  }
+
+  deltaValid.assign_subtract(written);
+  deltaValid.assign_union(exact);
+  deltaInexact.clear();
+}
+
 void EncodeManager::writeSubRect(const Rect& rect, const PixelBuffer *pb,
                                  const uint8_t type, const Palette &pal,
-                                 const std::vector<uint8_t> &compressed,
-                                 const uint8_t isWebp)
+                                 const EncodedBuffer &compressed,
+                                 const uint8_t isWebp, const int8_t quality)
 {
-  PixelBuffer *ppb;
+  OffsetPixelBuffer offsetpb;
+  const PixelBuffer *ppb;
   Encoder *encoder;
 
-  encoder = startRect(rect, type, compressed.size() == 0, isWebp);
+  TRACE_SCOPE("writeSubRect", traceId);
+
+  // Lossless rects may also have been compressed in parallel
+  const int klass = isWebp ? (int) encoderTightWEBP : activeEncoders[type];
+  const bool lossless = klass == encoderTight || klass == encoderZRLE;
 
-  if (compressed.size()) {
+  encoder = startRect(rect, type, compressed.size() == 0 || lossless, isWebp,
+                      compressed.size() ? quality : -1);
+
+  if (compressed.size() && lossless) {
+    if (klass == encoderTight)
+      ((TightEncoder *) encoder)->writeOnly(compressed);
+    else
+      ((ZRLEEncoder *) encoder)->writeOnly(compressed);
+  } else if (compressed.size()) {
     if (isWebp) {
       ((TightWEBPEncoder *) encoder)->writeOnly(compressed);
       webpstats.area += rect.area();
@@ -1445,14 +2044,18 @@ void EncodeManager::writeSubRect(const Rect& rect, const PixelBuffer *pb,
       jpegstats.rects++;
     }
   } else {
+    const std::chrono::steady_clock::time_point encodeStart = std::chrono::steady_clock::now();
+
     if (encoder->flags & EncoderUseNativePF) {
-      ppb = preparePixelBuffer(rect, pb, false);
+      ppb = preparePixelBuffer(rect, pb, false, &offsetpb);
     } else {
-      ppb = preparePixelBuffer(rect, pb, true);
+      ppb = preparePixelBuffer(rect, pb, true, &offsetpb);
     }
 
     encoder->writeRect(ppb, pal);
-    delete ppb;
+
+    metrics::registry.encoders[activeEncoders[type]].encodeTime.observe(
+      metrics::usSince(encodeStart));
   }
 
   endRect(isWebp);
@@ -1567,26 +2170,27 @@ void EncodeManager::extendSolidAreaByPixel(const Rect& r, const Rect& sr,
   er->br.x = cx;
 }
 
-PixelBuffer* EncodeManager::preparePixelBuffer(const Rect& rect,
-                                               const PixelBuffer *pb,
-                                               bool convert) const
+const PixelBuffer* EncodeManager::preparePixelBuffer(const Rect& rect,
+                                                     const PixelBuffer *pb,
+                                                     bool convert,
+                                                     OffsetPixelBuffer *offset) const
 {
+  // Each encoder thread converts into its own buffer, which only grows
+  static thread_local ManagedPixelBuffer convertedPixelBuffer;
   const rdr::U8* buffer;
   int stride;
 
   // Do wo need to convert the data?
   if (convert && !conn->cp.pf().equal(pb->getPF())) {
-    ManagedPixelBuffer *convertedPixelBuffer = new ManagedPixelBuffer;
-
-    convertedPixelBuffer->setPF(conn->cp.pf());
-    convertedPixelBuffer->setSize(rect.width(), rect.height());
+    convertedPixelBuffer.setPF(conn->cp.pf());
+    convertedPixelBuffer.setSize(rect.width(), rect.height());
 
     buffer = pb->getBuffer(rect, &stride);
-    convertedPixelBuffer->imageRect(pb->getPF(),
-                                   convertedPixelBuffer->getRect(),
+    convertedPixelBuffer.imageRect(pb->getPF(),
+                                   convertedPixelBuffer.getRect(),
                                    buffer, stride);
 
-    return convertedPixelBuffer;
+    return &convertedPixelBuffer;
   }
 
   // Otherwise we still need to shift the coordinates. We have our own
@@ -1594,11 +2198,10 @@ PixelBuffer* EncodeManager::preparePixelBuffer(const Rect& rect,
 
   buffer = pb->getBuffer(rect, &stride);
 
-  OffsetPixelBuffer *offsetPixelBuffer = new OffsetPixelBuffer;
-  offsetPixelBuffer->update(pb->getPF(), rect.width(), rect.height(),
-                           buffer, stride);
+  offset->update(pb->getPF(), rect.width(), rect.height(),
+                 buffer, stride);
 
-  return offsetPixelBuffer;
+  return offset;
 }
 
 bool EncodeManager::analyseRect(const PixelBuffer *pb,
@@ -1656,101 +2259,8 @@ rdr::U8* EncodeManager::OffsetPixelBuffer::getBufferRW(const Rect& r, int* strid
 #undef BPP
 
 // Dynamic quality tracking
-void EncodeManager::updateQualities() {
-  struct timeval now;
-  gettimeofday(&now, NULL);
-
-  // Remove elements that haven't been touched in 5s. Update the scores.
-  for (std::list<QualityInfo*>::iterator it = qualityList.begin(); it != qualityList.end(); ) {
-    QualityInfo * const cur = *it;
-    const unsigned since = msBetween(&cur->lastUpdate, &now);
-    if (since > 5000) {
-      delete cur;
-      it = qualityList.erase(it);
-    } else {
-      cur->score -= cur->score / 16;
-      it++;
-    }
-  }
-}
-
-static bool closeEnough(const Rect& unioned, const int& unionArea,
-                        const Rect& check, const int& checkArea) {
-  const Point p = unioned.tl.subtract(check.tl);
-  if (abs(p.x) > 32 ||
-      abs(p.y) > 32)
-      return false;
-
-  if (abs(unionArea - checkArea) > 4096)
-    return false;
-
-  return true;
-}
-
 void EncodeManager::trackRectQuality(const Rect& rect) {
-
-  const int searchArea = rect.area();
-  struct timeval now;
-  gettimeofday(&now, NULL);
-
-  for (std::list<QualityInfo*>::iterator it = qualityList.begin(); it != qualityList.end(); it++) {
-    QualityInfo * const cur = *it;
-    const int curArea = cur->rect.area();
-    const Rect unioned = cur->rect.union_boundary(rect);
-    const int unionArea = unioned.area();
-    // Is this close enough to match?
-    // e.g. ads that change parts in one frame and more in others
-    if (rect.enclosed_by(cur->rect) ||
-        cur->rect.enclosed_by(rect) ||
-        closeEnough(unioned, unionArea, cur->rect, curArea) ||
-        closeEnough(unioned, unionArea, rect, searchArea)) {
-
-        // This existing rect matched. Set it to the larger of the two,
-        // and add to its score.
-        if (searchArea > curArea)
-          cur->rect = rect;
-
-        cur->score += SCORE_INCREMENT;
-        cur->lastUpdate = now;
-        return;
-    }
-  }
-
-  // It wasn't found, add it
-  QualityInfo *info = new QualityInfo;
-  info->rect = rect;
-  info->score = 0;
-  info->lastUpdate = now;
-  qualityList.push_back(info);
-}
-
-// Returns the change-tracked quality, 0-128, where 128 is max quality
-unsigned EncodeManager::getQuality(const Rect& rect) const {
-
-  const int searchArea = rect.area();
-
-  for (std::list<QualityInfo*>::const_iterator it = qualityList.begin(); it != qualityList.end(); it++) {
-    const QualityInfo * const cur = *it;
-    const int curArea = cur->rect.area();
-    const Rect unioned = cur->rect.union_boundary(rect);
-    const int unionArea = unioned.area();
-    // Is this close enough to match?
-    // e.g. ads that change parts in one frame and more in others
-    if (rect.enclosed_by(cur->rect) ||
-        cur->rect.enclosed_by(rect) ||
-        closeEnough(unioned, unionArea, cur->rect, curArea) ||
-        closeEnough(unioned, unionArea, rect, searchArea)) {
-
-        unsigned score = cur->score;
-        if (score > 128)
-          score = 128;
-        score = 128 - score;
-
-        return score;
-    }
-  }
-
-  return 128; // Not found, this shouldn't happen - return max quality then
+  qualityMap.touch(rect);
 }
 
 // Returns the scaled quality, 0-9, where 9 is max
@@ -1759,7 +2269,7 @@ unsigned EncodeManager::scaledQuality(const Rect& rect) const {
 
   unsigned dynamic;
 
-  dynamic = getQuality(rect);
+  dynamic = qualityMap.getQuality(rect);
 
   // The tracker gives quality as 0-128. Convert to our desired range
   dynamic *= dynamicQualityOff;
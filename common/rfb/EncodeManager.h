@@ -22,10 +22,14 @@
 #define __RFB_ENCODEMANAGER_H__
 
 #include <vector>
-#include <list>
 
 #include <rdr/types.h>
+#include <rfb/CacheRect.h>
+#include <rfb/EncodedBuffer.h>
+#include <rfb/ContentMap.h>
+#include <rfb/Palette.h>
 #include <rfb/PixelBuffer.h>
+#include <rfb/QualityMap.h>
 #include <rfb/Region.h>
 #include <rfb/Timer.h>
 #include <rfb/UpdateTracker.h>
@@ -39,14 +43,12 @@ namespace rfb {
   class SConnection;
   class Encoder;
   class UpdateInfo;
-  class Palette;
   class PixelBuffer;
   class RenderedCursor;
   class EncCache;
   struct Rect;
 
   struct RectInfo;
-  struct QualityInfo;
 
   class EncodeManager: public Timer::Callback {
   public:
@@ -76,9 +78,25 @@ namespace rfb {
     [[nodiscard]] unsigned getEncodingTime() const {
         return encodingTime;
     };
+
+    // Where the client's user last pointed. When an update doesn't fit
+    // in the frame budget, rects close to it go first.
+    void setFocus(const Point& pos) { focus = pos; }
+
+    // Changes left out of the last update for lack of time, which must
+    // go in a later one
+    const Region& getDeferred() const { return deferred; }
+
+    // How often each part of the screen changes, and the quality it was
+    // last sent at
+    const QualityMap& getQualityMap() const { return qualityMap; }
+
     [[nodiscard]] unsigned getScalingTime() const {
         return scalingTime;
     };
+    [[nodiscard]] uint32_t getTraceId() const {
+        return traceId;
+    };
 
     void resetZlib();
 
@@ -91,6 +109,8 @@ namespace rfb {
     codecstats_t jpegstats, webpstats;
 
   protected:
+    class OffsetPixelBuffer;
+
     void doUpdate(bool allowLossy, const Region& changed,
                   const Region& copied, const Point& copy_delta,
                   const std::vector<CopyPassRect> &copypassed,
@@ -103,9 +123,16 @@ namespace rfb {
     int computeNumRects(const Region& changed);
 
     Encoder *startRect(const Rect& rect, int type, const bool trackQuality = true,
-                       const uint8_t isWebp = 0);
+                       const uint8_t isWebp = 0, const int8_t quality = -1);
     void endRect(const uint8_t isWebp = 0);
 
+    bool useCacheRect() const;
+    bool useTightZstd() const;
+    bool useTightDelta() const;
+    bool parallelLossless() const;
+    bool useFrameBudget() const;
+    bool useContentClass() const;
+
     void writeCopyRects(const Region& copied, const Point& delta);
     void writeCopyPassRects(const std::vector<CopyPassRect>& copypassed);
     void writeSolidRects(Region *changed, const PixelBuffer* pb);
@@ -113,16 +140,27 @@ namespace rfb {
     void writeRects(const Region& changed, const PixelBuffer* pb,
                     const struct timeval *start = NULL,
                     const bool mainScreen = false);
+    void scheduleRects(const std::vector<Rect>& subrects,
+                       const struct timeval *start,
+                       std::vector<uint8_t>& skipped);
+    void updateRectCosts(const std::vector<Rect>& subrects,
+                         const std::vector<uint8_t>& skipped,
+                         const std::vector<int>& cacheOps,
+                         const std::vector<uint32_t>& us);
     void checkWebpFallback(const struct timeval *start);
     void updateVideoStats(const std::vector<Rect> &rects, const PixelBuffer* pb);
 
+    void updateDeltaRef(const Region& written, const PixelBuffer* pb);
+    bool encodeDelta(const Rect& rect, const PixelBuffer *pb,
+                     EncodedBuffer &out) const;
+
     void writeSubRect(const Rect& rect, const PixelBuffer *pb, const uint8_t type,
-                      const Palette& pal, const std::vector<uint8_t> &compressed,
-                      const uint8_t isWebp);
+                      const Palette& pal, const EncodedBuffer &compressed,
+                      const uint8_t isWebp, const int8_t quality);
 
     uint8_t getEncoderType(const Rect& rect, const PixelBuffer *pb, Palette *pal,
-                           std::vector<uint8_t> &compressed, uint8_t *isWebp,
-                           uint8_t *fromCache,
+                           EncodedBuffer &compressed, uint8_t *isWebp,
+                           uint8_t *fromCache, int8_t *quality,
                            const PixelBuffer *scaledpb, const Rect& scaledrect,
                            uint32_t &ms) const;
 
@@ -136,15 +174,16 @@ namespace rfb {
                                 const rdr::U8* colourValue,
                                 const PixelBuffer *pb, Rect* er);
 
-    PixelBuffer* preparePixelBuffer(const Rect& rect,
-                                    const PixelBuffer *pb, bool convert) const;
+    // The result points into pb, or into offset or a per-thread buffer,
+    // and is valid until the next call on the same thread
+    const PixelBuffer* preparePixelBuffer(const Rect& rect,
+                                          const PixelBuffer *pb, bool convert,
+                                          OffsetPixelBuffer *offset) const;
 
     bool analyseRect(const PixelBuffer *pb,
                      struct RectInfo *info, int maxColours) const;
 
-    void updateQualities();
     void trackRectQuality(const Rect& rect);
-    unsigned getQuality(const Rect& rect) const;
     unsigned scaledQuality(const Rect& rect) const;
 
   protected:
@@ -183,7 +222,8 @@ namespace rfb {
     };
     typedef std::vector< std::vector<struct EncoderStats> > StatsVector;
 
-    std::list<QualityInfo*> qualityList;
+    QualityMap qualityMap;
+    ContentMap contentMap;
     int dynamicQualityMin;
     int dynamicQualityOff;
 
@@ -208,6 +248,42 @@ namespace rfb {
     unsigned scalingTime;
 
     EncCache *encCache;
+    uint32_t traceId;
+
+    // Mirror of the client's tile cache
+    CacheRectIndex cacheRects;
+    PixelFormat cacheRectPF;
+    bool allowLossyUpdate;
+
+    // The pixels the client shows, in its format, for delta rects. Only
+    // deltaValid is known to be exact; deltaInexact collects what this
+    // update sends lossily.
+    ManagedPixelBuffer deltaRef;
+    Region deltaValid, deltaInexact;
+
+    // Frame budget scheduling. deferredAge[n] holds what has been put off
+    // more than n updates in a row; the last one may not wait any longer.
+    Point focus;
+    Region deferred;
+    std::vector<Region> deferredAge;
+    // Recent encoding cost in microseconds per pixel, by full colour
+    // encoder and quality
+    std::vector<double> rectCost;
+
+    // Per subrect state of writeRects(), kept so that the buffers are
+    // reused from one frame to the next
+    struct {
+      std::vector<Rect> rects, subrects, scaledrects;
+      std::vector<uint8_t> encoderTypes, isWebp, fromCache;
+      std::vector<int8_t> qualities;
+      std::vector<Palette> palettes;
+      std::vector<EncodedBuffer> compresseds;
+      std::vector<uint32_t> ms, us;
+      std::vector<uint8_t> skipped;
+      std::vector<int> cacheOps;
+      std::vector<rdr::U32> cacheIds;
+      std::vector<uint64_t> hashes;
+    } scratch;
 
     class OffsetPixelBuffer : public FullFramePixelBuffer {
     public:
@@ -0,0 +1,57 @@
+/* Copyright (C) 2026 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+//
+// EncodedBuffer - holds a rect's encoded bytes between the parallel
+// compress phase and the serial write phase. Growing it leaves the new
+// bytes uninitialised, as the encoders overwrite them right away.
+//
+
+#ifndef __RFB_ENCODEDBUFFER_H__
+#define __RFB_ENCODEDBUFFER_H__
+
+#include <stdint.h>
+
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace rfb {
+
+  template<class T> class UninitAllocator : public std::allocator<T> {
+  public:
+    template<class U> struct rebind { typedef UninitAllocator<U> other; };
+
+    UninitAllocator() noexcept {}
+    template<class U> UninitAllocator(const UninitAllocator<U>&) noexcept {}
+
+    // Default rather than value initialise, i.e. no zeroing
+    template<class U> void construct(U* p) {
+      ::new((void*) p) U;
+    }
+    template<class U, class... Args> void construct(U* p, Args&&... args) {
+      ::new((void*) p) U(std::forward<Args>(args)...);
+    }
+  };
+
+  typedef std::vector<uint8_t, UninitAllocator<uint8_t> > EncodedBuffer;
+
+}
+
+#endif
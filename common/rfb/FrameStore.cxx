@@ -0,0 +1,99 @@
+/* Copyright (C) 2026 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#include <string.h>
+
+#include <rfb/FrameStore.h>
+
+using namespace rfb;
+
+FrameStore::FrameStore()
+  : cur(std::make_shared<ManagedPixelBuffer>()), generation(0), copies(0)
+{
+}
+
+FrameStore::WriteLock::WriteLock(FrameStore *store_)
+  : store(store_), writing(false)
+{
+  store->lock.lock();
+}
+
+FrameStore::WriteLock::~WriteLock()
+{
+  store->lock.unlock();
+}
+
+ManagedPixelBuffer &FrameStore::WriteLock::buffer()
+{
+  if (writing)
+    return *store->cur;
+
+  writing = true;
+
+  // Only we hand out new references, and only under the lock, so a count
+  // of one means nobody else can be reading the frame
+  if (store->cur.use_count() == 1)
+    return *store->cur;
+
+  // Someone still reads the current frame. Move on to a copy, recycling
+  // an earlier frame once its readers are gone.
+  std::shared_ptr<ManagedPixelBuffer> next;
+  if (store->spare && store->spare.use_count() == 1)
+    next.swap(store->spare);
+  else
+    next = std::make_shared<ManagedPixelBuffer>();
+
+  const ManagedPixelBuffer &src = *store->cur;
+  if (!next->getPF().equal(src.getPF()))
+    next->setPF(src.getPF());
+  if (next->width() != src.width() || next->height() != src.height())
+    next->setSize(src.width(), src.height());
+
+  if (!src.getRect().is_empty()) {
+    int stride;
+    const rdr::U8 *data = src.getBuffer(src.getRect(), &stride);
+    next->imageRect(src.getRect(), data, stride);
+  }
+
+  store->spare = store->cur;
+  store->cur = next;
+  store->copies++;
+
+  return *store->cur;
+}
+
+void FrameStore::WriteLock::publish()
+{
+  store->generation++;
+}
+
+FrameStore::Snapshot FrameStore::snapshot(uint32_t *generation_)
+{
+  std::lock_guard<std::mutex> guard(lock);
+
+  if (generation_)
+    *generation_ = generation;
+
+  return cur;
+}
+
+uint32_t FrameStore::getGeneration()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  return generation;
+}
@@ -0,0 +1,83 @@
+/* Copyright (C) 2026 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+//
+// FrameStore - the server's copy of the last compared frame, shared by
+// everything that needs to look at a stable frame. Readers borrow
+// refcounted snapshots; the writer only copies the frame when it has to
+// modify it while a snapshot is still held (copy-on-write).
+//
+
+#ifndef __RFB_FRAMESTORE_H__
+#define __RFB_FRAMESTORE_H__
+
+#include <stdint.h>
+
+#include <memory>
+#include <mutex>
+
+#include <rfb/PixelBuffer.h>
+
+namespace rfb {
+
+  class FrameStore {
+  public:
+    typedef std::shared_ptr<const ManagedPixelBuffer> Snapshot;
+
+    FrameStore();
+
+    // Exclusive write access, held by the main thread while it updates
+    // the frame. Readers asking for a snapshot meanwhile wait for it.
+    class WriteLock {
+    public:
+      WriteLock(FrameStore *store_);
+      ~WriteLock();
+
+      // Returns the frame to modify in place. Copies it first if a
+      // snapshot of it is still borrowed.
+      ManagedPixelBuffer &buffer();
+
+      // Marks the frame contents as changed
+      void publish();
+
+      // Read-only access, never copies
+      const ManagedPixelBuffer &peek() const { return *store->cur; }
+
+    private:
+      FrameStore *store;
+      bool writing;
+    };
+
+    // Safe from any thread. The snapshot never changes once returned.
+    Snapshot snapshot(uint32_t *generation = NULL);
+
+    uint32_t getGeneration();
+
+    // Number of times a borrowed frame forced a full copy
+    uint32_t getCopies() const { return copies; }
+
+  private:
+    std::mutex lock;
+    std::shared_ptr<ManagedPixelBuffer> cur, spare;
+    uint32_t generation;
+    uint32_t copies;
+  };
+
+}
+
+#endif
@@ -75,6 +75,8 @@ JpegOutputMessage(j_common_ptr cinfo)
 struct JPEG_DEST_MGR {
   struct jpeg_destination_mgr pub;
   JpegCompressor *instance;
+  // Compress straight into this instead of the MemOutStream, if set
+  EncodedBuffer *out;
 };
 
 static void
@@ -83,6 +85,19 @@ JpegInitDestination(j_compress_ptr cinfo)
   JPEG_DEST_MGR *dest = (JPEG_DEST_MGR *)cinfo->dest;
   JpegCompressor *jc = dest->instance;
 
+  if (dest->out) {
+    // Use whatever the buffer already holds, it usually fits. Growing it
+    // leaves the bytes uninitialised, and term_destination cuts it down
+    // to what libjpeg wrote.
+    size_t len = dest->out->capacity();
+    if (len < 16384)
+      len = 16384;
+    dest->out->resize(len);
+    dest->pub.next_output_byte = dest->out->data();
+    dest->pub.free_in_buffer = len;
+    return;
+  }
+
   jc->clear();
   dest->pub.next_output_byte = jc->getptr();
   dest->pub.free_in_buffer = jc->avail();
@@ -94,6 +109,14 @@ JpegEmptyOutputBuffer(j_compress_ptr cinfo)
   JPEG_DEST_MGR *dest = (JPEG_DEST_MGR *)cinfo->dest;
   JpegCompressor *jc = dest->instance;
 
+  if (dest->out) {
+    size_t used = dest->out->size();
+    dest->out->resize(used * 2);
+    dest->pub.next_output_byte = dest->out->data() + used;
+    dest->pub.free_in_buffer = used;
+    return TRUE;
+  }
+
   jc->setptr(jc->getend());
   jc->check(jc->length());
   dest->pub.next_output_byte = jc->getptr();
@@ -108,6 +131,11 @@ JpegTermDestination(j_compress_ptr cinfo)
   JPEG_DEST_MGR *dest = (JPEG_DEST_MGR *)cinfo->dest;
   JpegCompressor *jc = dest->instance;
 
+  if (dest->out) {
+    dest->out->resize(dest->out->size() - dest->pub.free_in_buffer);
+    return;
+  }
+
   jc->setptr(dest->pub.next_output_byte);
 }
 
@@ -133,6 +161,7 @@ JpegCompressor::JpegCompressor(int bufferLen) : MemOutStream(bufferLen)
   dest->pub.empty_output_buffer = JpegEmptyOutputBuffer;
   dest->pub.term_destination = JpegTermDestination;
   dest->instance = this;
+  dest->out = NULL;
   cinfo->dest = (struct jpeg_destination_mgr *)dest;
 }
 
@@ -248,6 +277,21 @@ void JpegCompressor::compress(const rdr::U8 *buf, int stride, const Rect& r,
   delete[] rowPointer;
 }
 
+void JpegCompressor::compress(const rdr::U8 *buf, int stride, const Rect& r,
+  const PixelFormat& pf, int quality, int subsamp, EncodedBuffer &out)
+{
+  dest->out = &out;
+
+  try {
+    compress(buf, stride, r, pf, quality, subsamp);
+  } catch (...) {
+    dest->out = NULL;
+    throw;
+  }
+
+  dest->out = NULL;
+}
+
 void JpegCompressor::writeBytes(const void* data, int length)
 {
   throw rdr::Exception("writeBytes() is not valid with a JpegCompressor instance.  Use compress() instead.");
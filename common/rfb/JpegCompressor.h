@@ -25,7 +25,10 @@
 #ifndef __RFB_JPEGCOMPRESSOR_H__
 #define __RFB_JPEGCOMPRESSOR_H__
 
+#include <vector>
+
 #include <rdr/MemOutStream.h>
+#include <rfb/EncodedBuffer.h>
 #include <rfb/PixelFormat.h>
 #include <rfb/Rect.h>
 
@@ -44,6 +47,9 @@ namespace rfb {
     virtual ~JpegCompressor();
 
     void compress(const rdr::U8 *, int, const Rect&, const PixelFormat&, int, int);
+    // Same, but the image goes straight into out, reusing its capacity
+    void compress(const rdr::U8 *, int, const Rect&, const PixelFormat&, int, int,
+                  EncodedBuffer &out);
 
     void writeBytes(const void*, int);
 
@@ -0,0 +1,245 @@
+/* Copyright (C) 2026 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <rfb/Metrics.h>
+
+using namespace rfb;
+using namespace rfb::metrics;
+
+Registry metrics::registry;
+
+// Upper bounds in microseconds. Dense around one frame at common rates.
+const uint64_t Histogram::bounds[numBuckets] = {
+  100, 250, 500, 1000, 2500, 5000, 10000, 16000, 25000, 33000,
+  50000, 100000, 250000, 1000000
+};
+
+void Histogram::observe(const uint64_t us)
+{
+  unsigned i;
+  for (i = 0; i < numBuckets; i++) {
+    if (us <= bounds[i])
+      break;
+  }
+
+  buckets[i].fetch_add(1, std::memory_order_relaxed);
+  sum.fetch_add(us, std::memory_order_relaxed);
+  count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Histogram::format(std::string &out, const char *name, const char *labels) const
+{
+  char buf[512];
+  const char *sep = labels[0] ? "," : "";
+  uint64_t cumulative = 0;
+  unsigned i;
+
+  for (i = 0; i < numBuckets; i++) {
+    cumulative += buckets[i].load(std::memory_order_relaxed);
+    snprintf(buf, sizeof(buf), "%s_bucket{%s%sle=\"%g\"} %lu\n",
+             name, labels, sep, bounds[i] / 1000000.0, (unsigned long) cumulative);
+    out += buf;
+  }
+  cumulative += buckets[numBuckets].load(std::memory_order_relaxed);
+
+  snprintf(buf, sizeof(buf), "%s_bucket{%s%sle=\"+Inf\"} %lu\n",
+           name, labels, sep, (unsigned long) cumulative);
+  out += buf;
+
+  const char *open = labels[0] ? "{" : "", *close = labels[0] ? "}" : "";
+  snprintf(buf, sizeof(buf), "%s_sum%s%s%s %g\n%s_count%s%s%s %lu\n",
+           name, open, labels, close, sum.load(std::memory_order_relaxed) / 1000000.0,
+           name, open, labels, close,
+           (unsigned long) count.load(std::memory_order_relaxed));
+  out += buf;
+}
+
+Registry::Registry()
+{
+  memset(encoderNames, 0, sizeof(encoderNames));
+}
+
+void Registry::setEncoderName(const unsigned id, const char *name)
+{
+  if (id < maxEncoders)
+    encoderNames[id] = name;
+}
+
+void Registry::updateClient(const char *id, const ClientMetrics &m)
+{
+  std::lock_guard<std::mutex> lock(clientMutex);
+  clientStats[id] = m;
+}
+
+void Registry::removeClient(const char *id)
+{
+  std::lock_guard<std::mutex> lock(clientMutex);
+  clientStats.erase(id);
+}
+
+static void header(std::string &out, const char *name, const char *type,
+                   const char *help)
+{
+  out += "# HELP ";
+  out += name;
+  out += " ";
+  out += help;
+  out += "\n# TYPE ";
+  out += name;
+  out += " ";
+  out += type;
+  out += "\n";
+}
+
+static void value(std::string &out, const char *name, const char *labels,
+                  const uint64_t val)
+{
+  char buf[512];
+  if (labels[0])
+    snprintf(buf, sizeof(buf), "%s{%s} %lu\n", name, labels, (unsigned long) val);
+  else
+    snprintf(buf, sizeof(buf), "%s %lu\n", name, (unsigned long) val);
+  out += buf;
+}
+
+// Label values may contain anything the client sent us
+static std::string escapeLabel(const char *in)
+{
+  std::string out;
+  for (; *in; in++) {
+    if (*in == '\\' || *in == '"')
+      out += '\\';
+    if (*in == '\n')
+      out += "\\n";
+    else
+      out += *in;
+  }
+  return out;
+}
+
+std::string Registry::format() const
+{
+  std::string out;
+  char labels[256];
+  unsigned i;
+
+  header(out, "kasmvnc_grab_seconds", "histogram",
+         "Time spent grabbing damaged regions from the screen");
+  grabTime.format(out, "kasmvnc_grab_seconds", "");
+  header(out, "kasmvnc_compare_seconds", "histogram",
+         "Time spent comparing against the previous frame");
+  compareTime.format(out, "kasmvnc_compare_seconds", "");
+  header(out, "kasmvnc_analysis_seconds", "histogram",
+         "Time spent analysing a subrect to pick its encoder");
+  analysisTime.format(out, "kasmvnc_analysis_seconds", "");
+  header(out, "kasmvnc_frame_seconds", "histogram",
+         "Total time of a frame update for all clients");
+  frameTime.format(out, "kasmvnc_frame_seconds", "");
+  header(out, "kasmvnc_input_latency_seconds", "histogram",
+         "Time from applying client input to the next screen damage");
+  inputLatency.format(out, "kasmvnc_input_latency_seconds", "");
+  header(out, "kasmvnc_damage_latency_seconds", "histogram",
+         "Time from the first damage of a frame to the frame being sent");
+  damageLatency.format(out, "kasmvnc_damage_latency_seconds", "");
+
+  header(out, "kasmvnc_frames_total", "counter", "Frame updates processed");
+  value(out, "kasmvnc_frames_total", "", frames.value());
+  header(out, "kasmvnc_congestion_stalls_total", "counter",
+         "Updates held back because a client's link was congested");
+  value(out, "kasmvnc_congestion_stalls_total", "", congestionStalls.value());
+  header(out, "kasmvnc_clients", "gauge", "Connected clients");
+  value(out, "kasmvnc_clients", "", clients.value());
+
+  header(out, "kasmvnc_encode_cache_hits_total", "counter",
+         "Rects sent from the encode cache instead of being compressed");
+  value(out, "kasmvnc_encode_cache_hits_total", "", encCacheHits.value());
+  header(out, "kasmvnc_encode_cache_misses_total", "counter",
+         "Encode cache lookups that had to compress the rect");
+  value(out, "kasmvnc_encode_cache_misses_total", "", encCacheMisses.value());
+  header(out, "kasmvnc_encode_cache_evictions_total", "counter",
+         "Entries dropped from the encode cache to stay under its size");
+  value(out, "kasmvnc_encode_cache_evictions_total", "", encCacheEvictions.value());
+  header(out, "kasmvnc_encode_cache_bytes", "gauge",
+         "Compressed bytes held in the encode cache");
+  value(out, "kasmvnc_encode_cache_bytes", "", encCacheBytes.value());
+  header(out, "kasmvnc_cache_rect_draws_total", "counter",
+         "Tiles drawn from a client's cache instead of being sent");
+  value(out, "kasmvnc_cache_rect_draws_total", "", cacheRectDraws.value());
+  header(out, "kasmvnc_cache_rect_stores_total", "counter",
+         "Tiles a client was asked to keep in its cache");
+  value(out, "kasmvnc_cache_rect_stores_total", "", cacheRectStores.value());
+  header(out, "kasmvnc_deferred_rects_total", "counter",
+         "Rects put off to a later update to stay within the frame budget");
+  value(out, "kasmvnc_deferred_rects_total", "", deferredRects.value());
+
+  header(out, "kasmvnc_encoder_rects_total", "counter", "Rects sent per encoder");
+  for (i = 0; i < maxEncoders; i++) {
+    if (!encoderNames[i])
+      continue;
+    snprintf(labels, sizeof(labels), "encoder=\"%s\"", encoderNames[i]);
+    value(out, "kasmvnc_encoder_rects_total", labels, encoders[i].rects.value());
+  }
+  header(out, "kasmvnc_encoder_bytes_total", "counter", "Bytes sent per encoder");
+  for (i = 0; i < maxEncoders; i++) {
+    if (!encoderNames[i])
+      continue;
+    snprintf(labels, sizeof(labels), "encoder=\"%s\"", encoderNames[i]);
+    value(out, "kasmvnc_encoder_bytes_total", labels, encoders[i].bytes.value());
+  }
+  header(out, "kasmvnc_encoder_pixels_total", "counter", "Pixels sent per encoder");
+  for (i = 0; i < maxEncoders; i++) {
+    if (!encoderNames[i])
+      continue;
+    snprintf(labels, sizeof(labels), "encoder=\"%s\"", encoderNames[i]);
+    value(out, "kasmvnc_encoder_pixels_total", labels, encoders[i].pixels.value());
+  }
+  header(out, "kasmvnc_encode_seconds", "histogram", "Time spent encoding one rect");
+  for (i = 0; i < maxEncoders; i++) {
+    if (!encoderNames[i])
+      continue;
+    snprintf(labels, sizeof(labels), "encoder=\"%s\"", encoderNames[i]);
+    encoders[i].encodeTime.format(out, "kasmvnc_encode_seconds", labels);
+  }
+
+  std::lock_guard<std::mutex> lock(clientMutex);
+  std::map<std::string, ClientMetrics>::const_iterator it;
+
+  header(out, "kasmvnc_client_bandwidth_bytes", "gauge",
+         "Estimated bandwidth to a client, in bytes per second");
+  for (it = clientStats.begin(); it != clientStats.end(); it++) {
+    snprintf(labels, sizeof(labels), "client=\"%s\"", escapeLabel(it->first.c_str()).c_str());
+    value(out, "kasmvnc_client_bandwidth_bytes", labels, it->second.bandwidth);
+  }
+  header(out, "kasmvnc_client_rtt_seconds", "gauge", "Round trip time to a client");
+  for (it = clientStats.begin(); it != clientStats.end(); it++) {
+    char buf[512];
+    snprintf(buf, sizeof(buf), "kasmvnc_client_rtt_seconds{client=\"%s\"} %g\n",
+             escapeLabel(it->first.c_str()).c_str(), it->second.rtt / 1000.0);
+    out += buf;
+  }
+  header(out, "kasmvnc_client_queued_bytes", "gauge",
+         "Bytes waiting in a client's send buffer");
+  for (it = clientStats.begin(); it != clientStats.end(); it++) {
+    snprintf(labels, sizeof(labels), "client=\"%s\"", escapeLabel(it->first.c_str()).c_str());
+    value(out, "kasmvnc_client_queued_bytes", labels, it->second.queued);
+  }
+
+  return out;
+}
@@ -0,0 +1,133 @@
+/* Copyright (C) 2026 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+//
+// Metrics - always-on counters and histograms for the encode pipeline,
+// exported in the Prometheus text format through the API listener.
+//
+// Updates are relaxed atomics and safe from any thread, including the
+// encoder workers. Each metric lives on its own cache line.
+//
+
+#ifndef __RFB_METRICS_H__
+#define __RFB_METRICS_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace rfb {
+
+  namespace metrics {
+
+    class Counter {
+    public:
+      void add(const uint64_t n = 1) { val.fetch_add(n, std::memory_order_relaxed); }
+      uint64_t value() const { return val.load(std::memory_order_relaxed); }
+
+    private:
+      alignas(64) std::atomic<uint64_t> val{0};
+    };
+
+    class Gauge {
+    public:
+      void set(const int64_t n) { val.store(n, std::memory_order_relaxed); }
+      void add(const int64_t n) { val.fetch_add(n, std::memory_order_relaxed); }
+      int64_t value() const { return val.load(std::memory_order_relaxed); }
+
+    private:
+      alignas(64) std::atomic<int64_t> val{0};
+    };
+
+    // Durations, observed in microseconds and exported in seconds
+    class Histogram {
+    public:
+      static const unsigned numBuckets = 14;
+
+      void observe(const uint64_t us);
+      void format(std::string &out, const char *name, const char *labels) const;
+
+    private:
+      static const uint64_t bounds[numBuckets];
+
+      alignas(64) std::atomic<uint64_t> buckets[numBuckets + 1] = {};
+      std::atomic<uint64_t> sum{0}, count{0};
+    };
+
+    // Microseconds elapsed since start, for feeding histograms
+    inline uint64_t usSince(const std::chrono::steady_clock::time_point &start) {
+      return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now() - start).count();
+    }
+
+    static const unsigned maxEncoders = 16;
+
+    struct EncoderMetrics {
+      Counter rects, bytes, pixels;
+      Histogram encodeTime;
+    };
+
+    struct ClientMetrics {
+      uint64_t bandwidth; // bytes per second, estimated
+      unsigned rtt;       // ms
+      size_t queued;      // bytes waiting in the send buffer
+    };
+
+    class Registry {
+    public:
+      Registry();
+
+      Histogram grabTime, compareTime, analysisTime, frameTime;
+      // From applying client input to the first damage that follows it
+      Histogram inputLatency;
+      // From the first damage of a frame to the frame being sent
+      Histogram damageLatency;
+      Counter frames, congestionStalls;
+      Gauge clients;
+      // Compressed rects reused from the shared EncCache
+      Counter encCacheHits, encCacheMisses, encCacheEvictions;
+      Gauge encCacheBytes;
+      // Tiles drawn from, and stored in, the clients' own caches
+      Counter cacheRectDraws, cacheRectStores;
+      // Rects put off to a later update to stay within the frame budget
+      Counter deferredRects;
+
+      EncoderMetrics encoders[maxEncoders];
+      void setEncoderName(const unsigned id, const char *name);
+
+      // Per-client values are only set from the main thread, once a frame
+      void updateClient(const char *id, const ClientMetrics &m);
+      void removeClient(const char *id);
+
+      std::string format() const;
+
+    private:
+      const char *encoderNames[maxEncoders];
+
+      mutable std::mutex clientMutex;
+      std::map<std::string, ClientMetrics> clientStats;
+    };
+
+    extern Registry registry;
+  }
+}
+
+#endif
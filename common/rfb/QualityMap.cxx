@@ -0,0 +1,167 @@
+/* Copyright (C) 2026 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#include <rfb/QualityMap.h>
+#include <rfb/util.h>
+
+using namespace rfb;
+
+static const unsigned ScoreIncrement = 32;
+static const unsigned ForgetTime = 5000;
+// lastChange of a cell that isn't being tracked
+static const uint32_t Untracked = 0xffffffff;
+
+QualityMap::QualityMap()
+  : width_(0), height_(0), cellsX(0), cellsY(0)
+{
+  gettimeofday(&epoch, NULL);
+}
+
+void QualityMap::resize(int width, int height)
+{
+  width_ = width;
+  height_ = height;
+  cellsX = (width + cellSize - 1) >> cellShift;
+  cellsY = (height + cellSize - 1) >> cellShift;
+
+  const size_t cells = (size_t)cellsX * cellsY;
+  score.assign(cells, 0);
+  lastChange.assign(cells, Untracked);
+  lastQuality.assign(cells, -1);
+}
+
+unsigned QualityMap::now() const
+{
+  return msSince(&epoch);
+}
+
+bool QualityMap::cellRange(const Rect& r, int *cx1, int *cy1,
+                           int *cx2, int *cy2) const
+{
+  int x1, y1, x2, y2;
+
+  x1 = r.tl.x < 0 ? 0 : r.tl.x;
+  y1 = r.tl.y < 0 ? 0 : r.tl.y;
+  x2 = r.br.x > width_ ? width_ : r.br.x;
+  y2 = r.br.y > height_ ? height_ : r.br.y;
+  if (x1 >= x2 || y1 >= y2)
+    return false;
+
+  *cx1 = x1 >> cellShift;
+  *cy1 = y1 >> cellShift;
+  *cx2 = ((x2 - 1) >> cellShift) + 1;
+  *cy2 = ((y2 - 1) >> cellShift) + 1;
+
+  return true;
+}
+
+void QualityMap::touch(const Rect& r)
+{
+  int cx1, cy1, cx2, cy2;
+
+  if (!cellRange(r, &cx1, &cy1, &cx2, &cy2))
+    return;
+
+  const uint32_t t = now();
+
+  for (int cy = cy1; cy < cy2; cy++) {
+    uint16_t *s = &score[(size_t)cy * cellsX];
+    uint32_t *l = &lastChange[(size_t)cy * cellsX];
+    for (int cx = cx1; cx < cx2; cx++) {
+      const unsigned v = s[cx] + ScoreIncrement;
+      if (l[cx] == Untracked)
+        s[cx] = 0;
+      else
+        s[cx] = v > 0xffff ? 0xffff : v;
+      l[cx] = t;
+    }
+  }
+}
+
+void QualityMap::decay()
+{
+  const uint32_t t = now();
+  const size_t cells = score.size();
+  uint16_t *s = score.data();
+  uint32_t *l = lastChange.data();
+
+  // Branch free so the compiler can vectorise it
+  for (size_t i = 0; i < cells; i++) {
+    const bool forget = t - l[i] > ForgetTime;
+    const uint16_t kept = s[i] - (s[i] >> 4);
+    s[i] = forget ? 0 : kept;
+    l[i] = forget ? Untracked : l[i];
+  }
+}
+
+unsigned QualityMap::getQuality(const Rect& r) const
+{
+  int cx1, cy1, cx2, cy2;
+  unsigned long long total;
+
+  if (!cellRange(r, &cx1, &cy1, &cx2, &cy2))
+    return 128;
+
+  total = 0;
+  for (int cy = cy1; cy < cy2; cy++) {
+    const uint16_t *s = &score[(size_t)cy * cellsX];
+    for (int cx = cx1; cx < cx2; cx++)
+      total += s[cx];
+  }
+
+  unsigned avg = total / ((cx2 - cx1) * (cy2 - cy1));
+  if (avg > 128)
+    avg = 128;
+
+  return 128 - avg;
+}
+
+void QualityMap::setLastQuality(const Rect& r, int quality)
+{
+  int cx1, cy1, cx2, cy2;
+
+  if (!cellRange(r, &cx1, &cy1, &cx2, &cy2))
+    return;
+
+  for (int cy = cy1; cy < cy2; cy++) {
+    int8_t *q = &lastQuality[(size_t)cy * cellsX];
+    for (int cx = cx1; cx < cx2; cx++)
+      q[cx] = quality;
+  }
+}
+
+int QualityMap::getLastQuality(const Rect& r) const
+{
+  int cx1, cy1, cx2, cy2;
+  int lowest;
+
+  if (!cellRange(r, &cx1, &cy1, &cx2, &cy2))
+    return -1;
+
+  // The worst of the covered cells is what the client is showing
+  lowest = -1;
+  for (int cy = cy1; cy < cy2; cy++) {
+    const int8_t *q = &lastQuality[(size_t)cy * cellsX];
+    for (int cx = cx1; cx < cx2; cx++) {
+      if (q[cx] >= 0 && (lowest < 0 || q[cx] < lowest))
+        lowest = q[cx];
+    }
+  }
+
+  return lowest;
+}
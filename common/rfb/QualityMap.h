@@ -0,0 +1,86 @@
+/* Copyright (C) 2026 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+//
+// QualityMap - per-cell history for dynamic quality. The screen is split
+// into 64x64 cells, each holding a decaying change score and the quality it was last sent
+// at. Tracking and
+// lookups cost one step per covered cell, however many areas are
+// changing.
+//
+
+#ifndef __RFB_QUALITYMAP_H__
+#define __RFB_QUALITYMAP_H__
+
+#include <stdint.h>
+#include <sys/time.h>
+
+#include <vector>
+
+#include <rfb/Rect.h>
+
+namespace rfb {
+
+  class QualityMap {
+  public:
+    static const int cellShift = 6;
+    static const int cellSize = 1 << cellShift;
+
+    QualityMap();
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+
+    // Sets the screen size and drops all history
+    void resize(int width, int height);
+
+    // Records a change in r. Cells not yet tracked start at a score of
+    // 0, later changes add to it.
+    void touch(const Rect& r);
+
+    // Ages all cells, called once per update. Cells not changed in 5s
+    // are forgotten.
+    void decay();
+
+    // Change-tracked quality, 0-128, where 128 is max quality
+    unsigned getQuality(const Rect& r) const;
+
+    // Quality level (0-9) r was last sent at, -1 if never sent lossy
+    void setLastQuality(const Rect& r, int quality);
+    int getLastQuality(const Rect& r) const;
+
+  private:
+    // Covered cells, false if r is off screen
+    bool cellRange(const Rect& r, int *cx1, int *cy1,
+                   int *cx2, int *cy2) const;
+
+    unsigned now() const;
+
+  private:
+    int width_, height_;
+    int cellsX, cellsY;
+    struct timeval epoch;
+
+    std::vector<uint16_t> score;
+    std::vector<uint32_t> lastChange;
+    std::vector<int8_t> lastQuality;
+  };
+
+}
+
+#endif
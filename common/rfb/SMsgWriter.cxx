@@ -391,6 +391,26 @@ void SMsgWriter::writeCopyRect(const Rect& r, int srcX, int srcY)
   endRect();
 }
 
+void SMsgWriter::writeCacheRect(const Rect& r, int op, rdr::U32 id)
+{
+  if (!cp->supportsCacheRect)
+    throw Exception("Client does not support cache rects");
+
+  startRect(r, pseudoEncodingCacheRect);
+  os->writeU8(op);
+  os->writeU32(id);
+  endRect();
+}
+
+void SMsgWriter::writeTightZstd()
+{
+  if (!cp->supportsTightZstd)
+    throw Exception("Client does not support zstd in Tight rects");
+
+  startRect(Rect(), pseudoEncodingTightZstd);
+  endRect();
+}
+
 void SMsgWriter::startRect(const Rect& r, int encoding)
 {
   if (++nRectsInUpdate > nRectsInHeader && nRectsInHeader)
@@ -123,6 +123,12 @@ namespace rfb {
     // There is no explicit encoder for CopyRect rects.
     void writeCopyRect(const Rect& r, int srcX, int srcY);
 
+    // Stores or draws a tile in the client's cache, see CacheRect.h
+    void writeCacheRect(const Rect& r, int op, rdr::U32 id);
+
+    // Tells the client that Tight rects use zstd from now on
+    void writeTightZstd();
+
     // Encoders should call these to mark the start and stop of individual
     // rects.
     void startRect(const Rect& r, int enc);
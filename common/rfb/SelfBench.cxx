@@ -77,7 +77,7 @@ void SelfBench() {
 	vlog.info("Running micro-benchmarks (single-threaded, runs depending on task)");
 
 	// Encoding
-	std::vector<uint8_t> vec;
+	EncodedBuffer vec;
 
 	TightJPEGEncoder jpeg(nullptr);
 
@@ -56,6 +56,23 @@ rfb::IntParameter rfb::Server::frameRate
 ("FrameRate",
  "The maximum number of updates per second sent to each client",
  60);
+rfb::BoolParameter rfb::Server::adaptiveFrameClock
+("AdaptiveFrameClock",
+ "Send an update as soon as an idle screen changes instead of on the next "
+ "frame tick. Continuous changes are still sent at most FrameRate times per "
+ "second",
+ false);
+rfb::IntParameter rfb::Server::frameClockMinDelay
+("FrameClockMinDelay",
+ "Milliseconds to wait for more changes before sending an update to an idle "
+ "screen, with AdaptiveFrameClock",
+ 2, 0, 1000);
+rfb::IntParameter rfb::Server::frameBudget
+("FrameBudget",
+ "Percentage of the frame interval an update may spend encoding. Changes "
+ "that don't fit are sent in the next updates, those near the pointer "
+ "first. 0 = off",
+ 80, 0, 100);
 rfb::BoolParameter rfb::Server::protocol3_3
 ("Protocol3.3",
  "Always use protocol version 3.3 for backwards compatibility with "
@@ -139,6 +156,11 @@ rfb::IntParameter rfb::Server::treatLossless
 ("TreatLossless",
  "Treat lossy quality levels above and including this as lossless, 0-9. 10 = off",
  10, 0, 10);
+rfb::BoolParameter rfb::Server::contentClassify
+("ContentClassify",
+ "Pick the encoder for each part of the screen by what it shows: text stays "
+ "lossless, gradients and photos go to JPEG or WebP",
+ true);
 rfb::IntParameter rfb::Server::scrollDetectLimit
 ("ScrollDetectLimit",
  "At least this % of the screen must change for scroll detection to happen, default 25.",
@@ -147,6 +169,21 @@ rfb::IntParameter rfb::Server::rectThreads
 ("RectThreads",
  "Use this many threads to compress rects in parallel. Default 0 (auto), 1 = off",
  0, 0, 64);
+rfb::BoolParameter rfb::Server::parallelLossless
+("ParallelLossless",
+ "Compress Tight rects in parallel too, with their own zlib streams. Uses a "
+ "little more bandwidth",
+ false);
+rfb::BoolParameter rfb::Server::tightDelta
+("TightDelta",
+ "Send rects that changed only a little as their difference from what the "
+ "client shows, if it supports that. Keeps a copy of the client's screen",
+ true);
+rfb::IntParameter rfb::Server::encodeCacheSize
+("EncodeCacheSize",
+ "Megabytes of compressed rects to keep for reuse when the same pixels are "
+ "sent again, shared by all clients. 0 = off",
+ 64, 0, 4096);
 rfb::IntParameter rfb::Server::jpegVideoQuality
 ("JpegVideoQuality",
  "The JPEG quality to use when in video mode",
@@ -286,6 +323,16 @@ rfb::BoolParameter rfb::Server::printVideoArea
 ("PrintVideoArea",
  "Print the detected video area % value.",
  false);
+rfb::BoolParameter rfb::Server::tracePipeline
+("TracePipeline",
+ "Record per-frame pipeline trace events from startup. They can be fetched as "
+ "Chrome trace-event JSON through the API, which can also toggle tracing.",
+ false);
+rfb::BoolParameter rfb::Server::inputPriority
+("InputPriority",
+ "Read and apply pending client input before each frame is encoded, and "
+ "merge consecutive pointer moves from a client into the latest position.",
+ false);
 
 rfb::StringParameter rfb::Server::kasmPasswordFile
 ("KasmPasswordFile",
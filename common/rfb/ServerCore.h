@@ -37,11 +37,18 @@ namespace rfb {
         static IntParameter clientWaitTimeMillis;
         static IntParameter compareFB;
         static IntParameter frameRate;
+        static BoolParameter adaptiveFrameClock;
+        static IntParameter frameClockMinDelay;
+        static IntParameter frameBudget;
         static IntParameter dynamicQualityMin;
         static IntParameter dynamicQualityMax;
         static IntParameter treatLossless;
+        static BoolParameter contentClassify;
         static IntParameter scrollDetectLimit;
         static IntParameter rectThreads;
+        static BoolParameter parallelLossless;
+        static BoolParameter tightDelta;
+        static IntParameter encodeCacheSize;
         static IntParameter DLP_ClipSendMax;
         static IntParameter DLP_ClipAcceptMax;
         static IntParameter DLP_ClipDelay;
@@ -81,6 +88,8 @@ namespace rfb {
         static StringParameter publicIP;
         static StringParameter stunServer;
         static BoolParameter printVideoArea;
+        static BoolParameter tracePipeline;
+        static BoolParameter inputPriority;
         static BoolParameter protocol3_3;
         static BoolParameter alwaysShared;
         static BoolParameter neverShared;
@@ -32,5 +32,7 @@ namespace rfb {
   const unsigned int tightFilterCopy = 0x00;
   const unsigned int tightFilterPalette = 0x01;
   const unsigned int tightFilterGradient = 0x02;
+  // XOR with the pixels already shown, see pseudoEncodingTightDelta
+  const unsigned int tightFilterDelta = 0x03;
 }
 #endif
@@ -117,6 +117,10 @@ void TightDecoder::readRect(const Rect& r, rdr::InStream* is,
       break;
     case tightFilterCopy:
       break;
+    case tightFilterDelta:
+      if (!cp.supportsTightDelta)
+        throw Exception("TightDecoder: unexpected delta filter received");
+      break;
     default:
       throw Exception("TightDecoder: unknown filter code received");
     }
@@ -193,10 +197,20 @@ void TightDecoder::decodeRect(const Rect& r, const void* buffer,
   bufptr += 1;
   buflen -= 1;
 
+#ifndef HAVE_ZSTD
+  if (cp.tightZstd)
+    throw Exception("TightDecoder: built without zstd support");
+#endif
+
   // Reset zlib streams if we are told by the server to do so.
   for (int i = 0; i < 4; i++) {
     if (comp_ctl & 1) {
-      zis[i].reset();
+#ifdef HAVE_ZSTD
+      if (cp.tightZstd)
+        zstdis[i].reset();
+      else
+#endif
+        zis[i].reset();
     }
     comp_ctl >>= 1;
   }
@@ -247,6 +261,7 @@ void TightDecoder::decodeRect(const Rect& r, const void* buffer,
   int palSize = 0;
   rdr::U8 palette[256 * 4];
   bool useGradient = false;
+  bool useDelta = false;
 
   if ((comp_ctl & tightExplicitFilter) != 0) {
     rdr::U8 filterId;
@@ -292,6 +307,9 @@ void TightDecoder::decodeRect(const Rect& r, const void* buffer,
       break;
     case tightFilterCopy:
       break;
+    case tightFilterDelta:
+      useDelta = true;
+      break;
     default:
       assert(false);
     }
@@ -333,15 +351,23 @@ void TightDecoder::decodeRect(const Rect& r, const void* buffer,
 
     streamId = comp_ctl & 0x03;
     ms = new rdr::MemInStream(bufptr, len);
-    zis[streamId].setUnderlying(ms, len);
 
     // Allocate buffer and decompress the data
     netbuf = new rdr::U8[dataSize];
 
-    zis[streamId].readBytes(netbuf, dataSize);
-
-    zis[streamId].flushUnderlying();
-    zis[streamId].setUnderlying(NULL, 0);
+#ifdef HAVE_ZSTD
+    if (cp.tightZstd) {
+      zstdis[streamId].setUnderlying(ms, len);
+      zstdis[streamId].readBytes(netbuf, dataSize);
+      zstdis[streamId].flushUnderlying();
+    } else
+#endif
+    {
+      zis[streamId].setUnderlying(ms, len);
+      zis[streamId].readBytes(netbuf, dataSize);
+      zis[streamId].flushUnderlying();
+      zis[streamId].setUnderlying(NULL, 0);
+    }
     delete ms;
 
     bufptr = netbuf;
@@ -354,7 +380,7 @@ void TightDecoder::decodeRect(const Rect& r, const void* buffer,
   rdr::U8* outbuf;
   int stride;
 
-  if (pb->getPF().equal(pf)) {
+  if (pb->getPF().equal(pf) && !useDelta) {
     // Decode directly into the framebuffer (fast path)
     directDecode = true;
   } else {
@@ -427,6 +453,19 @@ void TightDecoder::decodeRect(const Rect& r, const void* buffer,
     }
   }
 
+  // The pixels are XORed with the ones we are showing, which only
+  // differ where they have changed
+  if (useDelta) {
+    size_t len = r.area() * (pf.bpp/8);
+    rdr::U8* shown = new rdr::U8[len];
+
+    pb->getImage(pf, shown, r);
+    for (size_t i = 0; i < len; i++)
+      outbuf[i] ^= shown[i];
+
+    delete [] shown;
+  }
+
   if (directDecode)
     pb->commitBufferRW(r);
   else {
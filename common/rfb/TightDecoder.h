@@ -21,6 +21,7 @@
 #define __RFB_TIGHTDECODER_H__
 
 #include <rdr/ZlibInStream.h>
+#include <rdr/ZstdInStream.h>
 #include <rfb/Decoder.h>
 #include <rfb/JpegDecompressor.h>
 
@@ -67,6 +68,9 @@ namespace rfb {
 
   private:
     rdr::ZlibInStream zis[4];
+#ifdef HAVE_ZSTD
+    rdr::ZstdInStream zstdis[4];
+#endif
   };
 }
 
@@ -56,6 +56,13 @@ static const TightConf conf[10] = {
   { 9, 9, 9 }  // 9
 };
 
+#ifdef HAVE_ZSTD
+// zstd levels for each zlib level above. zstd is already faster than
+// zlib at its low levels, so 0 means its fastest (negative) level
+// rather than no compression.
+static const int zstdLevel[10] = { -5, 1, 1, 2, 3, 3, 4, 5, 7, 9 };
+#endif
+
 TightEncoder::TightEncoder(SConnection* conn) :
   Encoder(conn, encodingTight, EncoderPlain, 256), zlibNeedsReset(false)
 {
@@ -82,19 +89,107 @@ void TightEncoder::setCompressLevel(int level)
 }
 
 void TightEncoder::writeRect(const PixelBuffer* pb, const Palette& palette)
+{
+  Output dest;
+
+  if (palette.size() == 1) {
+    Encoder::writeSolidRect(pb, palette);
+    return;
+  }
+
+  dest.os = conn->getOutStream(conn->cp.supportsUdp);
+  for (int i = 0; i < 4; i++) {
+    dest.zlibStreams[i] = &zlibStreams[i];
+#ifdef HAVE_ZSTD
+    dest.zstdStreams[i] = conn->cp.tightZstd ? &zstdStreams[i] : NULL;
+#endif
+  }
+  dest.memStream = &memStream;
+  dest.resetZlib = conn->cp.supportsUdp || zlibNeedsReset;
+
+  encodeRect(pb, palette, dest);
+}
+
+// Every rect compressed on the side starts from a fresh stream, so one
+// per thread is enough
+static thread_local rdr::ZlibOutStream sideZlibStream;
+#ifdef HAVE_ZSTD
+static thread_local rdr::ZstdOutStream sideZstdStream;
+#endif
+static thread_local rdr::MemOutStream sideZlibData, sideOs;
+
+void TightEncoder::compressOnly(const PixelBuffer* pb, const Palette& palette,
+                                EncodedBuffer &out) const
+{
+  Output dest;
+
+  assert(palette.size() != 1);
+
+  sideOutput(&dest);
+  encodeRect(pb, palette, dest);
+
+  out.assign((const rdr::U8*) sideOs.data(),
+             (const rdr::U8*) sideOs.data() + sideOs.length());
+}
+
+void TightEncoder::compressDelta(const PixelBuffer* pb,
+                                 EncodedBuffer &out) const
+{
+  Output dest;
+
+  sideOutput(&dest);
+  writeRawRect(pb, true, dest);
+
+  out.assign((const rdr::U8*) sideOs.data(),
+             (const rdr::U8*) sideOs.data() + sideOs.length());
+}
+
+void TightEncoder::sideOutput(Output* dest) const
+{
+  sideOs.clear();
+
+  dest->os = &sideOs;
+  for (int i = 0; i < 4; i++) {
+    dest->zlibStreams[i] = &sideZlibStream;
+#ifdef HAVE_ZSTD
+    dest->zstdStreams[i] = conn->cp.tightZstd ? &sideZstdStream : NULL;
+#endif
+  }
+  dest->memStream = &sideZlibData;
+  dest->resetZlib = true;
+}
+
+void TightEncoder::writeOnly(const EncodedBuffer &out)
+{
+  // The client resets the streams that the control byte flags, so
+  // ours have to start over too. Only those, the others keep their
+  // history.
+  if (!out.empty() && !(out[0] & 0x80)) {
+    for (int i = 0; i < 4; i++) {
+      if (!(out[0] & (1 << i)))
+        continue;
+      zlibStreams[i].resetDeflate();
+#ifdef HAVE_ZSTD
+      zstdStreams[i].reset();
+#endif
+    }
+  }
+
+  conn->getOutStream(conn->cp.supportsUdp)->writeBytes(out.data(), out.size());
+}
+
+void TightEncoder::encodeRect(const PixelBuffer* pb, const Palette& palette,
+                              const Output& dest) const
 {
   switch (palette.size()) {
   case 0:
-    writeFullColourRect(pb, palette);
-    break;
-  case 1:
-    Encoder::writeSolidRect(pb, palette);
+    writeFullColourRect(pb, palette, dest);
     break;
   case 2:
-    writeMonoRect(pb, palette);
+    writeMonoRect(pb, palette, dest);
     break;
   default:
-    writeIndexedRect(pb, palette);
+    writeIndexedRect(pb, palette, dest);
   }
 }
 
@@ -110,7 +205,8 @@ void TightEncoder::writeSolidRect(int width, int height,
   writePixels(colour, pf, 1, os);
 }
 
-void TightEncoder::writeMonoRect(const PixelBuffer* pb, const Palette& palette)
+void TightEncoder::writeMonoRect(const PixelBuffer* pb, const Palette& palette,
+                                 const Output& dest) const
 {
   const rdr::U8* buffer;
   int stride;
@@ -120,19 +216,20 @@ void TightEncoder::writeMonoRect(const PixelBuffer* pb, const Palette& palette)
   switch (pb->getPF().bpp) {
   case 32:
     writeMonoRect(pb->width(), pb->height(), (rdr::U32*)buffer, stride,
-                  pb->getPF(), palette);
+                  pb->getPF(), palette, dest);
     break;
   case 16:
     writeMonoRect(pb->width(), pb->height(), (rdr::U16*)buffer, stride,
-                  pb->getPF(), palette);
+                  pb->getPF(), palette, dest);
     break;
   default:
     writeMonoRect(pb->width(), pb->height(), (rdr::U8*)buffer, stride,
-                  pb->getPF(), palette);
+                  pb->getPF(), palette, dest);
   }
 }
 
-void TightEncoder::writeIndexedRect(const PixelBuffer* pb, const Palette& palette)
+void TightEncoder::writeIndexedRect(const PixelBuffer* pb, const Palette& palette,
+                                    const Output& dest) const
 {
   const rdr::U8* buffer;
   int stride;
@@ -142,19 +239,26 @@ void TightEncoder::writeIndexedRect(const PixelBuffer* pb, const Palette& palett
   switch (pb->getPF().bpp) {
   case 32:
     writeIndexedRect(pb->width(), pb->height(), (rdr::U32*)buffer, stride,
-                     pb->getPF(), palette);
+                     pb->getPF(), palette, dest);
     break;
   case 16:
     writeIndexedRect(pb->width(), pb->height(), (rdr::U16*)buffer, stride,
-                     pb->getPF(), palette);
+                     pb->getPF(), palette, dest);
     break;
   default:
     // It's more efficient to just do raw pixels
-    writeFullColourRect(pb, palette);
+    writeFullColourRect(pb, palette, dest);
   }
 }
 
-void TightEncoder::writeFullColourRect(const PixelBuffer* pb, const Palette& palette)
+void TightEncoder::writeFullColourRect(const PixelBuffer* pb, const Palette& palette,
+                                       const Output& dest) const
+{
+  writeRawRect(pb, false, dest);
+}
+
+void TightEncoder::writeRawRect(const PixelBuffer* pb, bool delta,
+                                const Output& dest) const
 {
   const int streamId = 0;
 
@@ -165,11 +269,19 @@ void TightEncoder::writeFullColourRect(const PixelBuffer* pb, const Palette& pal
   const rdr::U8* buffer;
   int stride, h;
 
-  os = conn->getOutStream(conn->cp.supportsUdp);
-  if (conn->cp.supportsUdp || zlibNeedsReset)
-    os->writeU8((streamId << 4) | (1 << streamId));
-  else
-    os->writeU8(streamId << 4);
+  os = dest.os;
+  if (delta) {
+    if (dest.resetZlib)
+      os->writeU8(((streamId | tightExplicitFilter) << 4) | (1 << streamId));
+    else
+      os->writeU8((streamId | tightExplicitFilter) << 4);
+    os->writeU8(tightFilterDelta);
+  } else {
+    if (dest.resetZlib)
+      os->writeU8((streamId << 4) | (1 << streamId));
+    else
+      os->writeU8(streamId << 4);
+  }
 
   // Set up compression
   if ((pb->getPF().bpp != 32) || !pb->getPF().is888())
@@ -177,7 +289,7 @@ void TightEncoder::writeFullColourRect(const PixelBuffer* pb, const Palette& pal
   else
     length = pb->getRect().area() * 3;
 
-  zos = getZlibOutStream(streamId, rawZlibLevel, length);
+  zos = getZlibOutStream(dest, streamId, rawZlibLevel, length);
 
   // And then just dump all the raw pixels
   buffer = pb->getBuffer(pb->getRect(), &stride);
@@ -189,11 +301,11 @@ void TightEncoder::writeFullColourRect(const PixelBuffer* pb, const Palette& pal
   }
 
   // Finish the zlib stream
-  flushZlibOutStream(zos);
+  flushZlibOutStream(dest, zos);
 }
 
 void TightEncoder::writePixels(const rdr::U8* buffer, const PixelFormat& pf,
-                               unsigned int count, rdr::OutStream* os)
+                               unsigned int count, rdr::OutStream* os) const
 {
   rdr::U8 rgb[2048];
 
@@ -217,7 +329,7 @@ void TightEncoder::writePixels(const rdr::U8* buffer, const PixelFormat& pf,
   }
 }
 
-void TightEncoder::writeCompact(rdr::OutStream* os, rdr::U32 value)
+void TightEncoder::writeCompact(rdr::OutStream* os, rdr::U32 value) const
 {
   rdr::U8 b;
   b = value & 0x7F;
@@ -235,41 +347,67 @@ void TightEncoder::writeCompact(rdr::OutStream* os, rdr::U32 value)
   }
 }
 
-rdr::OutStream* TightEncoder::getZlibOutStream(int streamId, int level, size_t length)
+rdr::OutStream* TightEncoder::getZlibOutStream(const Output& dest, int streamId,
+                                               int level, size_t length) const
 {
   // Minimum amount of data to be compressed. This value should not be
   // changed, doing so will break compatibility with existing clients.
   if (length < 12)
-    return conn->getOutStream(conn->cp.supportsUdp);
+    return dest.os;
 
   assert(streamId >= 0);
   assert(streamId < 4);
 
-  zlibStreams[streamId].setUnderlying(&memStream);
-  zlibStreams[streamId].setCompressionLevel(level);
-  if (conn->cp.supportsUdp || zlibNeedsReset)
-    zlibStreams[streamId].resetDeflate();
+#ifdef HAVE_ZSTD
+  if (dest.zstdStreams[streamId]) {
+    dest.zstdStreams[streamId]->setUnderlying(dest.memStream);
+    dest.zstdStreams[streamId]->setCompressionLevel(zstdLevel[level]);
+    if (dest.resetZlib)
+      dest.zstdStreams[streamId]->reset();
+
+    return dest.zstdStreams[streamId];
+  }
+#endif
+
+  dest.zlibStreams[streamId]->setUnderlying(dest.memStream);
+  dest.zlibStreams[streamId]->setCompressionLevel(level);
+  if (dest.resetZlib)
+    dest.zlibStreams[streamId]->resetDeflate();
 
-  return &zlibStreams[streamId];
+  return dest.zlibStreams[streamId];
 }
 
-void TightEncoder::flushZlibOutStream(rdr::OutStream* os_)
+void TightEncoder::flushZlibOutStream(const Output& dest, rdr::OutStream* os_) const
 {
   rdr::OutStream* os;
   rdr::ZlibOutStream* zos;
+#ifdef HAVE_ZSTD
+  rdr::ZstdOutStream* zstdos;
+#endif
 
-  zos = dynamic_cast<rdr::ZlibOutStream*>(os_);
-  if (zos == NULL)
+  // Too little data to be compressed, it went straight out
+  if (os_ == dest.os)
     return;
 
-  zos->flush();
-  zos->setUnderlying(NULL);
+  zos = dynamic_cast<rdr::ZlibOutStream*>(os_);
+  if (zos != NULL) {
+    zos->flush();
+    zos->setUnderlying(NULL);
+  }
+
+#ifdef HAVE_ZSTD
+  zstdos = dynamic_cast<rdr::ZstdOutStream*>(os_);
+  if (zstdos != NULL) {
+    zstdos->flush();
+    zstdos->setUnderlying(NULL);
+  }
+#endif
 
-  os = conn->getOutStream(conn->cp.supportsUdp);
+  os = dest.os;
 
-  writeCompact(os, memStream.length());
-  os->writeBytes(memStream.data(), memStream.length());
-  memStream.clear();
+  writeCompact(os, dest.memStream->length());
+  os->writeBytes(dest.memStream->data(), dest.memStream->length());
+  dest.memStream->clear();
 }
 
 void TightEncoder::resetZlib()
@@ -22,7 +22,11 @@
 
 #include <rdr/MemOutStream.h>
 #include <rdr/ZlibOutStream.h>
+#include <rdr/ZstdOutStream.h>
+#include <rfb/EncodedBuffer.h>
 #include <rfb/Encoder.h>
+#include <stdint.h>
+#include <vector>
 
 namespace rfb {
 
@@ -46,39 +50,82 @@ namespace rfb {
                             const rdr::U8 a);
     void resetZlib();
 
+    // Encodes a non-solid rect into out using zlib streams of its own,
+    // so several rects can be compressed at once. The client is told to
+    // reset the stream such a rect uses, and writeOnly() resets ours to
+    // match, so these mix freely with writeRect().
+    void compressOnly(const PixelBuffer* pb, const Palette& palette,
+                      EncodedBuffer &out) const;
+    void writeOnly(const EncodedBuffer &out);
+
+    // Like compressOnly(), but pb holds the XOR of the new pixels with
+    // the ones the client shows, which it XORs back in
+    void compressDelta(const PixelBuffer* pb, EncodedBuffer &out) const;
+
   protected:
-    void writeMonoRect(const PixelBuffer* pb, const Palette& palette);
-    void writeIndexedRect(const PixelBuffer* pb, const Palette& palette);
-    void writeFullColourRect(const PixelBuffer* pb, const Palette& palette);
+    // Where an encoded rect and its zlib data go
+    struct Output {
+      rdr::OutStream* os;
+      rdr::ZlibOutStream* zlibStreams[4];
+#ifdef HAVE_ZSTD
+      rdr::ZstdOutStream* zstdStreams[4]; // Replace zlib when set
+#endif
+      rdr::MemOutStream* memStream;
+      bool resetZlib;
+    };
+
+    // Points dest at per-thread streams, for compressing on the side
+    void sideOutput(Output* dest) const;
+
+    void encodeRect(const PixelBuffer* pb, const Palette& palette,
+                    const Output& dest) const;
+
+    void writeMonoRect(const PixelBuffer* pb, const Palette& palette,
+                       const Output& dest) const;
+    void writeIndexedRect(const PixelBuffer* pb, const Palette& palette,
+                          const Output& dest) const;
+    void writeFullColourRect(const PixelBuffer* pb, const Palette& palette,
+                             const Output& dest) const;
+    void writeRawRect(const PixelBuffer* pb, bool delta,
+                      const Output& dest) const;
 
     void writePixels(const rdr::U8* buffer, const PixelFormat& pf,
-                     unsigned int count, rdr::OutStream* os);
+                     unsigned int count, rdr::OutStream* os) const;
 
-    void writeCompact(rdr::OutStream* os, rdr::U32 value);
+    void writeCompact(rdr::OutStream* os, rdr::U32 value) const;
 
-    rdr::OutStream* getZlibOutStream(int streamId, int level, size_t length);
-    void flushZlibOutStream(rdr::OutStream* os);
+    rdr::OutStream* getZlibOutStream(const Output& dest, int streamId,
+                                     int level, size_t length) const;
+    void flushZlibOutStream(const Output& dest, rdr::OutStream* os) const;
 
   protected:
     // Preprocessor generated, optimised methods
     void writeMonoRect(int width, int height,
                        const rdr::U8* buffer, int stride,
-                       const PixelFormat& pf, const Palette& palette);
+                       const PixelFormat& pf, const Palette& palette,
+                       const Output& dest) const;
     void writeMonoRect(int width, int height,
                        const rdr::U16* buffer, int stride,
-                       const PixelFormat& pf, const Palette& palette);
+                       const PixelFormat& pf, const Palette& palette,
+                       const Output& dest) const;
     void writeMonoRect(int width, int height,
                        const rdr::U32* buffer, int stride,
-                       const PixelFormat& pf, const Palette& palette);
+                       const PixelFormat& pf, const Palette& palette,
+                       const Output& dest) const;
 
     void writeIndexedRect(int width, int height,
                           const rdr::U16* buffer, int stride,
-                          const PixelFormat& pf, const Palette& palette);
+                          const PixelFormat& pf, const Palette& palette,
+                          const Output& dest) const;
     void writeIndexedRect(int width, int height,
                           const rdr::U32* buffer, int stride,
-                          const PixelFormat& pf, const Palette& palette);
+                          const PixelFormat& pf, const Palette& palette,
+                          const Output& dest) const;
 
     rdr::ZlibOutStream zlibStreams[4];
+#ifdef HAVE_ZSTD
+    rdr::ZstdOutStream zstdStreams[4];
+#endif
     rdr::MemOutStream memStream;
 
     int idxZlibLevel, monoZlibLevel, rawZlibLevel;
@@ -114,11 +114,12 @@ bool TightJPEGEncoder::treatLossless()
 }
 
 void TightJPEGEncoder::compressOnly(const PixelBuffer* pb, const uint8_t qualityIn,
-                                    std::vector<uint8_t> &out, const bool lowVideoQuality) const
+                                    EncodedBuffer &out, const bool lowVideoQuality) const
 {
+  // One compressor per encoder thread, setting up libjpeg is not free
+  static thread_local JpegCompressor jc;
   const rdr::U8* buffer;
   int stride;
-  JpegCompressor jc;
 
   int quality, subsampling;
 
@@ -141,15 +142,11 @@ void TightJPEGEncoder::compressOnly(const PixelBuffer* pb, const uint8_t quality
     subsampling = subsampleUndefined;
   }
 
-  jc.clear();
   jc.compress(buffer, stride, pb->getRect(),
-              pb->getPF(), quality, subsampling);
-
-  out.resize(jc.length());
-  memcpy(&out[0], jc.data(), jc.length());
+              pb->getPF(), quality, subsampling, out);
 }
 
-void TightJPEGEncoder::writeOnly(const std::vector<uint8_t> &out) const
+void TightJPEGEncoder::writeOnly(const EncodedBuffer &out) const
 {
   rdr::OutStream* os;
 
@@ -173,7 +173,7 @@ bool TightQOIEncoder::isSupported()
 }
 
 void TightQOIEncoder::compressOnly(const PixelBuffer* pb, const uint8_t qualityIn,
-                                    std::vector<uint8_t> &out, const bool lowVideoQuality) const
+                                    EncodedBuffer &out, const bool lowVideoQuality) const
 {
   const rdr::U8* buffer;
   int stride, len;
@@ -200,7 +200,7 @@ void TightQOIEncoder::compressOnly(const PixelBuffer* pb, const uint8_t qualityI
   free(encoded);
 }
 
-void TightQOIEncoder::writeOnly(const std::vector<uint8_t> &out) const
+void TightQOIEncoder::writeOnly(const EncodedBuffer &out) const
 {
   rdr::OutStream* os;
 
@@ -18,6 +18,7 @@
 #ifndef __RFB_TIGHTQOIENCODER_H__
 #define __RFB_TIGHTQOIENCODER_H__
 
+#include <rfb/EncodedBuffer.h>
 #include <rfb/Encoder.h>
 #include <stdint.h>
 #include <vector>
@@ -33,8 +34,8 @@ namespace rfb {
 
     virtual void writeRect(const PixelBuffer* pb, const Palette& palette);
     virtual void compressOnly(const PixelBuffer* pb, const uint8_t quality,
-                              std::vector<uint8_t> &out, const bool lowVideoQuality) const;
-    virtual void writeOnly(const std::vector<uint8_t> &out) const;
+                              EncodedBuffer &out, const bool lowVideoQuality) const;
+    virtual void writeOnly(const EncodedBuffer &out) const;
     virtual void writeSolidRect(int width, int height,
                                 const PixelFormat& pf,
                                 const rdr::U8* colour);
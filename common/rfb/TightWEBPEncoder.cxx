@@ -118,7 +118,7 @@ bool TightWEBPEncoder::treatLossless()
 }
 
 void TightWEBPEncoder::compressOnly(const PixelBuffer* pb, const uint8_t qualityIn,
-                                    std::vector<uint8_t> &out, const bool lowVideoQuality) const
+                                    EncodedBuffer &out, const bool lowVideoQuality) const
 {
   const rdr::U8* buffer;
   int stride;
@@ -184,7 +184,7 @@ void TightWEBPEncoder::compressOnly(const PixelBuffer* pb, const uint8_t quality
   WebPMemoryWriterClear(&wrt);
 }
 
-void TightWEBPEncoder::writeOnly(const std::vector<uint8_t> &out) const
+void TightWEBPEncoder::writeOnly(const EncodedBuffer &out) const
 {
   rdr::OutStream* os;
 
@@ -0,0 +1,183 @@
+/* Copyright (C) 2026 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#include <string.h>
+
+#include <rfb/TileDamage.h>
+
+using namespace rfb;
+
+TileDamage::TileDamage()
+  : width(0), height(0), tilesX(0), tilesY(0), wordsPerRow(0),
+    dirtyY1(0), dirtyY2(0)
+{
+}
+
+void TileDamage::resize(int width_, int height_)
+{
+  width = width_;
+  height = height_;
+  tilesX = (width + tileSize - 1) >> tileShift;
+  tilesY = (height + tileSize - 1) >> tileShift;
+  wordsPerRow = (tilesX + 63) / 64;
+
+  bits.assign((size_t)wordsPerRow * tilesY, 0);
+  dirtyY1 = dirtyY2 = 0;
+}
+
+void TileDamage::add(const ShortRect &r)
+{
+  int x1, y1, x2, y2;
+
+  x1 = r.x1 < 0 ? 0 : r.x1;
+  y1 = r.y1 < 0 ? 0 : r.y1;
+  x2 = r.x2 > width ? width : r.x2;
+  y2 = r.y2 > height ? height : r.y2;
+  if (x1 >= x2 || y1 >= y2)
+    return;
+
+  const int tx1 = x1 >> tileShift;
+  const int tx2 = (x2 - 1) >> tileShift;
+  const int ty1 = y1 >> tileShift;
+  const int ty2 = ((y2 - 1) >> tileShift) + 1;
+
+  const int w1 = tx1 / 64, w2 = tx2 / 64;
+  const uint64_t m1 = ~0ULL << (tx1 % 64);
+  const uint64_t m2 = ~0ULL >> (63 - tx2 % 64);
+
+  for (int ty = ty1; ty < ty2; ty++) {
+    uint64_t *row = &bits[(size_t)ty * wordsPerRow];
+    if (w1 == w2) {
+      row[w1] |= m1 & m2;
+      continue;
+    }
+    row[w1] |= m1;
+    for (int w = w1 + 1; w < w2; w++)
+      row[w] = ~0ULL;
+    row[w2] |= m2;
+  }
+
+  if (dirtyY1 >= dirtyY2) {
+    dirtyY1 = ty1;
+    dirtyY2 = ty2;
+  } else {
+    if (ty1 < dirtyY1)
+      dirtyY1 = ty1;
+    if (ty2 > dirtyY2)
+      dirtyY2 = ty2;
+  }
+}
+
+void TileDamage::add(int nRects, const ShortRect *rects)
+{
+  for (int i = 0; i < nRects; i++)
+    add(rects[i]);
+}
+
+int TileDamage::findBit(const uint64_t *row, int from, bool set) const
+{
+  int w = from / 64;
+  if (w >= wordsPerRow)
+    return tilesX;
+
+  uint64_t word = set ? row[w] : ~row[w];
+  word &= ~0ULL << (from % 64);
+  while (word == 0) {
+    if (++w >= wordsPerRow)
+      return tilesX;
+    word = set ? row[w] : ~row[w];
+  }
+
+  const int tx = w * 64 + __builtin_ctzll(word);
+  return tx > tilesX ? tilesX : tx;
+}
+
+void TileDamage::flush(Region *reg)
+{
+  ShortRect extents;
+  size_t bandStart, bandRuns;
+
+  reg->clear();
+  if (is_empty())
+    return;
+
+  rects.clear();
+  bandStart = bandRuns = 0;
+
+  extents.x1 = width;
+  extents.x2 = 0;
+  extents.y1 = extents.y2 = 0;
+
+  for (int ty = dirtyY1; ty < dirtyY2; ty++) {
+    uint64_t *row = &bits[(size_t)ty * wordsPerRow];
+    const short y1 = ty << tileShift;
+    const short y2 = (ty + 1) << tileShift > height ?
+                     height : (ty + 1) << tileShift;
+
+    // Collect the horizontal runs of dirty tiles on this row
+    runs.clear();
+    for (int tx = findBit(row, 0, true); tx < tilesX; ) {
+      const int end = findBit(row, tx, false);
+      runs.push_back(tx << tileShift);
+      runs.push_back(end >= tilesX ? width : end << tileShift);
+      tx = findBit(row, end, true);
+    }
+    memset(row, 0, wordsPerRow * sizeof(uint64_t));
+
+    if (runs.empty())
+      continue;
+
+    if (runs.front() < extents.x1)
+      extents.x1 = runs.front();
+    if (runs.back() > extents.x2)
+      extents.x2 = runs.back();
+
+    // Regions must be coalesced bands, so extend the previous band if
+    // this row has the same runs and touches it
+    bool same = bandRuns == runs.size() / 2 && rects[bandStart].y2 == y1;
+    for (size_t i = 0; same && i < bandRuns; i++) {
+      if (rects[bandStart + i].x1 != runs[i * 2] ||
+          rects[bandStart + i].x2 != runs[i * 2 + 1])
+        same = false;
+    }
+
+    if (same) {
+      for (size_t i = 0; i < bandRuns; i++)
+        rects[bandStart + i].y2 = y2;
+    } else {
+      if (rects.empty())
+        extents.y1 = y1;
+      bandStart = rects.size();
+      bandRuns = runs.size() / 2;
+      for (size_t i = 0; i < bandRuns; i++) {
+        ShortRect r;
+        r.x1 = runs[i * 2];
+        r.y1 = y1;
+        r.x2 = runs[i * 2 + 1];
+        r.y2 = y2;
+        rects.push_back(r);
+      }
+    }
+    extents.y2 = y2;
+  }
+
+  dirtyY1 = dirtyY2 = 0;
+
+  if (!rects.empty())
+    reg->setExtentsAndOrderedRects(&extents, rects.size(), rects.data());
+}
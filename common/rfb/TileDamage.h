@@ -0,0 +1,72 @@
+/* Copyright (C) 2026 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+//
+// TileDamage - accumulates damage from drawing operations as a bitmap of
+// 16x16 tiles. Marking damage is a few bit operations no matter how
+// fragmented the screen already is, and the result is turned into a
+// Region once per frame.
+//
+
+#ifndef __RFB_TILEDAMAGE_H__
+#define __RFB_TILEDAMAGE_H__
+
+#include <stdint.h>
+
+#include <vector>
+
+#include <rfb/Region.h>
+
+namespace rfb {
+
+  class TileDamage {
+  public:
+    static const int tileShift = 4;
+    static const int tileSize = 1 << tileShift;
+
+    TileDamage();
+
+    // Sets the screen size and drops any pending damage
+    void resize(int width, int height);
+
+    void add(const ShortRect &r);
+    void add(int nRects, const ShortRect *rects);
+
+    bool is_empty() const { return dirtyY1 >= dirtyY2; }
+
+    // Replaces reg with the damaged tiles (clipped to the screen) and
+    // clears the bitmap
+    void flush(Region *reg);
+
+  private:
+    // First tile at or after from that is set (or clear), tilesX if none
+    int findBit(const uint64_t *row, int from, bool set) const;
+
+  private:
+    int width, height;
+    int tilesX, tilesY, wordsPerRow;
+    std::vector<uint64_t> bits;
+    int dirtyY1, dirtyY2;
+
+    std::vector<ShortRect> rects;
+    std::vector<short> runs;
+  };
+
+}
+
+#endif
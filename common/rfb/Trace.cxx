@@ -0,0 +1,172 @@
+/* Copyright (C) 2026 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <rfb/LogWriter.h>
+#include <rfb/Trace.h>
+
+using namespace rfb;
+
+static LogWriter vlog("Trace");
+
+std::atomic<bool> trace::enabled{false};
+std::atomic<uint32_t> trace::currentFrame{0};
+
+namespace {
+
+  struct Event {
+    uint64_t ts;
+    const char *name;
+    uint32_t frame;
+    uint32_t client;
+    pid_t tid;
+    char phase;
+  };
+
+  // Single producer: only the owning thread writes. A dump racing with
+  // a wrap-around may see a few torn events, which the viewers tolerate.
+  struct Ring {
+    static const uint32_t size = 1 << 15;
+
+    Event events[size];
+    std::atomic<uint32_t> head{0};
+  };
+
+  // Rings outlive their threads, so a dump can still show what the
+  // encoder threads did before they exited. An exited thread's ring goes
+  // back to the pool and the next new thread appends to it, so the number
+  // of rings is bounded by the threads alive at once, and by maxRings.
+  static const size_t maxRings = 32;
+
+  std::mutex ringsMutex;
+  std::vector<Ring *> rings;
+  std::vector<Ring *> freeRings;
+
+  struct RingHolder {
+    Ring *ring = NULL;
+    pid_t tid;
+    bool refused = false;
+
+    ~RingHolder() {
+      if (!ring)
+        return;
+
+      std::lock_guard<std::mutex> lock(ringsMutex);
+      freeRings.push_back(ring);
+    }
+  };
+
+  thread_local RingHolder threadRing;
+
+  Ring *getRing()
+  {
+    if (threadRing.ring || threadRing.refused)
+      return threadRing.ring;
+
+    std::lock_guard<std::mutex> lock(ringsMutex);
+
+    Ring *ring;
+    if (!freeRings.empty()) {
+      ring = freeRings.back();
+      freeRings.pop_back();
+    } else if (rings.size() < maxRings) {
+      ring = new Ring;
+      rings.push_back(ring);
+    } else {
+      vlog.error("Too many threads to trace, ignoring thread %ld",
+                 (long) syscall(SYS_gettid));
+      threadRing.refused = true;
+      return NULL;
+    }
+
+    threadRing.tid = syscall(SYS_gettid);
+    threadRing.ring = ring;
+
+    return ring;
+  }
+
+  uint64_t now()
+  {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+}
+
+void trace::setEnabled(const bool on)
+{
+  if (on != enabled.load(std::memory_order_relaxed))
+    vlog.info("Pipeline tracing %s", on ? "enabled" : "disabled");
+
+  enabled.store(on, std::memory_order_relaxed);
+}
+
+void trace::record(const char *name, const char phase, const uint32_t client)
+{
+  Ring * const ring = getRing();
+  if (!ring)
+    return;
+
+  const uint32_t head = ring->head.load(std::memory_order_relaxed);
+  Event &e = ring->events[head & (Ring::size - 1)];
+
+  e.ts = now();
+  e.name = name;
+  e.frame = currentFrame.load(std::memory_order_relaxed);
+  e.client = client;
+  e.tid = threadRing.tid;
+  e.phase = phase;
+
+  ring->head.store(head + 1, std::memory_order_release);
+}
+
+std::string trace::dump()
+{
+  std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  const pid_t pid = getpid();
+  bool first = true;
+  char buf[256];
+
+  std::lock_guard<std::mutex> lock(ringsMutex);
+
+  for (const Ring *ring : rings) {
+    const uint32_t head = ring->head.load(std::memory_order_acquire);
+    const uint32_t start = head > Ring::size ? head - Ring::size : 0;
+
+    for (uint32_t i = start; i != head; i++) {
+      const Event &e = ring->events[i & (Ring::size - 1)];
+
+      snprintf(buf, sizeof(buf),
+               "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lu,\"pid\":%d,\"tid\":%d,"
+               "\"args\":{\"frame\":%u,\"client\":%u}}",
+               first ? "" : ",\n", e.name, e.phase, (unsigned long) e.ts,
+               pid, e.tid, e.frame, e.client);
+      out += buf;
+      first = false;
+    }
+  }
+
+  out += "]}\n";
+
+  return out;
+}
@@ -0,0 +1,86 @@
+/* Copyright (C) 2026 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+//
+// Trace - opt-in per-frame pipeline tracing. Each thread records begin/end
+// events into its own ring buffer, without locks. The rings can be dumped
+// as Chrome trace-event JSON, which Perfetto and chrome://tracing open.
+//
+// When tracing is off, a TRACE_SCOPE costs a single predictable branch.
+//
+
+#ifndef __RFB_TRACE_H__
+#define __RFB_TRACE_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+namespace rfb {
+
+  namespace trace {
+
+    extern std::atomic<bool> enabled;
+    extern std::atomic<uint32_t> currentFrame;
+
+    void setEnabled(const bool on);
+
+    // name must be a string literal, only the pointer is kept
+    void record(const char *name, const char phase, const uint32_t client);
+
+    // Returns all buffered events as trace-event JSON
+    std::string dump();
+
+    inline bool isEnabled() {
+      return enabled.load(std::memory_order_relaxed);
+    }
+
+    // Marks the start of a new server frame, the events of all threads
+    // are tagged with it
+    inline void nextFrame() {
+      if (isEnabled())
+        currentFrame.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    class Scope {
+    public:
+      Scope(const char *name_, const uint32_t client_ = 0) : name(NULL) {
+        if (isEnabled()) {
+          name = name_;
+          client = client_;
+          record(name, 'B', client);
+        }
+      }
+      ~Scope() {
+        if (name)
+          record(name, 'E', client);
+      }
+
+    private:
+      const char *name;
+      uint32_t client;
+    };
+  }
+}
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_SCOPE(...) \
+  rfb::trace::Scope TRACE_CONCAT(traceScope, __LINE__)(__VA_ARGS__)
+
+#endif
@@ -0,0 +1,187 @@
+/* Copyright (C) 2026 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include <chrono>
+
+#include <rfb/LogWriter.h>
+#include <rfb/UserIndex.h>
+
+#include <kasmpasswd.h>
+
+using namespace rfb;
+
+static LogWriter vlog("UserIndex");
+
+// How often an unwatched file is checked for changes
+static const int64_t StatInterval = 1000;
+
+static int64_t nowMs()
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool sameFile(const struct stat &a, const struct stat &b)
+{
+  return a.st_ino == b.st_ino && a.st_dev == b.st_dev &&
+         a.st_size == b.st_size &&
+         a.st_mtim.tv_sec == b.st_mtim.tv_sec &&
+         a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+
+UserIndex::UserIndex() : generation(1), watchFd(-1), lastStatCheck(0)
+{
+  memset(&lastStat, 0, sizeof(struct stat));
+}
+
+void UserIndex::setPath(const char *path_)
+{
+  path = path_;
+  reload();
+}
+
+void UserIndex::reload()
+{
+  std::shared_ptr<table_t> fresh = std::make_shared<table_t>();
+  struct stat st;
+
+  if (path.empty() || stat(path.c_str(), &st) != 0)
+    memset(&st, 0, sizeof(struct stat));
+
+  if (!path.empty()) {
+    struct kasmpasswd_t *set = readkasmpasswd(path.c_str());
+    fresh->reserve(set->num);
+
+    for (unsigned i = 0; i < set->num; i++) {
+      const struct kasmpasswd_entry_t &src = set->entries[i];
+      Entry e;
+
+      e.password = src.password;
+      e.read = src.read;
+      e.write = src.write;
+      e.owner = src.owner;
+
+      // First entry wins, same as the old linear scan
+      fresh->emplace(src.user, e);
+    }
+
+    free(set->entries);
+    free(set);
+  }
+
+  std::lock_guard<std::mutex> guard(lock);
+  table = fresh;
+  lastStat = st;
+  generation++;
+
+  vlog.debug("Loaded %u users, generation %u", (unsigned) fresh->size(),
+             generation.load());
+}
+
+// Returns true if the file changed since the last call
+bool UserIndex::drainEvents()
+{
+  bool changed = false;
+  char buf[256];
+  int ret;
+
+  while ((ret = read(watchFd, buf, sizeof(buf))) > 0) {
+    int pos = 0;
+    while (pos < ret) {
+      const struct inotify_event * const ev = (struct inotify_event *) &buf[pos];
+
+      if (ev->mask & IN_IGNORED) {
+        // file was deleted, set new watch
+        if (inotify_add_watch(watchFd, path.c_str(), IN_CLOSE_WRITE | IN_DELETE_SELF) < 0)
+          vlog.error("Failed to set watch");
+      }
+
+      changed = true;
+      pos += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+
+  return changed;
+}
+
+void UserIndex::revalidate()
+{
+  if (path.empty())
+    return;
+
+  if (watchFd >= 0) {
+    if (drainEvents())
+      reload();
+    return;
+  }
+
+  // Only one of the threads asking at once does the check
+  const int64_t now = nowMs();
+  int64_t last = lastStatCheck.load(std::memory_order_relaxed);
+  if (now - last < StatInterval ||
+      !lastStatCheck.compare_exchange_strong(last, now))
+    return;
+
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0)
+    memset(&st, 0, sizeof(struct stat));
+
+  bool changed;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    changed = !sameFile(st, lastStat);
+  }
+
+  if (changed)
+    reload();
+}
+
+unsigned UserIndex::getGeneration()
+{
+  revalidate();
+  return generation.load(std::memory_order_acquire);
+}
+
+std::shared_ptr<const UserIndex::table_t> UserIndex::snapshot(unsigned *generation_)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  if (generation_)
+    *generation_ = generation.load(std::memory_order_relaxed);
+  return table;
+}
+
+bool UserIndex::lookup(const char *user, Entry &out, unsigned *generation_)
+{
+  revalidate();
+
+  const std::shared_ptr<const table_t> cur = snapshot(generation_);
+  if (!cur)
+    return false;
+
+  const table_t::const_iterator it = cur->find(user);
+  if (it == cur->end())
+    return false;
+
+  out = it->second;
+  return true;
+}
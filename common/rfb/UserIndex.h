@@ -0,0 +1,85 @@
+/* Copyright (C) 2026 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+//
+// UserIndex - hashed, shared view of the kasmpasswd file. The file is parsed
+// once per change rather than once per permission check; readers get an
+// immutable snapshot, and a reload swaps in a new one.
+//
+
+#ifndef __RFB_USERINDEX_H__
+#define __RFB_USERINDEX_H__
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace rfb {
+
+  class UserIndex {
+  public:
+    struct Entry {
+      std::string password;
+      bool read, write, owner;
+    };
+
+    UserIndex();
+
+    void setPath(const char *path_);
+
+    // When watched, fd is a non-blocking inotify descriptor watching the
+    // file, and its events are drained before every answer. Otherwise the
+    // file is stat()ed at most once per second, and re-parsed only when
+    // that shows it changed.
+    void setWatched(const int fd) { watchFd = fd; }
+
+    void reload();
+
+    // Bumped on every reload. A cached lookup is valid as long as the
+    // generation it was made at is still current. Both this and lookup()
+    // pick up changes to the file first.
+    unsigned getGeneration();
+
+    // Returns false if the user does not exist. generation_ receives the
+    // generation of the snapshot the answer came from.
+    bool lookup(const char *user, Entry &out, unsigned *generation_ = NULL);
+
+  private:
+    typedef std::unordered_map<std::string, Entry> table_t;
+
+    std::shared_ptr<const table_t> snapshot(unsigned *generation_);
+    void revalidate();
+    bool drainEvents();
+
+    std::mutex lock;
+    std::shared_ptr<const table_t> table;
+    std::atomic<unsigned> generation;
+    std::string path;
+    int watchFd;
+    struct stat lastStat;
+    std::atomic<int64_t> lastStatCheck;
+  };
+
+}
+
+#endif
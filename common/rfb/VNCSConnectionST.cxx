@@ -24,6 +24,8 @@
 #include <rfb/Encoder.h>
 #include <rfb/KeyRemapper.h>
 #include <rfb/LogWriter.h>
+#include <rfb/Metrics.h>
+#include <rfb/Trace.h>
 #include <rfb/Security.h>
 #include <rfb/ServerCore.h>
 #include <rfb/SMsgWriter.h>
@@ -63,18 +65,20 @@ VNCSConnectionST::VNCSConnectionST(VNCServerST* server_, network::Socket *s,
     inProcessMessages(false),
     pendingSyncFence(false), syncFence(false), fenceFlags(0),
     fenceDataLen(0), fenceData(NULL), congestionTimer(this),
-    losslessTimer(this), kbdLogTimer(this), binclipTimer(this),
+    losslessTimer(this), deferredTimer(this), kbdLogTimer(this), binclipTimer(this),
     server(server_), updates(false),
     updateRenderedCursor(false), removeRenderedCursor(false),
     continuousUpdates(false), encodeManager(this, &VNCServerST::encCache),
+    permsGeneration(0), permsFound(false),
     needsPermCheck(false), needsConfigReload(false), pointerEventTime(0),
-    clientHasCursor(false),
+    lastButtonMask(0), clientHasCursor(false),
     accessRights(AccessDefault), startTime(time(0)), frameTracking(false),
     udpFramesSinceFull(0), complainedAboutNoViewRights(false), clientUsername("username_unavailable"),
-    dlpFramebuffer(NULL)
+    dlpMaskSent(false)
 {
   setStreams(&sock->inStream(), &sock->outStream());
   peerEndpoint.buf = sock->getPeerEndpoint();
+  pendingPointer.pending = false;
   VNCServerST::connectionsLog.write(1,"accepted: %s", peerEndpoint.buf);
 
   memset(bstats_total, 0, sizeof(bstats_total));
@@ -104,16 +108,11 @@ VNCSConnectionST::VNCSConnectionST(VNCServerST* server_, network::Socket *s,
   // Initial password of this connection.
   // getPerms() is called in many places, Having single initial value is safer.
   if (user[0] && !disablebasicauth) {
-    struct kasmpasswd_t *set = readkasmpasswd(kasmpasswdpath);
-    for (unsigned i = 0; i < set->num; i++) {
-      if (!strcmp(set->entries[i].user, user)) {
-        strncpy(storedPasswordHash, set->entries[i].password, PASSWORD_LEN - 1);
-        storedPasswordHash[PASSWORD_LEN - 1] = '\0';
-        break;
-      }
+    UserIndex::Entry entry;
+    if (server->userIndex.lookup(user, entry)) {
+      strncpy(storedPasswordHash, entry.password.c_str(), PASSWORD_LEN - 1);
+      storedPasswordHash[PASSWORD_LEN - 1] = '\0';
     }
-    free(set->entries);
-    free(set);
   }
 
   bool read, write, owner;
@@ -166,15 +165,10 @@ VNCSConnectionST::~VNCSConnectionST()
 
   // Remove this client from the server
   server->clients.remove(this);
+  metrics::registry.removeClient(peerEndpoint.buf);
 
   delete [] fenceData;
 
-  // Clean up per-user DLP framebuffer
-  if (dlpFramebuffer) {
-    delete dlpFramebuffer;
-    dlpFramebuffer = NULL;
-  }
-
   if (server->apimessager) {
     server->apimessager->mainUpdateUserInfo(checkOwnerConn(), server->clients.size());
     server->apimessager->mainClearBottleneckStats(peerEndpoint.buf);
@@ -267,6 +261,8 @@ void VNCSConnectionST::processMessages()
       }
     }
 
+    flushPendingPointer();
+
     // Flush out everything in case we go idle after this.
     sock->cork(false);
 
@@ -277,18 +273,37 @@ void VNCSConnectionST::processMessages()
     // higher priority to user actions such as keyboard and pointer events.
     writeFramebufferUpdate();
   } catch (rdr::EndOfStream&) {
+    abortProcessMessages();
     close("Clean disconnection");
   } catch (rdr::Exception &e) {
+    abortProcessMessages();
     close(e.str());
   }
 }
 
+// A pointer move held back by processMessages() was read in full before
+// whatever went wrong, so it still gets applied
+void VNCSConnectionST::abortProcessMessages()
+{
+  inProcessMessages = false;
+
+  try {
+    flushPendingPointer();
+  } catch (rdr::Exception &e) {
+    pendingPointer.pending = false;
+    vlog.error("Failed to apply pending pointer event: %s", e.str());
+  }
+}
+
 void VNCSConnectionST::flushSocket()
 {
   if (state() == RFBSTATE_CLOSING) return;
   try {
     setSocketTimeouts();
-    sock->outStream().flush();
+    {
+      TRACE_SCOPE("flush", encodeManager.getTraceId());
+      sock->outStream().flush();
+    }
     // Flushing the socket might release an update that was previously
     // delayed because of congestion.
     if (sock->outStream().bufferUsage() == 0)
@@ -322,6 +337,9 @@ void VNCSConnectionST::pixelBufferChange()
 
       damagedCursorRegion.assign_intersect(server->pb->getRect());
 
+      // The client's framebuffer is new, so any DLP mask must be resent
+      dlpMaskSent = false;
+
       cp.width = server->pb->width();
       cp.height = server->pb->height();
       cp.screenLayout = server->screenLayout;
@@ -937,10 +955,40 @@ void VNCSConnectionST::pointerEvent(const Point& pos, const Point& abspos, int b
       }
     }
 
+    // Absolute moves that keep the same buttons are superseded by the
+    // next one, so with InputPriority only the last of a batch is applied
+    if (Server::inputPriority && inProcessMessages && !(pos.x & 0x4000) &&
+        buttonMask == lastButtonMask && !scrollX && !scrollY) {
+      pendingPointer.pending = true;
+      pendingPointer.pos = newpos;
+      pendingPointer.abspos = pointerEventPos;
+      pendingPointer.buttonMask = buttonMask;
+      pendingPointer.skipClick = skipclick;
+      pendingPointer.skipRelease = skiprelease;
+      return;
+    }
+
+    flushPendingPointer();
+
+    lastButtonMask = buttonMask;
+    server->noteInput();
     server->desktop->pointerEvent(newpos, pointerEventPos, buttonMask, skipclick, skiprelease, scrollX, scrollY);
   }
 }
 
+void VNCSConnectionST::flushPendingPointer()
+{
+  if (!pendingPointer.pending)
+    return;
+
+  pendingPointer.pending = false;
+  server->noteInput();
+  server->desktop->pointerEvent(pendingPointer.pos, pendingPointer.abspos,
+                                pendingPointer.buttonMask,
+                                pendingPointer.skipClick,
+                                pendingPointer.skipRelease, 0, 0);
+}
+
 
 class VNCSConnectionSTShiftPresser {
 public:
@@ -970,6 +1018,9 @@ void VNCSConnectionST::keyEvent(rdr::U32 keysym, rdr::U32 keycode, bool down) {
     return;
   }
 
+  // Keys must not overtake a held back pointer move
+  flushPendingPointer();
+
   lastEventTime = time(0);
   server->lastUserInputTime = lastEventTime;
   if (!(accessRights & AccessKeyEvents)) return;
@@ -984,6 +1035,7 @@ void VNCSConnectionST::keyEvent(rdr::U32 keysym, rdr::U32 keycode, bool down) {
   }
 
   gettimeofday(&lastKeyEvent, NULL);
+  server->noteInput();
 
   if (down) {
     keylog(keysym, sock->getPeerAddress());
@@ -1312,7 +1364,8 @@ bool VNCSConnectionST::handleTimeout(Timer* t)
 {
   try {
     if ((t == &congestionTimer) ||
-        (t == &losslessTimer))
+        (t == &losslessTimer) ||
+        (t == &deferredTimer))
       writeFramebufferUpdate();
     else if (t == &kbdLogTimer)
       flushKeylog(sock->getPeerAddress());
@@ -1352,31 +1405,26 @@ bool VNCSConnectionST::getPerms(bool &read, bool &write, bool &owner, bool *pass
     return true;
   }
   if (user[0]) {
-    struct kasmpasswd_t *set = readkasmpasswd(kasmpasswdpath);
-    unsigned i;
-    for (i = 0; i < set->num; i++) {
-      if (!strcmp(set->entries[i].user, user)) {
-        read = set->entries[i].read;
-        write = set->entries[i].write;
-        owner = set->entries[i].owner;
-
-        // Check if password hash has changed
-        if (passwordChanged && storedPasswordHash[0] &&
-            strcmp(set->entries[i].password, storedPasswordHash) != 0) {
-          *passwordChanged = true;
-        }
+    if (server->userIndex.getGeneration() != permsGeneration)
+      permsFound = server->userIndex.lookup(user, permsEntry, &permsGeneration);
+
+    if (permsFound) {
+      read = permsEntry.read;
+      write = permsEntry.write;
+      owner = permsEntry.owner;
+
+      // Check if password hash has changed
+      if (passwordChanged && storedPasswordHash[0] &&
+          strcmp(permsEntry.password.c_str(), storedPasswordHash) != 0) {
+        *passwordChanged = true;
+      }
 
-        // Writer can always read
-        if (write)
-          read = true;
+      // Writer can always read
+      if (write)
+        read = true;
 
-        found = true;
-        break;
-      }
+      found = true;
     }
-
-    free(set->entries);
-    free(set);
   }
 
   return found;
@@ -1410,8 +1458,10 @@ bool VNCSConnectionST::isCongested()
   // Stuff still waiting in the send buffer?
   sock->outStream().flush();
   congestion.debugTrace("congestion-trace.csv", sock->getFd());
-  if (sock->outStream().bufferUsage() > 0)
+  if (sock->outStream().bufferUsage() > 0) {
+    metrics::registry.congestionStalls.add();
     return true;
+  }
 
   if (!cp.supportsFence || cp.supportsUdp)
     return false;
@@ -1420,6 +1470,8 @@ bool VNCSConnectionST::isCongested()
   if (!congestion.isCongested())
     return false;
 
+  metrics::registry.congestionStalls.add();
+
   eta = congestion.getUncongestedETA();
   if (eta >= 0)
     congestionTimer.start(eta);
@@ -1526,7 +1578,10 @@ void VNCSConnectionST::writeFramebufferUpdate()
   // Then real data (if possible)
   writeDataUpdate();
 
-  sock->cork(false);
+  {
+    TRACE_SCOPE("flush", encodeManager.getTraceId());
+    sock->cork(false);
+  }
 
   congestion.updatePosition(sock->outStream().length());
 
@@ -1554,6 +1609,7 @@ void VNCSConnectionST::writeDataUpdate()
   bool needNewUpdateInfo;
   const RenderedCursor *cursor;
   size_t maxUpdateSize;
+  Region deferred;
 
   updates.enable_copyrect(cp.useCopyRect);
 
@@ -1672,11 +1728,19 @@ void VNCSConnectionST::writeDataUpdate()
     }
   }
 
+  // Restrict the update to this user's DLP region. The lossless refresh
+  // must not reach outside it either, but the tracker still has to drop
+  // everything that was requested, so req itself is left alone.
+  PixelBuffer *fb = server->getPixelBuffer();
+  Region refresh(req);
+  if (dlpSettings.regionEnabled || dlpMaskSent)
+    fb = applyDLPRegion(ui, refresh, pending.is_empty());
+
   // Return if there is nothing to send the client.
   const unsigned losslessThreshold = 80 + 2 * 1000 / Server::frameRate;
 
   if (ui.is_empty() && !writer()->needFakeUpdate() &&
-      (!encodeManager.needsLosslessRefresh(req) ||
+      (!encodeManager.needsLosslessRefresh(refresh) ||
       msSince(&lastRealUpdate) < losslessThreshold))
     return;
 
@@ -1691,7 +1755,9 @@ void VNCSConnectionST::writeDataUpdate()
                   server->msToNextUpdate() / 1000;
 
   if (!ui.is_empty()) {
-    encodeManager.writeUpdate(ui, getFramebuffer(), cursor, maxUpdateSize);
+    encodeManager.setFocus(pointerEventPos);
+    encodeManager.writeUpdate(ui, fb, cursor, maxUpdateSize);
+    deferred = encodeManager.getDeferred();
     copypassed.clear();
     gettimeofday(&lastRealUpdate, NULL);
     losslessTimer.start(losslessThreshold);
@@ -1717,8 +1783,7 @@ void VNCSConnectionST::writeDataUpdate()
         bstats_total[BS_CPU_CLOSE]++;
     }
   } else {
-    encodeManager.writeLosslessRefresh(req, server->getPixelBuffer(),
-                                       cursor, maxUpdateSize);
+    encodeManager.writeLosslessRefresh(refresh, fb, cursor, maxUpdateSize);
   }
 
   writeRTTPing();
@@ -1727,6 +1792,13 @@ void VNCSConnectionST::writeDataUpdate()
   // just clear the entire update tracker.
   updates.subtract(req);
 
+  // What didn't fit in this update goes in the next one, even if the
+  // screen stays still and the frame clock stops
+  if (!deferred.is_empty()) {
+    updates.add_changed(deferred);
+    deferredTimer.start(1000 / rfb::Server::frameRate);
+  }
+
   requested.clear();
 
   if (Server::udpFullFrameFrequency && cp.supportsUdp)
@@ -1819,6 +1891,20 @@ void VNCSConnectionST::sendStats(const bool toClient) {
   }
 }
 
+void VNCSConnectionST::updateMetrics()
+{
+  if (state() != RFBSTATE_NORMAL)
+    return;
+
+  metrics::ClientMetrics m;
+  m.bandwidth = congestion.getBandwidth();
+  // No measurement yet shows up as zero
+  m.rtt = congestion.getPingTime() == (unsigned) -1 ? 0 : congestion.getPingTime();
+  m.queued = sock->outStream().bufferUsage();
+
+  metrics::registry.updateClient(peerEndpoint.buf, m);
+}
+
 void VNCSConnectionST::handleFrameStats(rdr::U32 all, rdr::U32 render)
 {
   if (server->apimessager) {
@@ -2041,74 +2127,77 @@ void VNCSConnectionST::sendUnixRelayData(const char name[], const unsigned char
 
 // Per-user DLP helper methods
 
-PixelBuffer* VNCSConnectionST::getFramebuffer()
+PixelBuffer* VNCSConnectionST::applyDLPRegion(UpdateInfo &ui, Region &refresh,
+                                              const bool canMask)
 {
-  if (!dlpSettings.regionEnabled)
-    return server->pb;  // Return original framebuffer if DLP region not enabled
+  // Masking is done on the update regions, so the masked area is only
+  // painted black when it changes. The pixels still always come from a
+  // masked copy of the framebuffer, as video mode and scaling encode the
+  // whole screen no matter what the update regions say.
 
-  // Apply per-user DLP region (creates/updates dlpFramebuffer)
-  applyDLPRegion();
-  return dlpFramebuffer;
-}
-
-void VNCSConnectionST::applyDLPRegion()
-{
-  // This method creates a blacked-out framebuffer for this specific user
-  // based on their DLP region settings
+  const Rect fbRect = server->pb->getRect();
 
   if (!dlpSettings.regionEnabled) {
-    // Region not enabled, clean up framebuffer if it exists
-    if (dlpFramebuffer) {
-      delete dlpFramebuffer;
-      dlpFramebuffer = NULL;
+    // The region was switched off, uncover what was masked
+    if (canMask) {
+      ui.changed.assign_union(Region(fbRect).subtract(Region(dlpAllowed)));
+      dlpMaskSent = false;
     }
-    return;
+    return server->pb;
   }
 
-  // Translate region coordinates to absolute pixels
   rdr::U16 x1, y1, x2, y2;
   dlpSettings.translateRegion(x1, y1, x2, y2,
-                              server->pb->width(),
-                              server->pb->height());
-
-  // Create or recreate framebuffer if dimensions changed
-  if (dlpFramebuffer &&
-      (dlpFramebuffer->width() != server->pb->width() ||
-       dlpFramebuffer->height() != server->pb->height())) {
-    delete dlpFramebuffer;
-    dlpFramebuffer = NULL;
-  }
-
-  if (!dlpFramebuffer) {
-    dlpFramebuffer = new ManagedPixelBuffer(server->pb->getPF(),
-                                            server->pb->width(),
-                                            server->pb->height());
-  }
-
-  // Copy original framebuffer data
-  int stride;
-  const rdr::U8 *src = server->pb->getBuffer(server->pb->getRect(), &stride);
-  rdr::U8 *data = dlpFramebuffer->getBufferRW(server->pb->getRect(), &stride);
-  stride *= 4;
-
-  memcpy(data, src, stride * server->pb->height());
-
-  // Black out areas outside the allowed region
-  rdr::U16 y;
-  const rdr::U16 w = server->pb->width();
-  const rdr::U16 h = server->pb->height();
-  for (y = 0; y < h; y++) {
-    if (y < y1 || y > y2) {
-      // This row is completely outside the region, black it out
-      memset(data, 0, stride);
-    } else {
-      // This row is within Y bounds, black out left and right portions
-      if (x1)
-        memset(data, 0, x1 * 4);
-      if (x2)
-        memset(&data[x2 * 4], 0, (w - x2) * 4);
+                              fbRect.width(), fbRect.height());
+  // Same edges as the old per-pixel mask: row y2 stays visible, column
+  // x2 is the first one masked
+  const Rect allowed = Rect(x1, y1, x2, y2 + 1).intersect(fbRect);
+
+  // Copies may neither write to nor read from the masked area. Those
+  // that would are sent as changed pixels instead.
+  if (!ui.copied.is_empty()) {
+    const Region copied = ui.copied.intersect(allowed);
+    const Region valid =
+      copied.intersect(Region(allowed.translate(ui.copy_delta)));
+
+    ui.changed.assign_union(copied.subtract(valid));
+    ui.copied = valid;
+  }
+
+  std::vector<CopyPassRect>::iterator it = ui.copypassed.begin();
+  while (it != ui.copypassed.end()) {
+    const Rect src(it->src_x, it->src_y,
+                   it->src_x + it->rect.width(), it->src_y + it->rect.height());
+    if (it->rect.enclosed_by(allowed) && src.enclosed_by(allowed)) {
+      ++it;
+      continue;
     }
-
-    data += stride;
-  }
+    ui.changed.assign_union(Region(it->rect.intersect(allowed)));
+    it = ui.copypassed.erase(it);
+  }
+
+  ui.changed.assign_intersect(Region(allowed));
+  refresh.assign_intersect(Region(allowed));
+
+  if (canMask && !(dlpMaskSent && allowed.equals(dlpAllowed))) {
+    // New client, framebuffer or region: black out the masked area once
+    ui.changed.assign_union(Region(fbRect).subtract(Region(allowed)));
+    // Whatever the old region masked but the new one allows is black on
+    // the client, and must be sent again from the real framebuffer
+    if (dlpMaskSent)
+      ui.changed.assign_union(Region(allowed).subtract(Region(dlpAllowed)));
+    dlpAllowed = allowed;
+    dlpMaskSent = true;
+  }
+
+  // The server keeps a masked buffer per distinct region. Bring it up to
+  // date wherever the client is about to get new pixels, copies included.
+  // The lossless refresh only resends what it got before, which the
+  // buffer already holds.
+  Region fill(ui.changed);
+  fill.assign_union(ui.copied);
+  for (it = ui.copypassed.begin(); it != ui.copypassed.end(); ++it)
+    fill.assign_union(Region(it->rect));
+
+  return server->getDLPMaskedBuffer(allowed, fill);
 }
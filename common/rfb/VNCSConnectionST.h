@@ -38,6 +38,7 @@
 #include <rfb/PointerSettings.h>
 #include <rfb/SConnection.h>
 #include <rfb/Timer.h>
+#include <rfb/UserIndex.h>
 #include <rfb/unixRelayLimits.h>
 
 #include "kasmpasswd.h"
@@ -180,6 +181,8 @@ namespace rfb {
     int getStatus();
 
     virtual void sendStats(const bool toClient = true);
+    // Publishes this client's link state to the metrics registry
+    void updateMetrics();
     virtual void handleFrameStats(rdr::U32 all, rdr::U32 render);
     virtual void keepAlive();
 
@@ -325,6 +328,7 @@ namespace rfb {
     Congestion congestion;
     Timer congestionTimer;
     Timer losslessTimer;
+    Timer deferredTimer;
     Timer kbdLogTimer;
     Timer binclipTimer;
 
@@ -353,6 +357,10 @@ namespace rfb {
 
     char user[USERNAME_LEN];
     char storedPasswordHash[PASSWORD_LEN];  // Store password hash at auth time
+    // Last user index answer, valid while its generation is current
+    mutable unsigned permsGeneration;
+    mutable bool permsFound;
+    mutable UserIndex::Entry permsEntry;
     char kasmpasswdpath[4096];
     bool needsPermCheck;
     bool needsConfigReload;
@@ -360,6 +368,17 @@ namespace rfb {
     time_t lastEventTime;
     time_t pointerEventTime;
     Point pointerEventPos;
+    int lastButtonMask;
+    // Latest pointer move of the current message batch, held back by
+    // InputPriority so that only it gets applied
+    struct {
+      bool pending;
+      Point pos, abspos;
+      int buttonMask;
+      bool skipClick, skipRelease;
+    } pendingPointer;
+    void flushPendingPointer();
+    void abortProcessMessages();
     bool clientHasCursor;
     struct timeval lastRealUpdate;
     struct timeval lastClipboardOp;
@@ -385,12 +404,14 @@ namespace rfb {
     PointerSettings pointerSettings;
     ConnectionSettings connectionSettings;
 
-    ManagedPixelBuffer* dlpFramebuffer;
+    // DLP region last masked out on the client
+    Rect dlpAllowed;
+    bool dlpMaskSent;
     KeyRemapper keyRemapper;
 
     // DLP helper methods
-    void applyDLPRegion();
-    PixelBuffer* getFramebuffer();
+    PixelBuffer* applyDLPRegion(UpdateInfo &ui, Region &refresh,
+                                const bool canMask);
   };
 }
 #endif
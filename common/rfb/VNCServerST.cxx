@@ -58,6 +58,8 @@
 #include <rfb/ComparingUpdateTracker.h>
 #include <rfb/KeyRemapper.h>
 #include <rfb/ListConnInfo.h>
+#include <rfb/Metrics.h>
+#include <rfb/Trace.h>
 #include <rfb/Security.h>
 #include <rfb/ServerCore.h>
 #include <rfb/VNCServerST.h>
@@ -106,7 +108,7 @@ VNCServerST::VNCServerST(const char* name_, SDesktop* desktop_)
     renderedCursorInvalid(false),
     queryConnectionHandler(nullptr), keyRemapper(&KeyRemapper::defInstance),
     lastConnectionTime(0), disableclients(false),
-    frameTimer(this), apimessager(nullptr), trackingFrameStats(0),
+    frameTimer(this), damagePending(false), inputPending(false), inputLatencyMs(0), inotifyfd(-1), apimessager(nullptr), trackingFrameStats(0),
     clipboardId(0), sendWatermark(false)
 {
     auto to_string = [](const bool value) {
@@ -150,13 +152,22 @@ VNCServerST::VNCServerST(const char* name_, SDesktop* desktop_)
 
     if (inotify_add_watch(inotifyfd, kasmpasswdpath, IN_CLOSE_WRITE | IN_DELETE_SELF) < 0)
       slog.error("Failed to set watch");
+    else
+      userIndex.setWatched(inotifyfd);
   }
 
+  if (kasmpasswdpath[0])
+    userIndex.setPath(kasmpasswdpath);
+  userGeneration = userIndex.getGeneration();
+
   trackingClient[0] = 0;
 
     if (watermarkData)
         sendWatermark = true;
 
+    if (Server::tracePipeline)
+        trace::setEnabled(true);
+
     if (Server::selfBench)
         SelfBench();
 
@@ -191,6 +202,8 @@ VNCServerST::~VNCServerST()
     comparer->logStats();
   delete comparer;
 
+  clearDLPMasks();
+
   delete cursor;
 }
 
@@ -379,7 +392,7 @@ void VNCServerST::unblockUpdates()
 
   // Restart the frame clock if we have updates
   if (blockCounter == 0) {
-    if (!comparer->is_empty())
+    if (!comparer->is_empty() || !damage.is_empty())
       startFrameClock();
   }
 }
@@ -393,6 +406,9 @@ void VNCServerST::setPixelBuffer(PixelBuffer* pb_, const ScreenSet& layout)
   delete comparer;
   comparer = 0;
 
+  clearDLPMasks();
+  damage.resize(pb_ ? pb_->width() : 0, pb_ ? pb_->height() : 0);
+
   screenLayout = layout;
 
   if (!pb) {
@@ -406,7 +422,7 @@ void VNCServerST::setPixelBuffer(PixelBuffer* pb_, const ScreenSet& layout)
 
   // Assume the framebuffer contents wasn't saved and reset everything
   // that tracks its contents
-  comparer = new ComparingUpdateTracker(pb);
+  comparer = new ComparingUpdateTracker(pb, &frameStore);
   renderedCursorInvalid = true;
   add_changed(pb->getRect());
 
@@ -534,6 +550,8 @@ void VNCServerST::add_changed(const Region& region)
   if (comparer == NULL)
     return;
 
+  noteDamage();
+
   comparer->add_changed(region);
   startFrameClock();
 }
@@ -543,10 +561,72 @@ void VNCServerST::add_copied(const Region& dest, const Point& delta)
   if (comparer == NULL)
     return;
 
+  noteDamage();
+
+  // Pending damage must be in the tracker before it moves anything
+  flushDamage();
   comparer->add_copied(dest, delta);
   startFrameClock();
 }
 
+void VNCServerST::add_damage(int nRects, const ShortRect *rects)
+{
+  if (comparer == NULL)
+    return;
+
+  noteDamage();
+
+  damage.add(nRects, rects);
+  startFrameClock();
+}
+
+void VNCServerST::noteDamage()
+{
+  if (inputPending)
+    inputDamaged();
+
+  // Time from the first damage that a frame update will carry
+  if (!damagePending) {
+    damageTime = std::chrono::steady_clock::now();
+    damagePending = true;
+  }
+}
+
+void VNCServerST::noteInput()
+{
+  // Time from the oldest input the screen hasn't reacted to yet
+  if (inputPending)
+    return;
+
+  inputTime = std::chrono::steady_clock::now();
+  inputPending = true;
+}
+
+void VNCServerST::inputDamaged()
+{
+  const uint64_t us = metrics::usSince(inputTime);
+
+  inputPending = false;
+
+  // Input that didn't change anything on screen would otherwise be
+  // charged with whatever gets drawn next
+  if (us > 1000000)
+    return;
+
+  metrics::registry.inputLatency.observe(us);
+  inputLatencyMs = us / 1000;
+}
+
+void VNCServerST::flushDamage()
+{
+  if (damage.is_empty())
+    return;
+
+  Region reg;
+  damage.flush(&reg);
+  comparer->add_changed(reg);
+}
+
 void VNCServerST::setCursor(int width, int height, const Point& newHotspot,
                             const rdr::U8* data, const bool resizing)
 {
@@ -650,8 +730,12 @@ bool VNCServerST::handleTimeout(Timer* t)
 {
   if (t == &frameTimer) {
     // We keep running until we go a full interval without any updates
-    if (comparer->is_empty())
+    flushDamage();
+    if (comparer->is_empty()) {
+      // Whatever was damaged turned out unchanged, no frame carries it
+      damagePending = false;
       return false;
+    }
 
     writeUpdate();
 
@@ -679,6 +763,7 @@ void VNCServerST::startDesktop()
     desktopStarted = true;
     // The tracker might have accumulated changes whilst we were
     // stopped, so flush those out
+    flushDamage();
     if (!comparer->is_empty())
       writeUpdate();
   }
@@ -764,6 +849,18 @@ void VNCServerST::startFrameClock()
   if (!desktopStarted)
     return;
 
+  if (rfb::Server::adaptiveFrameClock) {
+    // An idle screen gets its update right away, only giving further
+    // drawing a moment to coalesce. If a frame was sent recently we
+    // keep to the normal cadence.
+    const long long interval = 1000/rfb::Server::frameRate;
+    const long long sinceLast = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                  std::chrono::steady_clock::now() - lastFrameTime).count();
+    frameTimer.start(__rfbmax(interval - sinceLast,
+                              (long long)rfb::Server::frameClockMinDelay));
+    return;
+  }
+
   // The first iteration will be just half a frame as we get a very
   // unstable update rate if we happen to be perfectly in sync with
   // the application's update rate
@@ -890,14 +987,20 @@ void VNCServerST::writeUpdate()
 
   struct timeval start;
   gettimeofday(&start, NULL);
+  const std::chrono::steady_clock::time_point frameStart = std::chrono::steady_clock::now();
+
+  trace::nextFrame();
+  TRACE_SCOPE("writeUpdate");
 
   // DLP Region filtering is now done per-user in VNCSConnectionST::applyDLPRegion()
 
-  if (watermarkData && Server::DLP_WatermarkText[0] && watermarkTextNeedsUpdate(true)) {
-    // The text may have changed
-    sendWatermark = true;
+  if (watermarkData && Server::DLP_WatermarkText[0]) {
+    // Latch the time for this frame, updateWatermark() decides whether
+    // the text actually changed
+    watermarkTextNeedsUpdate(true);
   }
 
+  flushDamage();
   comparer->getUpdateInfo(&ui, pb->getRect());
   toCheck = ui.changed.union_(ui.copied);
 
@@ -912,57 +1015,58 @@ void VNCServerST::writeUpdate()
     cursorReg = clippedCursorRect;
   }
 
-  pb->grabRegion(toCheck);
+  std::chrono::steady_clock::time_point stageStart = std::chrono::steady_clock::now();
+  {
+    TRACE_SCOPE("grab");
+    pb->grabRegion(toCheck);
+  }
+  metrics::registry.grabTime.observe(metrics::usSince(stageStart));
 
   if (getComparerState())
     comparer->enable();
   else
     comparer->disable();
 
+  // Screenshots read the compared frame, so it must stay current
+  comparer->setAlwaysSync(apimessager != nullptr);
+
   struct timeval beforeAnalysis;
   gettimeofday(&beforeAnalysis, NULL);
+  stageStart = std::chrono::steady_clock::now();
+
+  {
+    TRACE_SCOPE("compare");
 
-  // Skip scroll detection if the client is slow, and didn't get the previous one yet
-  if (comparer->compare(clients.size() == 1 && (*clients.begin())->has_copypassed(),
-                        cursorReg))
-    comparer->getUpdateInfo(&ui, pb->getRect());
+    // Skip scroll detection if the client is slow, and didn't get the previous one yet
+    if (comparer->compare(clients.size() == 1 && (*clients.begin())->has_copypassed(),
+                          cursorReg))
+      comparer->getUpdateInfo(&ui, pb->getRect());
 
-  comparer->clear();
+    comparer->clear();
+  }
 
   const unsigned analysisMs = msSince(&beforeAnalysis);
+  metrics::registry.compareTime.observe(metrics::usSince(stageStart));
 
-  encCache.clear();
-  encCache.enabled = clients.size() > 1;
+  encCache.setLimit((size_t) Server::encodeCacheSize * 1024 * 1024);
 
   // Check if the password file was updated
   bool permcheck = false;
   bool configReload = false;
-  if (inotifyfd >= 0) {
-    char buf[256];
-    int ret = read(inotifyfd, buf, 256);
-    int pos = 0;
-    while (ret > 0) {
-      const struct inotify_event * const ev = (struct inotify_event *) &buf[pos];
-
-      if (ev->mask & IN_IGNORED) {
-        // file was deleted, set new watch
-        if (inotify_add_watch(inotifyfd, kasmpasswdpath, IN_CLOSE_WRITE | IN_DELETE_SELF) < 0)
-          slog.error("Failed to set watch");
-      }
-
-      permcheck = true;
-      configReload = true;
-
-      ret -= sizeof(struct inotify_event) - ev->len;
-      pos += sizeof(struct inotify_event) - ev->len;
-    }
+  // The index parses the file once per change, every client then
+  // rechecks against the new snapshot instead of re-reading it
+  const unsigned generation = userIndex.getGeneration();
+  if (generation != userGeneration) {
+    userGeneration = generation;
+    permcheck = true;
+    configReload = true;
   }
 
   unsigned shottime = 0;
   if (apimessager) {
     struct timeval shotstart;
     gettimeofday(&shotstart, NULL);
-    apimessager->mainUpdateScreen(pb);
+    apimessager->mainUpdateScreen(&frameStore);
     shottime = msSince(&shotstart);
 
     trackingFrameStats = 0;
@@ -1003,6 +1107,7 @@ void VNCServerST::writeUpdate()
     (*ci)->add_copypassed(ui.copypassed);
     (*ci)->add_changed(ui.changed);
     (*ci)->writeFramebufferUpdateOrClose();
+    (*ci)->updateMetrics();
 
     if (((network::UdpStream *)(*ci)->getOutStream(true))->isFailed()) {
       ((network::UdpStream *)(*ci)->getOutStream(true))->clearFailed();
@@ -1029,6 +1134,16 @@ void VNCServerST::writeUpdate()
 
   sendWatermark = false; // the client now caches it, only send once
 
+  metrics::registry.frames.add();
+  metrics::registry.clients.set(clients.size());
+  metrics::registry.frameTime.observe(metrics::usSince(frameStart));
+
+  if (damagePending) {
+    metrics::registry.damageLatency.observe(metrics::usSince(damageTime));
+    damagePending = false;
+  }
+  lastFrameTime = std::chrono::steady_clock::now();
+
   if (trackingFrameStats) {
     if (enctime) {
       const unsigned totalMs = msSince(&start);
@@ -1041,7 +1156,8 @@ void VNCServerST::writeUpdate()
                                                 jpegstats.rects, webpstats.rects,
                                                 enctime, scaletime, shottime,
                                                 pb->getRect().width(),
-                                                pb->getRect().height());
+                                                pb->getRect().height(),
+                                                inputLatencyMs);
     } else {
       // Zero encoding time means this was a no-data frame; restore the stats request
       if (apimessager && pthread_mutex_lock(&apimessager->userMutex) == 0) {
@@ -1067,6 +1183,7 @@ Region VNCServerST::getPendingRegion()
     return pb->getRect();
 
   // Block client from updating if there are pending updates
+  flushDamage();
   if (comparer->is_empty())
     return Region();
 
@@ -1085,6 +1202,61 @@ const RenderedCursor* VNCServerST::getRenderedCursor()
   return &renderedCursor;
 }
 
+PixelBuffer *VNCServerST::getDLPMaskedBuffer(const Rect &allowed,
+                                             const Region &fill)
+{
+  // Distinct regions are rare, a handful covers all practical setups
+  const size_t maxMasks = 4;
+
+  std::list<DLPMask>::iterator it;
+  for (it = dlpMasks.begin(); it != dlpMasks.end(); ++it) {
+    if (it->allowed.equals(allowed))
+      break;
+  }
+
+  if (it == dlpMasks.end()) {
+    if (dlpMasks.size() >= maxMasks) {
+      delete dlpMasks.back().pb;
+      dlpMasks.pop_back();
+    }
+
+    DLPMask mask;
+    mask.allowed = allowed;
+    mask.pb = new ManagedPixelBuffer(pb->getPF(), pb->width(), pb->height());
+
+    int stride;
+    rdr::U8 *data = mask.pb->getBufferRW(mask.pb->getRect(), &stride);
+    memset(data, 0, (size_t) stride * pb->height() * (pb->getPF().bpp / 8));
+    mask.pb->commitBufferRW(mask.pb->getRect());
+
+    dlpMasks.push_front(mask);
+  } else if (it != dlpMasks.begin()) {
+    dlpMasks.splice(dlpMasks.begin(), dlpMasks, it);
+  }
+
+  DLPMask &mask = dlpMasks.front();
+
+  // Bring only the pixels about to be encoded up to date
+  std::vector<Rect> rects;
+  std::vector<Rect>::const_iterator rect;
+  fill.intersect(Region(allowed)).get_rects(&rects);
+  for (rect = rects.begin(); rect != rects.end(); ++rect) {
+    int stride;
+    const rdr::U8 *src = pb->getBuffer(*rect, &stride);
+    mask.pb->imageRect(*rect, src, stride);
+  }
+
+  return mask.pb;
+}
+
+void VNCServerST::clearDLPMasks()
+{
+  std::list<DLPMask>::iterator it;
+  for (it = dlpMasks.begin(); it != dlpMasks.end(); ++it)
+    delete it->pb;
+  dlpMasks.clear();
+}
+
 void VNCServerST::getConnInfo(ListConnInfo * listConn)
 {
   listConn->Clear();
@@ -27,14 +27,18 @@
 #include <sys/time.h>
 
 #include <rfb/EncCache.h>
+#include <rfb/FrameStore.h>
 #include <rfb/SDesktop.h>
 #include <rfb/VNCServer.h>
 #include <rfb/LogWriter.h>
 #include <rfb/Blacklist.h>
 #include <rfb/Cursor.h>
 #include <rfb/Timer.h>
+#include <rfb/TileDamage.h>
+#include <rfb/UserIndex.h>
 #include <network/Socket.h>
 #include <rfb/ScreenSet.h>
+#include <chrono>
 #include <string>
 
 namespace rfb {
@@ -104,6 +108,11 @@ namespace rfb {
                                         unsigned *len);
     virtual void add_changed(const Region &region);
     virtual void add_copied(const Region &dest, const Point &delta);
+
+    // add_damage() is add_changed() for the drawing hooks. The damage is
+    // rounded up to tiles and only becomes a Region once per frame.
+    void add_damage(int nRects, const ShortRect *rects);
+
     virtual void setCursor(int width, int height, const Point& hotspot,
                            const rdr::U8* data, const bool resizing = false);
     virtual void setCursorPos(const Point& p, bool warped);
@@ -126,6 +135,14 @@ namespace rfb {
 
     SConnection* getSConnection(network::Socket* sock);
 
+    // frameDue() is true when the next frame update is about to be
+    // written, so any input already waiting should be applied first
+    bool frameDue() { return frameTimer.isStarted() && frameTimer.getRemainingMs() == 0; }
+
+    // noteInput() is called when client input is handed to the desktop,
+    // to time how long it takes before the screen changes
+    void noteInput();
+
     // getName() returns the name of this VNC Server.  NB: The value returned
     // is the server's internal buffer which may change after any other methods
     // are called - take a copy if necessary.
@@ -224,7 +241,19 @@ namespace rfb {
     bool desktopStarted;
     int blockCounter;
     PixelBuffer* pb;
-    // blackedpb removed - now per-user in VNCSConnectionST::dlpFramebuffer
+    // Last compared frame, shared with the API for screenshots
+    FrameStore frameStore;
+
+    // Black-masked copies of the framebuffer, one per distinct DLP region
+    // and shared by every client using that region. Only the allowed area
+    // of each is ever written, so everything else stays black.
+    struct DLPMask {
+      Rect allowed;
+      ManagedPixelBuffer *pb;
+    };
+    std::list<DLPMask> dlpMasks;
+    PixelBuffer *getDLPMaskedBuffer(const Rect &allowed, const Region &fill);
+    void clearDLPMasks();
     ScreenSet screenLayout;
     unsigned int ledState;
 
@@ -239,6 +268,8 @@ namespace rfb {
     static EncCache encCache;
 
     ComparingUpdateTracker* comparer;
+    TileDamage damage;
+    void flushDamage();
 
     Point cursorPos;
     Cursor* cursor;
@@ -289,7 +320,20 @@ namespace rfb {
 
     Timer frameTimer;
 
+    // Damage-to-send latency, and when the last frame went out
+    std::chrono::steady_clock::time_point damageTime, lastFrameTime;
+    bool damagePending;
+    void noteDamage();
+
+    // Input-to-damage latency
+    std::chrono::steady_clock::time_point inputTime;
+    bool inputPending;
+    unsigned inputLatencyMs;
+    void inputDamaged();
+
     int inotifyfd;
+    UserIndex userIndex;
+    unsigned userGeneration;
 
     network::GetAPIMessager *apimessager;
 
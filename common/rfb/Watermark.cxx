@@ -23,9 +23,12 @@
 #include <string.h>
 #include <time.h>
 #include <zlib.h>
+#include <chrono>
+#include <future>
 #include <rfb/LogWriter.h>
 #include <rfb/ServerCore.h>
 #include <rfb/VNCServerST.h>
+#include <rfb/xxhash.h>
 #include "font.h"
 #include <ft2build.h>
 #include FT_FREETYPE_H
@@ -44,6 +47,18 @@ uint32_t watermarkDataLen;
 static uint16_t rw, rh;
 static time_t lastUpdate;
 
+// Compression target of the packing job, swapped with watermarkData when done
+static uint8_t *watermarkPending;
+static uint64_t lastPackedHash;
+static char lastText[PATH_MAX];
+
+struct packResult_t {
+	uint32_t len;
+	bool changed;
+};
+
+static std::future<packResult_t> packJob;
+
 static FT_Library ft = NULL;
 static FT_Face face;
 
@@ -333,7 +348,7 @@ static void angledsize(const char *txt, uint32_t &w, uint32_t &h,
 }
 
 static bool drawtext(const char fmt[], const int16_t utcOff, const char fontpath[],
-			const uint8_t fontsize) {
+			const uint8_t fontsize, bool *changed = NULL) {
 	char buf[PATH_MAX];
 
 	if (!ft) {
@@ -357,6 +372,17 @@ static bool drawtext(const char fmt[], const int16_t utcOff, const char fontpath
 	if (!len)
 		return false;
 
+	// Most formats only change once a minute or less, but we get called
+	// every second. Keep the rendered glyph run while the text is the same.
+	if (watermarkInfo.src && !strcmp(buf, lastText)) {
+		if (changed)
+			*changed = false;
+		return true;
+	}
+	strcpy(lastText, buf);
+	if (changed)
+		*changed = true;
+
 	free(watermarkInfo.src);
 	if (Server::DLP_WatermarkTextAngle) {
 		uint32_t w, h, recw, recy = fontsize;
@@ -391,8 +417,10 @@ static bool drawtext(const char fmt[], const int16_t utcOff, const char fontpath
 
 bool watermarkInit() {
 	memset(&watermarkInfo, 0, sizeof(watermarkInfo_t));
-	watermarkData = watermarkUnpacked = watermarkTmp = NULL;
+	watermarkData = watermarkUnpacked = watermarkTmp = watermarkPending = NULL;
 	rw = rh = 0;
+	lastPackedHash = 0;
+	lastText[0] = '\0';
 
 	if (!Server::DLP_WatermarkImage[0] && !Server::DLP_WatermarkText[0])
 		return true;
@@ -439,51 +467,95 @@ bool watermarkInit() {
 	watermarkUnpacked = (uint8_t *) calloc(MAXW, MAXH);
 	watermarkTmp = (uint8_t *) calloc(MAXW, MAXH / 2);
 	watermarkData = (uint8_t *) calloc(MAXW, MAXH / 2);
+	watermarkPending = (uint8_t *) calloc(MAXW, MAXH / 2);
 
 	return true;
 }
 
-static void packWatermark() {
+// Runs off the main thread for text updates. Only watermarkUnpacked is
+// read, and it is not touched again until the result has been installed.
+static packResult_t packWatermark(const uint16_t w, const uint16_t h) {
 	// Take the expanded 4-bit data, filter it by the changed rects, pack
 	// to shared bytes, and compress with zlib
 
 	uint16_t x, y;
 	uint8_t pix[2], cur = 0;
 	uint8_t *dst = watermarkTmp;
+	packResult_t res = { 0, false };
 
-	for (y = 0; y < rh; y++) {
-		for (x = 0; x < rw; x++) {
-			pix[cur] = watermarkUnpacked[y * rw + x];
-			if (cur || (y == rh - 1 && x == rw - 1))
+	for (y = 0; y < h; y++) {
+		for (x = 0; x < w; x++) {
+			pix[cur] = watermarkUnpacked[y * w + x];
+			if (cur || (y == h - 1 && x == w - 1))
 				*dst++ = pix[0] | (pix[1] << 4);
 
 			cur ^= 1;
 		}
 	}
 
+	// A new time string often renders to the same pixels, and the clients
+	// already have those
+	const uint32_t packedLen = w * h / 2 + 1;
+	const uint64_t hash = XXH64(watermarkTmp, packedLen, (w << 16) | h);
+	if (hash == lastPackedHash)
+		return res;
+
 	uLong destLen = MAXW * MAXH / 2;
-	if (compress2(watermarkData, &destLen, watermarkTmp, rw * rh / 2 + 1, 1) != Z_OK)
+	if (compress2(watermarkPending, &destLen, watermarkTmp, packedLen, 1) != Z_OK) {
 		vlog.error("Zlib compression error");
+		return res;
+	}
 
-	watermarkDataLen = destLen;
+	// Only now, so that a failed compression is retried next time
+	lastPackedHash = hash;
+	res.len = destLen;
+	res.changed = true;
+	return res;
+}
+
+static bool installWatermark(const packResult_t &res) {
+	if (!res.changed)
+		return false;
+
+	uint8_t * const tmp = watermarkData;
+	watermarkData = watermarkPending;
+	watermarkPending = tmp;
+	watermarkDataLen = res.len;
+
+	return true;
 }
 
 // update the screen-size rendered watermark whenever the screen is resized
 // or if using text, every frame
 void VNCServerST::updateWatermark() {
-	if (rw == pb->width() &&
-		rh == pb->height()) {
+	// Pick up a finished background compression
+	if (packJob.valid() &&
+		packJob.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+		if (installWatermark(packJob.get()))
+			sendWatermark = true;
+	}
+
+	const bool resized = rw != pb->width() || rh != pb->height();
 
+	if (!resized) {
 		if (Server::DLP_WatermarkImage[0])
 			return;
 		if (!watermarkTextNeedsUpdate(false))
 			return;
+		// Still compressing the previous text, try again next frame
+		if (packJob.valid())
+			return;
+	} else if (packJob.valid()) {
+		installWatermark(packJob.get());
 	}
 
 	if (Server::DLP_WatermarkText[0] && watermarkTextNeedsUpdate(false)) {
+		bool changed = true;
 		drawtext(Server::DLP_WatermarkText,
 				Server::DLP_WatermarkTimeOffset * 60 + Server::DLP_WatermarkTimeOffsetMinutes,
-				Server::DLP_WatermarkFont, Server::DLP_WatermarkFontSize);
+				Server::DLP_WatermarkFont, Server::DLP_WatermarkFontSize, &changed);
+		if (!changed && !resized)
+			return;
 	}
 
 	rw = pb->width();
@@ -549,9 +621,13 @@ void VNCServerST::updateWatermark() {
 		}
 	}
 
-	packWatermark();
-
-	sendWatermark = true;
+	if (resized || !watermarkDataLen) {
+		// Clients decode it at the current screen size, so this can't wait
+		if (installWatermark(packWatermark(rw, rh)))
+			sendWatermark = true;
+	} else {
+		packJob = std::async(std::launch::async, packWatermark, rw, rh);
+	}
 }
 
 // Limit changes to once per second
@@ -16,6 +16,8 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
  * USA.
  */
+#include <assert.h>
+
 #include <rdr/OutStream.h>
 #include <rfb/Exception.h>
 #include <rfb/encodings.h>
@@ -48,17 +50,44 @@ bool ZRLEEncoder::isSupported()
 
 void ZRLEEncoder::writeRect(const PixelBuffer* pb, const Palette& palette)
 {
-  int x, y;
-  Rect tile;
-
-  rdr::OutStream* os;
-
   // A bit of a special case
   if (palette.size() == 1) {
     Encoder::writeSolidRect(pb, palette);
     return;
   }
 
+  writeTiles(pb, palette, &zos);
+
+  flushZlib();
+}
+
+void ZRLEEncoder::compressOnly(const PixelBuffer* pb, const Palette& palette,
+                               EncodedBuffer &out) const
+{
+  static thread_local rdr::MemOutStream tiles;
+
+  assert(palette.size() != 1);
+
+  tiles.clear();
+  writeTiles(pb, palette, &tiles);
+
+  out.assign((const rdr::U8*) tiles.data(),
+             (const rdr::U8*) tiles.data() + tiles.length());
+}
+
+void ZRLEEncoder::writeOnly(const EncodedBuffer &out)
+{
+  zos.writeBytes(out.data(), out.size());
+
+  flushZlib();
+}
+
+void ZRLEEncoder::writeTiles(const PixelBuffer* pb, const Palette& palette,
+                             rdr::OutStream* os) const
+{
+  int x, y;
+  Rect tile;
+
   for (y = 0;y < pb->height();y += 64) {
     tile.tl.y = y;
     tile.br.y = y + 64;
@@ -72,13 +101,18 @@ void ZRLEEncoder::writeRect(const PixelBuffer* pb, const Palette& palette)
         tile.br.x = pb->width();
 
       if (palette.size() == 0)
-        writeRawTile(tile, pb, palette);
+        writeRawTile(tile, pb, palette, os);
       else if (palette.size() <= 16)
-        writePaletteTile(tile, pb, palette);
+        writePaletteTile(tile, pb, palette, os);
       else
-        writePaletteRLETile(tile, pb, palette);
+        writePaletteRLETile(tile, pb, palette, os);
     }
   }
+}
+
+void ZRLEEncoder::flushZlib()
+{
+  rdr::OutStream* os;
 
   zos.flush();
 
@@ -96,27 +130,18 @@ void ZRLEEncoder::writeSolidRect(int width, int height,
 {
   int tiles;
 
-  rdr::OutStream* os;
-
   tiles = ((width + 63)/64) * ((height + 63)/64);
 
   while (tiles--) {
     zos.writeU8(1);
-    writePixels(colour, pf, 1);
+    writePixels(colour, pf, 1, &zos);
   }
 
-  zos.flush();
-
-  os = conn->getOutStream();
-
-  os->writeU32(mos.length());
-  os->writeBytes(mos.data(), mos.length());
-
-  mos.clear();
+  flushZlib();
 }
 
 void ZRLEEncoder::writePaletteTile(const Rect& tile, const PixelBuffer* pb,
-                                   const Palette& palette)
+                                   const Palette& palette, rdr::OutStream* os) const
 {
   const rdr::U8* buffer;
   int stride;
@@ -127,22 +152,22 @@ void ZRLEEncoder::writePaletteTile(const Rect& tile, const PixelBuffer* pb,
   case 32:
     writePaletteTile(tile.width(), tile.height(),
                      (rdr::U32*)buffer, stride,
-                     pb->getPF(), palette);
+                     pb->getPF(), palette, os);
     break;
   case 16:
     writePaletteTile(tile.width(), tile.height(),
                      (rdr::U16*)buffer, stride,
-                     pb->getPF(), palette);
+                     pb->getPF(), palette, os);
     break;
   default:
     writePaletteTile(tile.width(), tile.height(),
                      (rdr::U8*)buffer, stride,
-                     pb->getPF(), palette);
+                     pb->getPF(), palette, os);
   }
 }
 
 void ZRLEEncoder::writePaletteRLETile(const Rect& tile, const PixelBuffer* pb,
-                                      const Palette& palette)
+                                      const Palette& palette, rdr::OutStream* os) const
 {
   const rdr::U8* buffer;
   int stride;
@@ -153,22 +178,22 @@ void ZRLEEncoder::writePaletteRLETile(const Rect& tile, const PixelBuffer* pb,
   case 32:
     writePaletteRLETile(tile.width(), tile.height(),
                         (rdr::U32*)buffer, stride,
-                        pb->getPF(), palette);
+                        pb->getPF(), palette, os);
     break;
   case 16:
     writePaletteRLETile(tile.width(), tile.height(),
                         (rdr::U16*)buffer, stride,
-                        pb->getPF(), palette);
+                        pb->getPF(), palette, os);
     break;
   default:
     writePaletteRLETile(tile.width(), tile.height(),
                         (rdr::U8*)buffer, stride,
-                        pb->getPF(), palette);
+                        pb->getPF(), palette, os);
   }
 }
 
 void ZRLEEncoder::writeRawTile(const Rect& tile, const PixelBuffer* pb,
-                               const Palette& palette)
+                               const Palette& palette, rdr::OutStream* os) const
 {
   const rdr::U8* buffer;
   int stride;
@@ -177,18 +202,19 @@ void ZRLEEncoder::writeRawTile(const Rect& tile, const PixelBuffer* pb,
 
   buffer = pb->getBuffer(tile, &stride);
 
-  zos.writeU8(0); // Empty palette (i.e. raw pixels)
+  os->writeU8(0); // Empty palette (i.e. raw pixels)
 
   w = tile.width();
   h = tile.height();
   stride_bytes = stride * pb->getPF().bpp/8;
   while (h--) {
-    writePixels(buffer, pb->getPF(), w);
+    writePixels(buffer, pb->getPF(), w, os);
     buffer += stride_bytes;
   }
 }
 
-void ZRLEEncoder::writePalette(const PixelFormat& pf, const Palette& palette)
+void ZRLEEncoder::writePalette(const PixelFormat& pf, const Palette& palette,
+                               rdr::OutStream* os) const
 {
   rdr::U8 buffer[256*4];
   int i;
@@ -210,11 +236,11 @@ void ZRLEEncoder::writePalette(const PixelFormat& pf, const Palette& palette)
       *buf++ = palette.getColour(i);
   }
 
-  writePixels(buffer, pf, palette.size());
+  writePixels(buffer, pf, palette.size(), os);
 }
 
 void ZRLEEncoder::writePixels(const rdr::U8* buffer, const PixelFormat& pf,
-                              unsigned int count)
+                              unsigned int count, rdr::OutStream* os) const
 {
   Pixel maxPixel;
   rdr::U8 pixBuf[4];
@@ -223,7 +249,7 @@ void ZRLEEncoder::writePixels(const rdr::U8* buffer, const PixelFormat& pf,
   pf.bufferFromPixel(pixBuf, maxPixel);
 
   if ((pf.bpp != 32) || ((pixBuf[0] != 0) && (pixBuf[3] != 0))) {
-    zos.writeBytes(buffer, count * (pf.bpp/8));
+    os->writeBytes(buffer, count * (pf.bpp/8));
     return;
   }
 
@@ -231,7 +257,7 @@ void ZRLEEncoder::writePixels(const rdr::U8* buffer, const PixelFormat& pf,
     buffer++;
 
   while (count--) {
-    zos.writeBytes(buffer, 3);
+    os->writeBytes(buffer, 3);
     buffer += 4;
   }
 }
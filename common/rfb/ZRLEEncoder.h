@@ -21,7 +21,10 @@
 
 #include <rdr/MemOutStream.h>
 #include <rdr/ZlibOutStream.h>
+#include <rfb/EncodedBuffer.h>
 #include <rfb/Encoder.h>
+#include <stdint.h>
+#include <vector>
 
 namespace rfb {
 
@@ -37,41 +40,59 @@ namespace rfb {
                                 const PixelFormat& pf,
                                 const rdr::U8* colour);
 
+    // ZRLE has a single zlib stream for the whole connection, so only
+    // the tiling of a non-solid rect can be done in parallel. That goes
+    // into out, and writeOnly() then compresses and sends it.
+    void compressOnly(const PixelBuffer* pb, const Palette& palette,
+                      EncodedBuffer &out) const;
+    void writeOnly(const EncodedBuffer &out);
+
   protected:
+    void writeTiles(const PixelBuffer* pb, const Palette& palette,
+                    rdr::OutStream* os) const;
+    void flushZlib();
+
     void writePaletteTile(const Rect& tile, const PixelBuffer* pb,
-                          const Palette& palette);
+                          const Palette& palette, rdr::OutStream* os) const;
     void writePaletteRLETile(const Rect& tile, const PixelBuffer* pb,
-                             const Palette& palette);
+                             const Palette& palette, rdr::OutStream* os) const;
     void writeRawTile(const Rect& tile, const PixelBuffer* pb,
-                      const Palette& palette);
+                      const Palette& palette, rdr::OutStream* os) const;
 
-    void writePalette(const PixelFormat& pf, const Palette& palette);
+    void writePalette(const PixelFormat& pf, const Palette& palette,
+                      rdr::OutStream* os) const;
 
     void writePixels(const rdr::U8* buffer, const PixelFormat& pf,
-                     unsigned int count);
+                     unsigned int count, rdr::OutStream* os) const;
 
   protected:
     // Preprocessor generated, optimised methods
 
     void writePaletteTile(int width, int height,
                           const rdr::U8* buffer, int stride,
-                          const PixelFormat& pf, const Palette& palette);
+                          const PixelFormat& pf, const Palette& palette,
+                          rdr::OutStream* os) const;
     void writePaletteTile(int width, int height,
                           const rdr::U16* buffer, int stride,
-                          const PixelFormat& pf, const Palette& palette);
+                          const PixelFormat& pf, const Palette& palette,
+                          rdr::OutStream* os) const;
     void writePaletteTile(int width, int height,
                           const rdr::U32* buffer, int stride,
-                          const PixelFormat& pf, const Palette& palette);
+                          const PixelFormat& pf, const Palette& palette,
+                          rdr::OutStream* os) const;
 
     void writePaletteRLETile(int width, int height,
                              const rdr::U8* buffer, int stride,
-                             const PixelFormat& pf, const Palette& palette);
+                             const PixelFormat& pf, const Palette& palette,
+                             rdr::OutStream* os) const;
     void writePaletteRLETile(int width, int height,
                              const rdr::U16* buffer, int stride,
-                             const PixelFormat& pf, const Palette& palette);
+                             const PixelFormat& pf, const Palette& palette,
+                             rdr::OutStream* os) const;
     void writePaletteRLETile(int width, int height,
                              const rdr::U32* buffer, int stride,
-                             const PixelFormat& pf, const Palette& palette);
+                             const PixelFormat& pf, const Palette& palette,
+                             rdr::OutStream* os) const;
 
   protected:
     rdr::ZlibOutStream zos;
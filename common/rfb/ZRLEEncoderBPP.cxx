@@ -24,7 +24,8 @@
 void ZRLEEncoder::writePaletteTile(int width, int height,
                                    const rdr::UBPP* buffer, int stride,
                                    const PixelFormat& pf,
-                                   const Palette& palette)
+                                   const Palette& palette,
+                                   rdr::OutStream* os) const
 {
   const int bitsPerPackedPixel[] = {
     0, 1, 2, 2, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4
@@ -36,8 +37,8 @@ void ZRLEEncoder::writePaletteTile(int width, int height,
   assert(palette.size() > 1);
   assert(palette.size() <= 16);
 
-  zos.writeU8(palette.size());
-  writePalette(pf, palette);
+  os->writeU8(palette.size());
+  writePalette(pf, palette, os);
 
   bppp = bitsPerPackedPixel[palette.size()-1];
   pad = stride - width;
@@ -55,13 +56,13 @@ void ZRLEEncoder::writePaletteTile(int width, int height,
       byte = (byte << bppp) | index;
       nbits += bppp;
       if (nbits >= 8) {
-        zos.writeU8(byte);
+        os->writeU8(byte);
         nbits = 0;
       }
     }
     if (nbits > 0) {
       byte <<= 8 - nbits;
-      zos.writeU8(byte);
+      os->writeU8(byte);
     }
 
     buffer += pad;
@@ -71,7 +72,8 @@ void ZRLEEncoder::writePaletteTile(int width, int height,
 void ZRLEEncoder::writePaletteRLETile(int width, int height,
                                       const rdr::UBPP* buffer, int stride,
                                       const PixelFormat& pf,
-                                      const Palette& palette)
+                                      const Palette& palette,
+                                      rdr::OutStream* os) const
 {
   int pad;
 
@@ -81,8 +83,8 @@ void ZRLEEncoder::writePaletteRLETile(int width, int height,
   assert(palette.size() > 1);
   assert(palette.size() <= 127);
 
-  zos.writeU8(palette.size() | 0x80);
-  writePalette(pf, palette);
+  os->writeU8(palette.size() | 0x80);
+  writePalette(pf, palette, os);
 
   pad = stride - width;
 
@@ -94,15 +96,15 @@ void ZRLEEncoder::writePaletteRLETile(int width, int height,
     while (w--) {
       if (prevColour != *buffer) {
         if (runLength == 1)
-          zos.writeU8(palette.lookup(prevColour));
+          os->writeU8(palette.lookup(prevColour));
         else {
-          zos.writeU8(palette.lookup(prevColour) | 0x80);
+          os->writeU8(palette.lookup(prevColour) | 0x80);
 
           while (runLength > 255) {
-            zos.writeU8(255);
+            os->writeU8(255);
             runLength -= 255;
           }
-          zos.writeU8(runLength - 1);
+          os->writeU8(runLength - 1);
         }
 
         prevColour = *buffer;
@@ -115,14 +117,14 @@ void ZRLEEncoder::writePaletteRLETile(int width, int height,
     buffer += pad;
   }
   if (runLength == 1)
-    zos.writeU8(palette.lookup(prevColour));
+    os->writeU8(palette.lookup(prevColour));
   else {
-    zos.writeU8(palette.lookup(prevColour) | 0x80);
+    os->writeU8(palette.lookup(prevColour) | 0x80);
 
     while (runLength > 255) {
-      zos.writeU8(255);
+      os->writeU8(255);
       runLength -= 255;
     }
-    zos.writeU8(runLength - 1);
+    os->writeU8(runLength - 1);
   }
 }
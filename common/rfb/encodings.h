@@ -87,6 +87,15 @@ namespace rfb {
   const int pseudoEncodingVideoOutTimeLevel100 = -1887;
   const int pseudoEncodingQOI = -1886;
   const int pseudoEncodingKasmDisconnectNotify = -1885;
+  // Size of the client's tile cache, 1 << n megapixels
+  const int pseudoEncodingCacheRectSize0 = -1884;
+  const int pseudoEncodingCacheRectSize7 = -1877;
+  const int pseudoEncodingCacheRect = -1876;
+  // Offered by the client; sent by the server as an empty rect when
+  // Tight switches from zlib to zstd streams for the rest of the session
+  const int pseudoEncodingTightZstd = -1875;
+  // The client can take Tight rects XORed with what it already shows
+  const int pseudoEncodingTightDelta = -1874;
 
   // VMware-specific
   const int pseudoEncodingVMwareCursor = 0x574d5664;
@@ -36,6 +36,7 @@
 #include <rfb/CMsgReader.h>
 #include <rfb/PixelBuffer.h>
 #include <rfb/PixelFormat.h>
+#include <rfb/encodings.h>
 
 #include "util.h"
 
@@ -49,7 +50,8 @@ public:
 
   virtual void setDesktopSize(int w, int h);
   virtual void setPixelFormat(const rfb::PixelFormat& pf);
-  virtual void setCursor(int, int, const rfb::Point&, const rdr::U8*);
+  virtual void setCursor(int, int, const rfb::Point&, const rdr::U8*,
+                         const bool);
   virtual void framebufferUpdateStart();
   virtual void framebufferUpdateEnd();
   virtual void setColourMapEntries(int, int, rdr::U16*);
@@ -74,6 +76,11 @@ CConn::CConn(const char *filename)
   setState(RFBSTATE_INITIALISATION);
   // That also means that the reader and writer weren't setup
   setReader(new rfb::CMsgReader(this, in));
+
+  // Recordings may use the largest tile cache a client can ask for
+  cp.supportsCacheRect = true;
+  cp.cacheRectSize = (size_t)1024 * 1024 <<
+    (rfb::pseudoEncodingCacheRectSize7 - rfb::pseudoEncodingCacheRectSize0);
 }
 
 CConn::~CConn()
@@ -94,7 +101,8 @@ void CConn::setPixelFormat(const rfb::PixelFormat& pf)
   CConnection::setPixelFormat(filePF);
 }
 
-void CConn::setCursor(int, int, const rfb::Point&, const rdr::U8*)
+void CConn::setCursor(int, int, const rfb::Point&, const rdr::U8*,
+                      const bool)
 {
 }
 
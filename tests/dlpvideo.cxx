@@ -0,0 +1,200 @@
+/* Copyright (C) 2026 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+/*
+ * Checks that nothing outside a DLP region reaches the client when the
+ * encoder is in video mode, which encodes (and possibly scales) the
+ * whole screen. Two framebuffers that only differ outside the region are
+ * encoded from the server's masked buffer, and the resulting streams
+ * must be identical.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <rdr/Exception.h>
+#include <rdr/MemOutStream.h>
+
+#include <rfb/EncCache.h>
+#include <rfb/EncodeManager.h>
+#include <rfb/PixelBuffer.h>
+#include <rfb/SConnection.h>
+#include <rfb/SDesktop.h>
+#include <rfb/SMsgWriter.h>
+#include <rfb/ServerCore.h>
+#include <rfb/UpdateTracker.h>
+#include <rfb/VNCServerST.h>
+
+static const rfb::PixelFormat fbPF(32, 24, false, true, 255, 255, 255, 0, 8, 16);
+
+static const int width = 640, height = 480;
+static const rfb::Rect allowed(64, 48, 320, 240);
+
+static const rdr::S32 encodings[] = {
+  rfb::encodingTight, rfb::encodingCopyRect, rfb::pseudoEncodingLastRect,
+  rfb::pseudoEncodingQualityLevel0 + 8,
+  rfb::pseudoEncodingCompressLevel0 + 2};
+
+class Desktop : public rfb::SDesktop {
+};
+
+// Gives access to the masked buffers that connections encode from
+class Server : public rfb::VNCServerST {
+public:
+  Server() : VNCServerST("dlpvideo", &desktop) {}
+
+  rfb::PixelBuffer* getMasked(const rfb::Rect& allowed)
+  {
+    return getDLPMaskedBuffer(allowed, rfb::Region(pb->getRect()));
+  }
+
+protected:
+  Desktop desktop;
+};
+
+class SConn : public rfb::SConnection {
+public:
+  SConn()
+  {
+    setStreams(NULL, &out);
+    setWriter(new rfb::SMsgWriter(&cp, &out, NULL));
+    manager = new rfb::EncodeManager(this, &encCache);
+  }
+  ~SConn() { delete manager; }
+
+  void writeUpdate(const rfb::PixelBuffer* pb)
+  {
+    rfb::UpdateInfo ui;
+
+    ui.changed = rfb::Region(pb->getRect());
+    manager->writeUpdate(ui, pb, NULL);
+  }
+
+  virtual void setAccessRights(AccessRights ar) {}
+  virtual void setDesktopSize(int fb_width, int fb_height,
+                              const rfb::ScreenSet& layout) {}
+  virtual void sendStats(const bool toClient) {}
+  virtual void handleFrameStats(rdr::U32 all, rdr::U32 render) {}
+  virtual bool canChangeKasmSettings() const { return false; }
+  virtual void udpUpgrade(const char *resp) {}
+  virtual void udpDowngrade(const bool) {}
+  virtual void subscribeUnixRelay(const char *name) {}
+  virtual void unixRelay(const char *name, const rdr::U8 *buf,
+                         const unsigned len) {}
+
+public:
+  rdr::MemOutStream out;
+
+protected:
+  rfb::EncCache encCache;
+  rfb::EncodeManager *manager;
+};
+
+// Photo-like noise everywhere, but only inside the region if secret is
+// false
+static void fill(rfb::ManagedPixelBuffer* pb, bool secret)
+{
+  rdr::U32 *data;
+  int stride;
+  rdr::U32 seed;
+
+  data = (rdr::U32*) pb->getBufferRW(pb->getRect(), &stride);
+
+  seed = 1;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      seed = seed * 1103515245 + 12345;
+      if (secret || allowed.contains(rfb::Point(x, y)))
+        data[y * stride + x] = (seed >> 8) & 0xffffff;
+      else
+        data[y * stride + x] = 0;
+    }
+  }
+
+  pb->commitBufferRW(pb->getRect());
+}
+
+static void encode(rdr::MemOutStream* out, const rfb::PixelBuffer* pb)
+{
+  SConn sc;
+
+  sc.cp.setPF(fbPF);
+  sc.setEncodings(sizeof(encodings) / sizeof(*encodings), encodings);
+  sc.writeUpdate(pb);
+
+  out->clear();
+  out->writeBytes(sc.out.data(), sc.out.length());
+}
+
+static bool sameBytes(rdr::MemOutStream* a, rdr::MemOutStream* b)
+{
+  return a->length() == b->length() &&
+         memcmp(a->data(), b->data(), a->length()) == 0;
+}
+
+static void doTest(const char* name, const char* maxVideoResolution)
+{
+  rfb::ManagedPixelBuffer secretpb(fbPF, width, height);
+  rfb::ManagedPixelBuffer cleanpb(fbPF, width, height);
+  rdr::MemOutStream secret, clean, unmasked;
+
+  printf("%s: ", name);
+
+  rfb::Server::maxVideoResolution.setParam(maxVideoResolution);
+
+  fill(&secretpb, true);
+  fill(&cleanpb, false);
+
+  Server secretServer, cleanServer;
+  secretServer.setPixelBuffer(&secretpb);
+  cleanServer.setPixelBuffer(&cleanpb);
+
+  encode(&secret, secretServer.getMasked(allowed));
+  encode(&clean, cleanServer.getMasked(allowed));
+  // The server framebuffer itself must give a different stream, or
+  // the comparison above could not see a leak
+  encode(&unmasked, &secretpb);
+
+  if (sameBytes(&secret, &unmasked))
+    printf("FAILED (unmasked framebuffer gives the same stream)");
+  else if (!sameBytes(&secret, &clean))
+    printf("FAILED (pixels outside the region were sent)");
+  else
+    printf("OK");
+  printf("\n");
+  fflush(stdout);
+
+  secretServer.setPixelBuffer(NULL);
+  cleanServer.setPixelBuffer(NULL);
+}
+
+int main(int argc, char** argv)
+{
+  // Video mode from the first frame
+  rfb::Server::videoTime.setParam(0);
+
+  try {
+    doTest("video", "1920x1080");
+    doTest("video, scaled", "320x240");
+  } catch (rdr::Exception& e) {
+    fprintf(stderr, "%s\n", e.str());
+    return 1;
+  }
+
+  return 0;
+}
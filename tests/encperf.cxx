@@ -31,19 +31,31 @@
 #include <math.h>
 #include <sys/time.h>
 
+#include <atomic>
+#include <new>
+#include <set>
+#include <vector>
+
 #include <rdr/Exception.h>
 #include <rdr/OutStream.h>
 #include <rdr/FileInStream.h>
+#include <rdr/MemOutStream.h>
+#include <rdr/ZlibOutStream.h>
 
 #include <rfb/PixelFormat.h>
+#include <rfb/ContentMap.h>
+#include <rfb/JpegCompressor.h>
+#include <rfb/JpegDecompressor.h>
 
 #include <rfb/CConnection.h>
 #include <rfb/CMsgReader.h>
 #include <rfb/UpdateTracker.h>
 
+#include <rfb/EncCache.h>
 #include <rfb/EncodeManager.h>
 #include <rfb/SConnection.h>
 #include <rfb/SMsgWriter.h>
+#include <rfb/ServerCore.h>
 
 #include "util.h"
 
@@ -57,9 +69,80 @@ static rfb::BoolParameter translate("translate",
                                     "Translate 8-bit and 16-bit datasets into 24-bit",
                                     true);
 
+static rfb::BoolParameter zstd("zstd",
+                               "Ask for zstd instead of zlib in Tight rects",
+                               false);
+
+static rfb::BoolParameter delta("delta",
+                                "Accept Tight rects XORed with the previous frame",
+                                false);
+
+static rfb::BoolParameter classify("classify",
+                                   "Instead of timing the encoder, sort changed "
+                                   "tiles into content classes and report the "
+                                   "lossless and JPEG size and quality of each",
+                                   false);
+static rfb::IntParameter jpegQuality("jpegquality",
+                                     "JPEG quality (1-100) used by -classify",
+                                     92, 1, 100);
+
+// Heap allocations made through operator new, to see what encoding a
+// frame costs. Allocations inside C libraries are not included.
+static std::atomic<unsigned long long> allocCount;
+
+void* operator new(size_t size)
+{
+  void *ptr;
+
+  allocCount.fetch_add(1, std::memory_order_relaxed);
+
+  ptr = malloc(size ? size : 1);
+  if (ptr == NULL)
+    throw std::bad_alloc();
+
+  return ptr;
+}
+
+void* operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+  free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+  free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+  free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept
+{
+  free(ptr);
+}
+
 // The frame buffer (and output) is always this format
 static const rfb::PixelFormat fbPF(32, 24, false, true, 255, 255, 255, 0, 8, 16);
 
+// Results of -classify for each content class
+struct classStats {
+  unsigned long long tiles;
+  unsigned long long pixels;
+  unsigned long long losslessBytes;
+  unsigned long long jpegBytes;
+  double sqError; // Over all channels of all pixels
+  double ssim;    // Weighted by pixels
+};
+
+static struct classStats classStats[rfb::contentClassMax];
+
 // Encodings to use
 static const rdr::S32 encodings[] = {
   rfb::encodingTight, rfb::encodingCopyRect, rfb::encodingRRE,
@@ -71,11 +154,11 @@ class DummyOutStream : public rdr::OutStream {
 public:
   DummyOutStream();
 
-  virtual int length();
+  virtual size_t length();
   virtual void flush();
 
 private:
-  virtual int overrun(int itemSize, int nItems);
+  virtual void overrun(size_t needed);
 
   int offset;
   rdr::U8 buf[131072];
@@ -90,7 +173,8 @@ public:
                 unsigned long long& rawEquivalent);
 
   virtual void setDesktopSize(int w, int h);
-  virtual void setCursor(int, int, const rfb::Point&, const rdr::U8*);
+  virtual void setCursor(int, int, const rfb::Point&, const rdr::U8*,
+                         const bool);
   virtual void framebufferUpdateStart();
   virtual void framebufferUpdateEnd();
   virtual void dataRect(const rfb::Rect&, int);
@@ -101,6 +185,8 @@ public:
 public:
   double decodeTime;
   double encodeTime;
+  unsigned long long encodeAllocs;
+  unsigned frames;
 
 protected:
   rdr::FileInStream *in;
@@ -110,7 +196,7 @@ protected:
 
 class Manager : public rfb::EncodeManager {
 public:
-  Manager(class rfb::SConnection *conn);
+  Manager(class rfb::SConnection *conn, rfb::EncCache *encCache);
 
   void getStats(double&, unsigned long long&, unsigned long long&);
 };
@@ -129,8 +215,19 @@ public:
   virtual void setDesktopSize(int fb_width, int fb_height,
                               const rfb::ScreenSet& layout);
 
+  virtual void sendStats(const bool toClient);
+  virtual void handleFrameStats(rdr::U32 all, rdr::U32 render);
+  virtual bool canChangeKasmSettings() const;
+  virtual void udpUpgrade(const char *resp);
+  virtual void udpDowngrade(const bool);
+  virtual void subscribeUnixRelay(const char *name);
+  virtual void unixRelay(const char *name, const rdr::U8 *buf,
+                         const unsigned len);
+
 protected:
   DummyOutStream *out;
+  // Left disabled, every run should measure the encoders themselves
+  rfb::EncCache encCache;
   Manager *manager;
 };
 
@@ -141,7 +238,7 @@ DummyOutStream::DummyOutStream()
   end = buf + sizeof(buf);
 }
 
-int DummyOutStream::length()
+size_t DummyOutStream::length()
 {
   flush();
   return offset;
@@ -153,18 +250,138 @@ void DummyOutStream::flush()
   ptr = buf;
 }
 
-int DummyOutStream::overrun(int itemSize, int nItems)
+void DummyOutStream::overrun(size_t needed)
 {
   flush();
-  if (itemSize * nItems > end - ptr)
-    nItems = (end - ptr) / itemSize;
-  return nItems;
+  if (avail() < needed)
+    throw rdr::Exception("Insufficient dummy output buffer");
+}
+
+// SSIM of the brightness of two images, over 8x8 windows
+static double ssim(const rdr::U32 *a, const rdr::U32 *b, int w, int h)
+{
+  const double c1 = (0.01 * 255) * (0.01 * 255);
+  const double c2 = (0.03 * 255) * (0.03 * 255);
+  double total;
+
+  total = 0;
+  for (int wy = 0; wy < h; wy += 8) {
+    for (int wx = 0; wx < w; wx += 8) {
+      double sa, sb, saa, sbb, sab;
+      int n;
+
+      sa = sb = saa = sbb = sab = 0;
+      n = 0;
+      for (int y = wy; y < h && y < wy + 8; y++) {
+        for (int x = wx; x < w && x < wx + 8; x++) {
+          const rdr::U32 pa = a[y * w + x], pb = b[y * w + x];
+          const double la = ((pa & 0xff) * 2 + ((pa >> 8) & 0xff) * 5 +
+                             ((pa >> 16) & 0xff)) / 8.0;
+          const double lb = ((pb & 0xff) * 2 + ((pb >> 8) & 0xff) * 5 +
+                             ((pb >> 16) & 0xff)) / 8.0;
+          sa += la;
+          sb += lb;
+          saa += la * la;
+          sbb += lb * lb;
+          sab += la * lb;
+          n++;
+        }
+      }
+
+      const double ma = sa / n, mb = sb / n;
+      const double va = saa / n - ma * ma, vb = sbb / n - mb * mb;
+      const double cov = sab / n - ma * mb;
+
+      total += n * ((2 * ma * mb + c1) * (2 * cov + c2)) /
+               ((ma * ma + mb * mb + c1) * (va + vb + c2));
+    }
+  }
+
+  return total;
+}
+
+// Sorts every tile touched by changed into a content class, and
+// compresses it both losslessly (zlib, as Tight does) and as JPEG
+static void evaluateTiles(const rfb::Region& changed,
+                          const rfb::PixelBuffer* pb)
+{
+  static rfb::JpegCompressor jc;
+  static rfb::JpegDecompressor jd;
+
+  const int size = rfb::ContentMap::tileSize;
+  static rdr::U32 orig[size * size], decoded[size * size];
+  static rdr::U8 packed[size * size * 3];
+
+  std::vector<rfb::Rect> rects;
+  std::set<std::pair<int, int> > tiles;
+
+  changed.get_rects(&rects);
+  for (const rfb::Rect& r : rects) {
+    for (int ty = r.tl.y / size; ty <= (r.br.y - 1) / size; ty++) {
+      for (int tx = r.tl.x / size; tx <= (r.br.x - 1) / size; tx++)
+        tiles.insert(std::make_pair(ty, tx));
+    }
+  }
+
+  for (const std::pair<int, int>& t : tiles) {
+    rfb::ContentFeatures features;
+    rfb::ContentClass content;
+
+    const rfb::Rect tile = rfb::Rect(t.second * size, t.first * size,
+                                     (t.second + 1) * size,
+                                     (t.first + 1) * size)
+                             .intersect(pb->getRect());
+    const int w = tile.width(), h = tile.height();
+    const rfb::Rect local(0, 0, w, h);
+
+    rfb::ContentMap::analyse(pb, tile, &features);
+    content = rfb::ContentMap::classify(features);
+
+    pb->getImage(fbPF, orig, tile);
+
+    struct classStats *s = &classStats[content];
+    s->tiles++;
+    s->pixels += tile.area();
+
+    for (int i = 0; i < w * h; i++) {
+      packed[i * 3 + 0] = orig[i];
+      packed[i * 3 + 1] = orig[i] >> 8;
+      packed[i * 3 + 2] = orig[i] >> 16;
+    }
+
+    rdr::MemOutStream mos;
+    {
+      rdr::ZlibOutStream zos(&mos);
+      zos.writeBytes(packed, w * h * 3);
+      zos.flush();
+    }
+    s->losslessBytes += mos.length();
+
+    jc.clear();
+    jc.compress((const rdr::U8*)orig, w, local, fbPF, jpegQuality,
+                rfb::subsampleNone);
+    s->jpegBytes += jc.length();
+
+    jd.decompress((const rdr::U8*)jc.data(), jc.length(),
+                  (rdr::U8*)decoded, w, local, fbPF);
+
+    for (int i = 0; i < w * h; i++) {
+      for (int c = 0; c < 24; c += 8) {
+        const int d = (int)((orig[i] >> c) & 0xff) -
+                      (int)((decoded[i] >> c) & 0xff);
+        s->sqError += d * d;
+      }
+    }
+    s->ssim += ssim(orig, decoded, w, h);
+  }
 }
 
 CConn::CConn(const char *filename)
 {
   decodeTime = 0.0;
   encodeTime = 0.0;
+  encodeAllocs = 0;
+  frames = 0;
 
   in = new rdr::FileInStream(filename);
   setStreams(in, NULL);
@@ -179,9 +396,18 @@ CConn::CConn(const char *filename)
   setPixelFormat(pf);
   setDesktopSize(width, height);
 
+  std::vector<rdr::S32> encs(encodings, encodings +
+                             sizeof(encodings) / sizeof(*encodings));
+  if (zstd)
+    encs.push_back(rfb::pseudoEncodingTightZstd);
+  if (delta) {
+    cp.supportsTightDelta = true;
+    encs.push_back(rfb::pseudoEncodingTightDelta);
+  }
+
   sc = new SConn();
   sc->cp.setPF((bool)translate ? fbPF : pf);
-  sc->setEncodings(sizeof(encodings) / sizeof(*encodings), encodings);
+  sc->setEncodings(encs.size(), encs.data());
 }
 
 CConn::~CConn()
@@ -207,7 +433,8 @@ void CConn::setDesktopSize(int w, int h)
   setFramebuffer(pb);
 }
 
-void CConn::setCursor(int, int, const rfb::Point&, const rdr::U8*)
+void CConn::setCursor(int, int, const rfb::Point&, const rdr::U8*,
+                      const bool)
 {
 }
 
@@ -233,11 +460,21 @@ void CConn::framebufferUpdateEnd()
 
   updates.getUpdateInfo(&ui, clip);
 
+  if (classify) {
+    evaluateTiles(ui.changed, pb);
+    frames++;
+    return;
+  }
+
+  unsigned long long allocs = allocCount.load();
+
   startCpuCounter();
   sc->writeUpdate(ui, pb);
   endCpuCounter();
 
   encodeTime += getCpuCounter();
+  encodeAllocs += allocCount.load() - allocs;
+  frames++;
 }
 
 void CConn::dataRect(const rfb::Rect &r, int encoding)
@@ -260,8 +497,8 @@ void CConn::serverCutText(const char*, rdr::U32)
 {
 }
 
-Manager::Manager(class rfb::SConnection *conn) :
-  EncodeManager(conn)
+Manager::Manager(class rfb::SConnection *conn, rfb::EncCache *encCache) :
+  EncodeManager(conn, encCache)
 {
 }
 
@@ -290,9 +527,9 @@ SConn::SConn()
   out = new DummyOutStream;
   setStreams(NULL, out);
 
-  setWriter(new rfb::SMsgWriter(&cp, out));
+  setWriter(new rfb::SMsgWriter(&cp, out, NULL));
 
-  manager = new Manager(this);
+  manager = new Manager(this, &encCache);
 }
 
 SConn::~SConn()
@@ -321,11 +558,42 @@ void SConn::setDesktopSize(int fb_width, int fb_height,
 {
 }
 
+void SConn::sendStats(const bool toClient)
+{
+}
+
+void SConn::handleFrameStats(rdr::U32 all, rdr::U32 render)
+{
+}
+
+bool SConn::canChangeKasmSettings() const
+{
+  return false;
+}
+
+void SConn::udpUpgrade(const char *resp)
+{
+}
+
+void SConn::udpDowngrade(const bool)
+{
+}
+
+void SConn::subscribeUnixRelay(const char *name)
+{
+}
+
+void SConn::unixRelay(const char *name, const rdr::U8 *buf,
+                      const unsigned len)
+{
+}
+
 struct stats
 {
   double decodeTime;
   double encodeTime;
   double realTime;
+  double allocsPerFrame;
 
   double ratio;
   unsigned long long bytes;
@@ -362,6 +630,7 @@ static struct stats runTest(const char *fn)
   s.encodeTime = cc->encodeTime;
   s.realTime = (double)stop.tv_sec - start.tv_sec;
   s.realTime += ((double)stop.tv_usec - start.tv_usec)/1000000.0;
+  s.allocsPerFrame = cc->frames ? (double)cc->encodeAllocs / cc->frames : 0.0;
   cc->getStats(s.ratio, s.bytes, s.rawEquivalent);
 
   delete cc;
@@ -442,6 +711,30 @@ int main(int argc, char **argv)
     usage(argv[0]);
   }
 
+  if (classify) {
+    runTest(fn);
+
+    printf("%-10s %8s %12s %14s %12s %8s %8s\n", "Class", "Tiles",
+           "Pixels", "Lossless B", "JPEG B", "PSNR", "SSIM");
+    for (i = 0; i < rfb::contentClassMax; i++) {
+      const struct classStats *s = &classStats[i];
+      double psnr;
+
+      if (s->pixels == 0)
+        continue;
+
+      psnr = s->sqError / (s->pixels * 3.0);
+      psnr = psnr > 0 ? 10 * log10(255.0 * 255.0 / psnr) : INFINITY;
+
+      printf("%-10s %8llu %12llu %14llu %12llu %8.2f %8.4f\n",
+             rfb::contentClassName((rfb::ContentClass)i), s->tiles,
+             s->pixels, s->losslessBytes, s->jpegBytes, psnr,
+             s->ssim / s->pixels);
+    }
+
+    return 0;
+  }
+
   // Warmup
   runTest(fn);
 
@@ -479,6 +772,9 @@ int main(int argc, char **argv)
 
   printf("CPU time (encoding): %g s (+/- %g %%)\n", median, meddev);
 
+  // Compare zlib and zstd by this and the ratio
+  printf("Encoding speed: %g MB/s\n", runs[0].rawEquivalent / median / 1000000);
+
   // And for CPU core usage encoding
   for (i = 0;i < runCount;i++)
     values[i] = (runs[i].decodeTime + runs[i].encodeTime) / runs[i].realTime;
@@ -494,6 +790,15 @@ int main(int argc, char **argv)
 
   printf("Core usage (total): %g (+/- %g %%)\n", median, meddev);
 
+  // And for heap allocations while encoding
+  for (i = 0;i < runCount;i++)
+    values[i] = runs[i].allocsPerFrame;
+
+  sort(values, runCount);
+  median = values[runCount/2];
+
+  printf("Allocations per frame (encoding): %g\n", median);
+
 #ifdef WIN32
   printf("Encoded bytes: %I64d\n", runs[0].bytes);
   printf("Raw equivalent bytes: %I64d\n", runs[0].rawEquivalent);
@@ -503,5 +808,17 @@ int main(int argc, char **argv)
 #endif
   printf("Ratio: %g\n", runs[0].ratio);
 
+  // Lossless rects compressed in parallel each restart their zlib
+  // stream, which costs some of the ratio
+  const bool parallel = rfb::Server::parallelLossless;
+  rfb::Server::parallelLossless.setParam(!parallel);
+  const struct stats other = runTest(fn);
+  rfb::Server::parallelLossless.setParam(parallel);
+
+  printf("Ratio with ParallelLossless off: %g\n",
+         parallel ? other.ratio : runs[0].ratio);
+  printf("Ratio with ParallelLossless on: %g\n",
+         parallel ? runs[0].ratio : other.ratio);
+
   return 0;
 }
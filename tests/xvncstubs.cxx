@@ -0,0 +1,42 @@
+/* Copyright (C) 2026 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+//
+// Globals that Xvnc normally provides, for the test programs that pull
+// in the connection and server classes from the rfb and network
+// libraries.
+//
+
+#include <stdlib.h>
+
+#include <rfb/Configuration.h>
+#include <rfb/unixRelayLimits.h>
+
+extern "C" {
+// websocket.c
+char *extra_headers = NULL;
+unsigned extra_headers_len = 0;
+int wakeuppipe[2] = { -1, -1 };
+
+// VNCSConnectionST
+char unixrelaynames[MAX_UNIX_RELAYS][MAX_UNIX_RELAY_NAME_LEN];
+}
+
+rfb::BoolParameter disablebasicauth("DisableBasicAuth",
+                                    "Disable basic auth for websockets",
+                                    false);
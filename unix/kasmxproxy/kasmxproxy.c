@@ -17,17 +17,20 @@
  */
 
 #include <getopt.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
+#include <time.h>
 #include <unistd.h>
 #include <X11/Xatom.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/Xcursor/Xcursor.h>
+#include <X11/extensions/Xdamage.h>
 #include <X11/extensions/Xfixes.h>
 #include <X11/extensions/Xrandr.h>
 #include <X11/extensions/XShm.h>
@@ -37,6 +40,14 @@
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Changes are compared and forwarded in tiles of this size
+#define TILE 64
+// Longest wait between polls when nothing is happening
+#define IDLE_MAX_US (250 * 1000)
+// With XDamage, every tile is still checked this often, as some drawing
+// (e.g. direct rendering) isn't always reported
+#define SWEEP_SECONDS 5
+
 static void help(const char name[]) {
 	printf("Usage: %s [opts]\n\n"
 		"-a --app-display disp	App display, default :0\n"
@@ -103,6 +114,171 @@ static void supplyselection(Display *disp, const XEvent * const ev, const Atom x
 			(XEvent *) &sev);
 }
 
+// A row of tiles, shared by both displays so a tile can be grabbed from
+// the app display and put on the VNC display without copying it. If the
+// VNC display can't attach the segment, e.g. it runs in another IPC
+// namespace, vnc is a plain image over the same memory and tiles go
+// through XPutImage instead.
+struct strip {
+	XImage *app, *vnc;
+	XShmSegmentInfo appshm, vncshm;
+	uint8_t vncusesshm;
+};
+
+static uint8_t shmfailed;
+
+static int shmerror(Display *disp, XErrorEvent *ev) {
+	shmfailed = 1;
+	return 0;
+}
+
+// XShmAttach errors arrive asynchronously, so wait for the reply
+static int shmattach(Display *disp, XShmSegmentInfo *shm) {
+	int (*old)(Display *, XErrorEvent *);
+
+	XSync(disp, False);
+	shmfailed = 0;
+	old = XSetErrorHandler(shmerror);
+	if (!XShmAttach(disp, shm))
+		shmfailed = 1;
+	XSync(disp, False);
+	XSetErrorHandler(old);
+
+	return !shmfailed;
+}
+
+static void destroystrip(Display *appdisp, Display *vncdisp, struct strip *s) {
+	if (!s->app)
+		return;
+
+	XShmDetach(appdisp, &s->appshm);
+	if (s->vncusesshm) {
+		XShmDetach(vncdisp, &s->vncshm);
+	} else {
+		// Not ours to free, it's the shared segment
+		s->vnc->data = NULL;
+	}
+	XDestroyImage(s->app);
+	XDestroyImage(s->vnc);
+	shmdt(s->appshm.shmaddr);
+	shmctl(s->appshm.shmid, IPC_RMID, NULL);
+
+	s->app = s->vnc = NULL;
+}
+
+static int createstrip(Display *appdisp, Visual *appvis,
+			Display *vncdisp, Visual *vncvis,
+			const int depth, const unsigned w, const unsigned h,
+			struct strip *s) {
+	s->app = XShmCreateImage(appdisp, appvis, depth, ZPixmap,
+				NULL, &s->appshm, w, h);
+	s->vnc = XShmCreateImage(vncdisp, vncvis, depth, ZPixmap,
+				NULL, &s->vncshm, w, h);
+	if (!s->app || !s->vnc)
+		return 0;
+
+	s->appshm.shmid = shmget(IPC_PRIVATE,
+				s->app->bytes_per_line * s->app->height,
+				IPC_CREAT | 0666);
+	if (s->appshm.shmid == -1)
+		return 0;
+	s->appshm.shmaddr = s->app->data = shmat(s->appshm.shmid, 0, 0);
+	s->appshm.readOnly = False;
+
+	s->vncshm.shmid = s->appshm.shmid;
+	s->vncshm.shmaddr = s->vnc->data = s->appshm.shmaddr;
+	s->vncshm.readOnly = True;
+
+	if (!shmattach(appdisp, &s->appshm))
+		return 0;
+
+	s->vncusesshm = shmattach(vncdisp, &s->vncshm);
+	if (!s->vncusesshm) {
+		printf("Cannot attach shared memory on the VNC display, using XPutImage\n");
+		XDestroyImage(s->vnc);
+		s->vnc = XCreateImage(vncdisp, vncvis, depth, ZPixmap, 0,
+					s->app->data, w, h, 32,
+					s->app->bytes_per_line);
+		if (!s->vnc)
+			return 0;
+	}
+
+	return 1;
+}
+
+// Grabs the dirty tiles from the app display and puts the ones whose
+// contents actually changed on the VNC display. Returns the number of
+// tiles sent.
+static unsigned copytiles(Display *appdisp, Window approot,
+			Display *vncdisp, Window vncroot, GC gc,
+			struct strip *strip, const unsigned w, const unsigned h,
+			uint8_t *dirty, uint64_t *hashes) {
+	static uint8_t tilebuf[TILE * TILE * 4];
+
+	const unsigned tilesx = (w + TILE - 1) / TILE;
+	const unsigned tilesy = (h + TILE - 1) / TILE;
+	const unsigned bpp = strip->app->bits_per_pixel / 8;
+	unsigned tx, ty, y, sent = 0;
+
+	for (ty = 0; ty < tilesy; ty++) {
+		uint8_t *row = &dirty[ty * tilesx];
+		for (tx = 0; tx < tilesx; tx++) {
+			if (row[tx])
+				break;
+		}
+		if (tx == tilesx)
+			continue;
+
+		// The last row is grabbed overlapping the one above it, so
+		// the strip can stay one size
+		const unsigned tiley = ty * TILE;
+		const unsigned stripy = min(tiley, h - strip->app->height);
+		const unsigned th = min(TILE, h - tiley);
+
+		if (!XShmGetImage(appdisp, approot, strip->app, 0, stripy, AllPlanes))
+			continue;
+
+		unsigned put = 0;
+		for (; tx < tilesx; tx++) {
+			if (!row[tx])
+				continue;
+			row[tx] = 0;
+
+			const unsigned tilex = tx * TILE;
+			const unsigned tw = min(TILE, w - tilex);
+			const uint8_t *src = (uint8_t *) strip->app->data +
+						(tiley - stripy) * strip->app->bytes_per_line +
+						tilex * bpp;
+
+			for (y = 0; y < th; y++)
+				memcpy(&tilebuf[y * tw * bpp],
+					src + y * strip->app->bytes_per_line, tw * bpp);
+
+			const uint64_t hash = XXH64(tilebuf, tw * th * bpp, 0);
+			if (hash == hashes[ty * tilesx + tx])
+				continue;
+			hashes[ty * tilesx + tx] = hash;
+
+			if (strip->vncusesshm)
+				XShmPutImage(vncdisp, vncroot, gc, strip->vnc,
+						tilex, tiley - stripy, tilex, tiley,
+						tw, th, False);
+			else
+				XPutImage(vncdisp, vncroot, gc, strip->vnc,
+						tilex, tiley - stripy, tilex, tiley,
+						tw, th);
+			put++;
+		}
+
+		// The strip gets overwritten by the next grab
+		if (put)
+			XSync(vncdisp, False);
+		sent += put;
+	}
+
+	return sent;
+}
+
 int main(int argc, char **argv) {
 
 	const char *appstr = ":0";
@@ -169,7 +345,7 @@ int main(int argc, char **argv) {
 	const int appscreen = DefaultScreen(appdisp);
 	const int vncscreen = DefaultScreen(vncdisp);
 	Visual *appvis = DefaultVisual(appdisp, appscreen);
-	//Visual *vncvis = DefaultVisual(vncdisp, vncscreen);
+	Visual *vncvis = DefaultVisual(vncdisp, vncscreen);
 	const int appdepth = DefaultDepth(appdisp, appscreen);
 	const int vncdepth = DefaultDepth(vncdisp, vncscreen);
 	if (appdepth != vncdepth) {
@@ -186,9 +362,10 @@ int main(int argc, char **argv) {
 	gcval.function = GXcopy;
 	GC gc = XCreateGC(vncdisp, vncroot, GCFunction | GCPlaneMask, &gcval);
 
-	XImage *img = NULL;
-	XShmSegmentInfo shminfo;
+	struct strip strip = { NULL, NULL };
 	unsigned imgw = 0, imgh = 0;
+	uint8_t *dirty = NULL;
+	uint64_t *hashes = NULL;
 
 	if (XGrabPointer(vncdisp, vncroot, False,
 				ButtonPressMask | ButtonReleaseMask | PointerMotionMask,
@@ -204,6 +381,19 @@ int main(int argc, char **argv) {
 	XFixesSelectSelectionInput(appdisp, approot, XA_PRIMARY,
 					XFixesSetSelectionOwnerNotifyMask);
 
+	// Without XDamage every tile has to be checked on every iteration
+	int damagebase, damageerrbase;
+	Damage damage = None;
+	XserverRegion damageregion = None;
+	uint8_t damaged = 1;
+	time_t lastsweep = 0;
+	if (XDamageQueryExtension(appdisp, &damagebase, &damageerrbase)) {
+		damage = XDamageCreate(appdisp, approot, XDamageReportNonEmpty);
+		damageregion = XFixesCreateRegion(appdisp, NULL, 0);
+	} else {
+		printf("Display %s lacks DAMAGE extension, polling\n", appstr);
+	}
+
 	int xfixesbasevnc, xfixeserrbasevnc;
 	XFixesQueryExtension(vncdisp, &xfixesbasevnc, &xfixeserrbasevnc);
 	XFixesSelectSelectionInput(vncdisp, vncroot, XA_PRIMARY,
@@ -219,6 +409,13 @@ int main(int argc, char **argv) {
 	Cursor xcursor = None;
 
 	const unsigned sleeptime = 1000 * 1000 / fps;
+	unsigned waittime = sleeptime;
+
+	struct pollfd fds[2];
+	fds[0].fd = ConnectionNumber(appdisp);
+	fds[0].events = POLLIN;
+	fds[1].fd = ConnectionNumber(vncdisp);
+	fds[1].events = POLLIN;
 
 	while (1) {
 		if (!XGetWindowAttributes(appdisp, approot, &appattr))
@@ -318,38 +515,85 @@ int main(int argc, char **argv) {
 		const unsigned h = min(appattr.height, vncattr.height);
 
 		if (w != imgw || h != imgh) {
-			if (img) {
-				XShmDetach(appdisp, &shminfo);
-				XDestroyImage(img);
-				shmdt(shminfo.shmaddr);
-				shmctl(shminfo.shmid, IPC_RMID, NULL);
-			}
-			img = XShmCreateImage(appdisp, appvis, appdepth, ZPixmap,
-						NULL, &shminfo, w, h);
-			if (!img)
+			destroystrip(appdisp, vncdisp, &strip);
+			if (!createstrip(appdisp, appvis, vncdisp, vncvis, appdepth,
+						w, min(TILE, h), &strip))
 				break;
 
-			shminfo.shmid = shmget(IPC_PRIVATE,
-						img->bytes_per_line * img->height,
-						IPC_CREAT | 0666);
-			if (shminfo.shmid == -1)
-				break;
-			shminfo.shmaddr = img->data = shmat(shminfo.shmid, 0, 0);
-			shminfo.readOnly = False;
-			if (!XShmAttach(appdisp, &shminfo))
+			const unsigned ntiles = ((w + TILE - 1) / TILE) *
+						((h + TILE - 1) / TILE);
+			free(dirty);
+			free(hashes);
+			dirty = calloc(ntiles, 1);
+			hashes = calloc(ntiles, sizeof(uint64_t));
+			if (!dirty || !hashes)
 				break;
 
 			imgw = w;
 			imgh = h;
+
+			// Everything needs sending once
+			memset(dirty, 1, ntiles);
+			if (damage != None)
+				XDamageSubtract(appdisp, damage, None, None);
+			damaged = 0;
 		}
 
-		XShmGetImage(appdisp, approot, img, 0, 0, 0xffffffff);
-		XPutImage(vncdisp, vncroot, gc, img, 0, 0, 0, 0, w, h);
+		uint8_t active = 0;
+
+		if (damage == None) {
+			memset(dirty, 1, ((w + TILE - 1) / TILE) * ((h + TILE - 1) / TILE));
+		} else if (damaged) {
+			// Only look at the tiles the app display says it drew to
+			int nrects, i;
+			XRectangle *rects;
+			const unsigned tilesx = (w + TILE - 1) / TILE;
+
+			XDamageSubtract(appdisp, damage, None, damageregion);
+			rects = XFixesFetchRegion(appdisp, damageregion, &nrects);
+			for (i = 0; i < nrects; i++) {
+				int x1 = rects[i].x, y1 = rects[i].y;
+				int x2 = x1 + rects[i].width, y2 = y1 + rects[i].height;
+				if (x1 < 0)
+					x1 = 0;
+				if (y1 < 0)
+					y1 = 0;
+				x2 = min(x2, (int) w);
+				y2 = min(y2, (int) h);
+				if (x1 >= x2 || y1 >= y2)
+					continue;
+
+				unsigned tx, ty;
+				for (ty = y1 / TILE; ty <= (unsigned) (y2 - 1) / TILE; ty++)
+					for (tx = x1 / TILE; tx <= (unsigned) (x2 - 1) / TILE; tx++)
+						dirty[ty * tilesx + tx] = 1;
+			}
+			if (rects)
+				XFree(rects);
+
+			damaged = 0;
+			active = 1;
+		}
+
+		if (damage != None) {
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (now.tv_sec - lastsweep >= SWEEP_SECONDS) {
+				// Unchanged tiles match their hash and aren't sent
+				memset(dirty, 1, ((w + TILE - 1) / TILE) * ((h + TILE - 1) / TILE));
+				lastsweep = now.tv_sec;
+			}
+		}
+
+		if (copytiles(appdisp, approot, vncdisp, vncroot, gc, &strip,
+				w, h, dirty, hashes))
+			active = 1;
 
 		// Handle events
 		while (XPending(vncdisp)) {
 			XEvent ev;
 			XNextEvent(vncdisp, &ev);
+			active = 1;
 
 			if (ev.type == xfixesbasevnc + XFixesSelectionNotify) {
 				XFixesSelectionNotifyEvent *xfe =
@@ -437,6 +681,11 @@ int main(int argc, char **argv) {
 			XEvent ev;
 			XNextEvent(appdisp, &ev);
 
+			if (damage != None && ev.type == damagebase + XDamageNotify) {
+				damaged = 1;
+				continue;
+			}
+
 			if (ev.type == xfixesbase + XFixesSelectionNotify) {
 				XFixesSelectionNotifyEvent *xfe =
 					(XFixesSelectionNotifyEvent *) &ev;
@@ -518,13 +767,29 @@ int main(int argc, char **argv) {
 			XcursorImageDestroy(converted);
 
 			cursorhash = newhash;
+			active = 1;
 		}
 
 		XFree(cursor);
 
-		usleep(sleeptime);
+		// Run at the full rate while things change. When idle, back off
+		// and wait for events from either display instead.
+		if (active || damaged || damage == None) {
+			waittime = sleeptime;
+			usleep(sleeptime);
+		} else {
+			waittime = min(waittime * 2, IDLE_MAX_US);
+			XFlush(appdisp);
+			XFlush(vncdisp);
+			if (!XPending(appdisp) && !XPending(vncdisp))
+				poll(fds, 2, waittime / 1000);
+		}
 	}
 
+	destroystrip(appdisp, vncdisp, &strip);
+	free(dirty);
+	free(hashes);
+
 	XCloseDisplay(appdisp);
 	XCloseDisplay(vncdisp);
 
@@ -32,6 +32,7 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/utsname.h>
 
 #include <network/Socket.h>
@@ -83,7 +84,8 @@ XserverDesktop::XserverDesktop(int screenIndex_,
   : screenIndex(screenIndex_),
     server(0), listeners(listeners_),
     directFbptr(true),
-    queryConnectId(0), queryConnectTimer(this), resizing(false)
+    queryConnectId(0), queryConnectTimer(this), inputDeferred(false),
+    resizing(false)
 {
   format = pf;
 
@@ -304,6 +306,15 @@ void XserverDesktop::add_changed(const rfb::Region &region)
   }
 }
 
+void XserverDesktop::add_damage(int nRects, const rfb::ShortRect *rects)
+{
+  try {
+    server->add_damage(nRects, rects);
+  } catch (rdr::Exception& e) {
+    vlog.error("XserverDesktop::add_damage: %s",e.str());
+  }
+}
+
 void XserverDesktop::add_copied(const rfb::Region &dest, const rfb::Point &delta)
 {
   try {
@@ -377,7 +388,7 @@ bool XserverDesktop::handleListenerEvent(int fd,
   sock->outStream().setBlocking(false);
   vlog.debug("new client, sock %d", sock->getFd());
   sockserv->addSocket(sock);
-  vncSetNotifyFd(sock->getFd(), screenIndex, true, false);
+  registerSocket(sock);
 
   return true;
 }
@@ -386,27 +397,96 @@ bool XserverDesktop::handleSocketEvent(int fd,
                                        SocketServer* sockserv,
                                        bool read, bool write)
 {
-  std::list<Socket*> sockets;
-  std::list<Socket*>::iterator i;
+  ClientSocketMap::iterator i;
+  Socket* sock;
 
-  sockserv->getSockets(&sockets);
-  for (i = sockets.begin(); i != sockets.end(); i++) {
-    if ((*i)->getFd() == fd)
-      break;
+  i = clientSockets.find(fd);
+  if (i == clientSockets.end())
+    return false;
+
+  sock = i->second.sock;
+
+  // Shutting down a socket makes it readable, so no matter who closed
+  // it we always end up here to clean it up. Sockets the server refused
+  // (e.g. blacklisted) have no connection to take the event.
+  if (sock->isShutdown()) {
+    removeSocket(i);
+    return true;
   }
 
-  if (i == sockets.end())
-    return false;
+  try {
+    if (read)
+      sockserv->processSocketReadEvent(sock);
 
-  if (read)
-    sockserv->processSocketReadEvent(*i);
+    if (write)
+      sockserv->processSocketWriteEvent(sock);
+  } catch (rdr::Exception& e) {
+    vlog.error("XserverDesktop::handleSocketEvent: %s", e.str());
+    // Nothing can handle this socket, don't leave it registered or
+    // we'll be woken up for it forever. The other clients carry on,
+    // even when we're draining input from blockHandler().
+    removeSocket(i);
+    return true;
+  }
 
-  if (write)
-    sockserv->processSocketWriteEvent(*i);
+  if (sock->isShutdown())
+    removeSocket(i);
 
   return true;
 }
 
+bool XserverDesktop::drainInput()
+{
+  std::vector<struct pollfd> fds;
+  ClientSocketMap::iterator i;
+  bool found = false;
+
+  fds.reserve(clientSockets.size());
+  for (i = clientSockets.begin(); i != clientSockets.end(); ++i) {
+    struct pollfd pfd;
+    pfd.fd = i->first;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    fds.push_back(pfd);
+  }
+
+  if (fds.empty() || poll(fds.data(), fds.size(), 0) <= 0)
+    return false;
+
+  for (size_t n = 0; n < fds.size(); n++) {
+    if (!(fds[n].revents & (POLLIN | POLLHUP | POLLERR)))
+      continue;
+    handleSocketEvent(fds[n].fd, server, true, false);
+    found = true;
+  }
+
+  return found;
+}
+
+void XserverDesktop::registerSocket(Socket* sock)
+{
+  ClientSocket entry;
+
+  entry.sock = sock;
+  entry.writeNotify = false;
+  clientSockets[sock->getFd()] = entry;
+
+  vncSetNotifyFd(sock->getFd(), screenIndex, true, false);
+}
+
+void XserverDesktop::removeSocket(ClientSocketMap::iterator i)
+{
+  int fd = i->first;
+  Socket* sock = i->second.sock;
+
+  vlog.debug("client gone, sock %d",fd);
+  clientSockets.erase(i);
+  vncRemoveNotifyFd(fd);
+  server->removeSocket(sock);
+  vncClientGone(fd);
+  delete sock;
+}
+
 void XserverDesktop::blockHandler(int* timeout)
 {
   // We don't have a good callback for when we can init input devices[1],
@@ -416,21 +496,15 @@ void XserverDesktop::blockHandler(int* timeout)
   vncInitInputDevice(freeKeyMappings);
 
   try {
-    std::list<Socket*> sockets;
-    std::list<Socket*>::iterator i;
-    server->getSockets(&sockets);
-    for (i = sockets.begin(); i != sockets.end(); i++) {
-      int fd = (*i)->getFd();
-      if ((*i)->isShutdown()) {
-        vlog.debug("client gone, sock %d",fd);
-        vncRemoveNotifyFd(fd);
-        server->removeSocket(*i);
-        vncClientGone(fd);
-        delete (*i);
-      } else {
-        /* Update existing NotifyFD to listen for write (or not) */
-        vncSetNotifyFd(fd, screenIndex, true, (*i)->outStream().bufferUsage() > 0);
-      }
+    // Only bother the X server when a socket starts or stops having
+    // data queued
+    ClientSocketMap::iterator i;
+    for (i = clientSockets.begin(); i != clientSockets.end(); ++i) {
+      bool pending = i->second.sock->outStream().bufferUsage() > 0;
+      if (pending == i->second.writeNotify)
+        continue;
+      i->second.writeNotify = pending;
+      vncSetNotifyFd(i->first, screenIndex, true, pending);
     }
 
     // We are responsible for propagating mouse movement between clients
@@ -444,6 +518,18 @@ void XserverDesktop::blockHandler(int* timeout)
       server->setCursorPos(oldCursorPos, false);
     }
 
+    // Input that is already waiting goes to the X server before the
+    // frame is encoded. The frame then waits for one dispatch round so
+    // that the applications get to react to it first.
+    if (Server::inputPriority && server->frameDue()) {
+      if (!inputDeferred && drainInput()) {
+        inputDeferred = true;
+        *timeout = 0;
+        return;
+      }
+      inputDeferred = false;
+    }
+
     // Trigger timers and check when the next will expire
     int nextTimeout = server->checkTimeouts();
     if (nextTimeout > 0 && (*timeout == -1 || nextTimeout < *timeout))
@@ -458,7 +544,7 @@ void XserverDesktop::addClient(Socket* sock, bool reverse)
   vlog.debug("new client, sock %d reverse %d",sock->getFd(),reverse);
   sock->outStream().setBlocking(false);
   server->addSocket(sock, reverse);
-  vncSetNotifyFd(sock->getFd(), screenIndex, true, false);
+  registerSocket(sock);
 }
 
 void XserverDesktop::disconnectClients()
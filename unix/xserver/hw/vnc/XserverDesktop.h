@@ -75,6 +75,7 @@ public:
                  const unsigned char *rgbaData);
   void setCursorPos(int x, int y, bool warped);
   void add_changed(const rfb::Region &region);
+  void add_damage(int nRects, const rfb::ShortRect *rects);
   void add_copied(const rfb::Region &dest, const rfb::Point &delta);
   void handleSocketEvent(int fd, bool read, bool write);
   void blockHandler(int* timeout);
@@ -124,10 +125,23 @@ protected:
   virtual bool handleTimeout(rfb::Timer* t);
 
 private:
+  // Client sockets we have registered with the X server, and whether we
+  // currently ask it to wake us up when they are writable
+  struct ClientSocket {
+    network::Socket* sock;
+    bool writeNotify;
+  };
+  typedef std::map<int, ClientSocket> ClientSocketMap;
+
+  void registerSocket(network::Socket* sock);
+  // Reads whatever clients have already sent, returns true if any had
+  bool drainInput();
+  void removeSocket(ClientSocketMap::iterator i);
 
   int screenIndex;
   rfb::VNCServerST* server;
   std::list<network::SocketListener*> listeners;
+  ClientSocketMap clientSockets;
   bool directFbptr;
 
   uint32_t queryConnectId;
@@ -139,6 +153,7 @@ private:
   OutputIdMap outputIdMap;
 
   rfb::Point oldCursorPos;
+  bool inputDeferred;
 
   bool resizing;
 
@@ -33,6 +33,7 @@
 
 #include <X11/X.h>
 #include <X11/Xmd.h>
+#include <damage.h>
 #include <dri3.h>
 #include <drm_fourcc.h>
 #include <fb.h>
@@ -44,6 +45,7 @@ extern const char *driNode;
 static struct priv_t {
     struct gbm_device *gbm;
     int fd;
+    DestroyPixmapProcPtr DestroyPixmap;
 } priv;
 
 struct gbm_pixmap {
@@ -57,12 +59,15 @@ static struct timeval start;
 
 struct texpixmap {
     PixmapPtr pixmap;
+    DamagePtr damage;
+    Bool full; // the bo has never been filled
     struct xorg_list entry;
 };
 
 static struct xorg_list texpixmaps;
 static CARD32 update_texpixmaps(OsTimerPtr timer, CARD32 time, void *arg);
 static OsTimerPtr texpixmaptimer;
+static Bool texpixmaptimer_armed;
 
 void xvnc_sync_dri3_textures(void);
 void xvnc_sync_dri3_pixmap(PixmapPtr pixmap);
@@ -111,6 +116,30 @@ static gbm_pixmap *gbm_pixmap_get(PixmapPtr pixmap)
     return dixLookupPrivate(&pixmap->devPrivates, &dri3_pixmap_private_key);
 }
 
+static void start_texpixmap_timer(void)
+{
+    if (texpixmaptimer_armed)
+        return;
+
+    // TimerSet reuses the timer if we have one
+    texpixmaptimer = TimerSet(texpixmaptimer, 0, 16, update_texpixmaps, NULL);
+    texpixmaptimer_armed = TRUE;
+}
+
+static void texpixmap_damage_report(DamagePtr damage, RegionPtr region,
+                                    void *closure)
+{
+    // Only called when the pixmap goes from clean to dirty
+    start_texpixmap_timer();
+}
+
+static void texpixmap_damage_destroy(DamagePtr damage, void *closure)
+{
+    struct texpixmap *ptr = closure;
+
+    ptr->damage = NULL;
+}
+
 static void add_texpixmap(PixmapPtr pix)
 {
     struct texpixmap *ptr;
@@ -121,13 +150,22 @@ static void add_texpixmap(PixmapPtr pix)
     }
 
     ptr = calloc(1, sizeof(struct texpixmap));
+    if (!ptr)
+        return;
     ptr->pixmap = pix;
+    ptr->full = TRUE;
     pix->refcnt++;
+
+    ptr->damage = DamageCreate(texpixmap_damage_report,
+                               texpixmap_damage_destroy,
+                               DamageReportNonEmpty, FALSE,
+                               pix->drawable.pScreen, ptr);
+    if (ptr->damage)
+        DamageRegister(&pix->drawable, ptr->damage);
+
     xorg_list_append(&ptr->entry, &texpixmaps);
 
-    // start if not running
-    if (!texpixmaptimer)
-        texpixmaptimer = TimerSet(NULL, 0, 16, update_texpixmaps, NULL);
+    start_texpixmap_timer();
 }
 
 static PixmapPtr
@@ -303,20 +341,80 @@ void xvnc_sync_dri3_pixmap(PixmapPtr pixmap)
     gbm_bo_unmap(gp->bo, opaque);
 }
 
+static void sync_texpixmap(struct texpixmap *ptr)
+{
+    gbm_pixmap *gp;
+    PixmapPtr pixmap = ptr->pixmap;
+    RegionRec full;
+    RegionPtr dirty;
+    BoxPtr ext, boxes;
+    int nboxes, i, y, bytespp;
+    uint8_t *src, *dst, *map;
+    uint32_t srcstride, dststride;
+    void *opaque = NULL;
+
+    if (ptr->full || !ptr->damage) {
+        BoxRec box = { 0, 0, pixmap->drawable.width, pixmap->drawable.height };
+        RegionInit(&full, &box, 1);
+        dirty = &full;
+    } else {
+        dirty = DamageRegion(ptr->damage);
+        if (RegionNil(dirty))
+            return;
+        RegionInit(&full, NullBox, 0);
+    }
+
+    gp = gbm_pixmap_get(pixmap);
+    ext = RegionExtents(dirty);
+
+    // Only map the part that changed
+    map = gbm_bo_map(gp->bo, ext->x1, ext->y1,
+                     ext->x2 - ext->x1, ext->y2 - ext->y1,
+                     GBM_BO_TRANSFER_WRITE, &dststride, &opaque);
+    if (!map) {
+        ErrorF("gbm map failed, errno %d\n", errno);
+        RegionUninit(&full);
+        return;
+    }
+
+    srcstride = pixmap->devKind;
+    bytespp = pixmap->drawable.bitsPerPixel / 8;
+
+    nboxes = RegionNumRects(dirty);
+    boxes = RegionRects(dirty);
+    for (i = 0; i < nboxes; i++) {
+        const size_t len = (boxes[i].x2 - boxes[i].x1) * bytespp;
+
+        src = (uint8_t *) pixmap->devPrivate.ptr +
+              boxes[i].y1 * srcstride + boxes[i].x1 * bytespp;
+        dst = map + (boxes[i].y1 - ext->y1) * dststride +
+              (boxes[i].x1 - ext->x1) * bytespp;
+
+        for (y = boxes[i].y1; y < boxes[i].y2; y++) {
+            memcpy(dst, src, len);
+            dst += dststride;
+            src += srcstride;
+        }
+    }
+
+    gbm_bo_unmap(gp->bo, opaque);
+
+    RegionUninit(&full);
+    ptr->full = FALSE;
+    if (ptr->damage)
+        DamageEmpty(ptr->damage);
+}
+
 void xvnc_sync_dri3_textures(void)
 {
     // Sync the tracked pixmaps into their textures (bos)
-    // This is a bit of an ugly solution, but we don't know
-    // when the pixmaps have changed nor when the textures are read.
+    // We don't know when the textures are read, so changes are copied
+    // over as soon as possible. Damage tracking on each pixmap limits
+    // that to the areas that actually changed.
     //
     // This is called both from the global damage report and the timer,
     // to account for cases that do not use the damage report.
 
-    uint32_t y;
-    gbm_pixmap *gp;
-    uint8_t *src, *dst;
-    uint32_t srcstride, dststride;
-    void *opaque = NULL;
     struct texpixmap *ptr, *tmpptr;
 
     // We may not be running on hw if there's a compositor using PRESENT on llvmpipe
@@ -325,48 +423,72 @@ void xvnc_sync_dri3_textures(void)
 
     xorg_list_for_each_entry_safe(ptr, tmpptr, &texpixmaps, entry) {
         if (ptr->pixmap->refcnt == 1) {
-            // We are the only user left, delete it
+            // We are the only user left, delete it. This also destroys
+            // our damage.
             ptr->pixmap->drawable.pScreen->DestroyPixmap(ptr->pixmap);
             xorg_list_del(&ptr->entry);
             free(ptr);
             continue;
         }
 
-        gp = gbm_pixmap_get(ptr->pixmap);
-        opaque = NULL;
-        dst = gbm_bo_map(gp->bo, 0, 0,
-                         ptr->pixmap->drawable.width,
-                         ptr->pixmap->drawable.height,
-                         GBM_BO_TRANSFER_WRITE, &dststride, &opaque);
-        if (!dst) {
-            ErrorF("gbm map failed, errno %d\n", errno);
-            continue;
-        }
+        sync_texpixmap(ptr);
+    }
+}
 
-        srcstride = ptr->pixmap->devKind;
-        src = ptr->pixmap->devPrivate.ptr;
+static Bool xvnc_dri3_destroy_pixmap(PixmapPtr pixmap)
+{
+    ScreenPtr screen = pixmap->drawable.pScreen;
+    struct texpixmap *ptr;
+    Bool ret;
 
-        for (y = 0; y < ptr->pixmap->drawable.height; y++) {
-            memcpy(dst, src, srcstride);
-            dst += dststride;
-            src += srcstride;
-        }
+    // Dropping to one reference might leave only ours
+    const Bool last = pixmap->refcnt == 2;
+
+    screen->DestroyPixmap = priv.DestroyPixmap;
+    ret = screen->DestroyPixmap(pixmap);
+    priv.DestroyPixmap = screen->DestroyPixmap;
+    screen->DestroyPixmap = xvnc_dri3_destroy_pixmap;
+
+    if (!last)
+        return ret;
+
+    // The client freed a tracked pixmap, delete it right away instead of
+    // waiting for the timer, which may not be running
+    xorg_list_for_each_entry(ptr, &texpixmaps, entry) {
+        if (ptr->pixmap != pixmap)
+            continue;
 
-        gbm_bo_unmap(gp->bo, opaque);
+        screen->DestroyPixmap(pixmap);
+        xorg_list_del(&ptr->entry);
+        free(ptr);
+        break;
     }
+
+    return ret;
 }
 
 static CARD32 update_texpixmaps(OsTimerPtr timer, CARD32 time, void *arg)
 {
+    struct texpixmap *ptr;
+
     xvnc_sync_dri3_textures();
 
     if (xorg_list_is_empty(&texpixmaps)) {
         TimerFree(texpixmaptimer);
         texpixmaptimer = NULL;
+        texpixmaptimer_armed = FALSE;
         return 0;
     }
 
-    return 16; // Reschedule next tick
+    // Pixmaps without damage tracking have to be polled
+    xorg_list_for_each_entry(ptr, &texpixmaps, entry) {
+        if (!ptr->damage)
+            return 16; // Reschedule next tick
+    }
+
+    // Everything is in sync now, a damage report restarts us
+    texpixmaptimer_armed = FALSE;
+    return 0;
 }
 
 void xvnc_init_dri3(void)
@@ -393,6 +515,9 @@ void xvnc_init_dri3(void)
 
     if (!dri3_screen_init(screenInfo.screens[0], &xvnc_dri3_info))
         FatalError("Couldn't init dri3\n");
+
+    priv.DestroyPixmap = screenInfo.screens[0]->DestroyPixmap;
+    screenInfo.screens[0]->DestroyPixmap = xvnc_dri3_destroy_pixmap;
 }
 
 #endif // DRI3
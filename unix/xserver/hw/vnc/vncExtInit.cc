@@ -475,11 +475,7 @@ void vncSetLEDState(unsigned long leds)
 void vncAddChanged(int scrIdx, const struct UpdateRect *extents,
                    int nRects, const struct UpdateRect *rects)
 {
-  Region reg;
-
-  reg.setExtentsAndOrderedRects((const ShortRect*)extents,
-                                nRects, (const ShortRect*)rects);
-  desktop[scrIdx]->add_changed(reg);
+  desktop[scrIdx]->add_damage(nRects, (const ShortRect*)rects);
 }
 
 void vncAddCopied(int scrIdx, const struct UpdateRect *extents,
@@ -22,6 +22,7 @@
 #endif
 
 #include <stdio.h>
+#include <string.h>
 
 #include "vncHooks.h"
 #include "vncExtInit.h"
@@ -29,6 +30,9 @@
 #include "xorg-version.h"
 
 #include "scrnintstr.h"
+#include "pixmapstr.h"
+#include "fb.h"
+#include "servermd.h"
 #include "windowstr.h"
 #include "cursorstr.h"
 #include "gcstruct.h"
@@ -362,29 +366,86 @@ int vncHooksInit(int scrIdx)
 // provided buffer. It lives here rather than in XorgGlue.c because it
 // temporarily pauses the hooks.
 
+// When the screen is drawn by plain fb, its pixmap is ordinary memory
+// that we can copy straight out of. Anything wrapping GetImage() (a
+// software cursor, shadowfb, glamor, EXA) may need to sync with a driver
+// or fix up the pixels first, so those must go through GetImage().
+static Bool vncGetScreenImageDirect(ScreenPtr pScreen, int x, int y,
+                                    int width, int height,
+                                    char *buffer, int strideBytes)
+{
+  PixmapPtr pPixmap;
+  const char *src;
+  int bytesPerPixel, lineBytes, i;
+
+  if (pScreen->GetImage != fbGetImage)
+    return FALSE;
+
+  pPixmap = (*pScreen->GetScreenPixmap)(pScreen);
+  if (!pPixmap || !pPixmap->devPrivate.ptr)
+    return FALSE;
+  if (pPixmap->drawable.bitsPerPixel % 8)
+    return FALSE;
+  if (x < 0 || y < 0 ||
+      x + width > pPixmap->drawable.width ||
+      y + height > pPixmap->drawable.height)
+    return FALSE;
+
+  bytesPerPixel = pPixmap->drawable.bitsPerPixel / 8;
+  lineBytes = width * bytesPerPixel;
+  src = (const char *) pPixmap->devPrivate.ptr +
+        y * pPixmap->devKind + x * bytesPerPixel;
+
+  fbPrepareAccess(&pPixmap->drawable);
+
+  if (strideBytes == pPixmap->devKind && lineBytes == pPixmap->devKind) {
+    memcpy(buffer, src, (size_t) lineBytes * height);
+  } else {
+    for (i = 0; i < height; i++) {
+      memcpy(buffer, src, lineBytes);
+      buffer += strideBytes;
+      src += pPixmap->devKind;
+    }
+  }
+
+  fbFinishAccess(&pPixmap->drawable);
+
+  return TRUE;
+}
+
 void vncGetScreenImage(int scrIdx, int x, int y, int width, int height,
                        char *buffer, int strideBytes)
 {
   ScreenPtr pScreen = screenInfo.screens[scrIdx];
   vncHooksScreenPtr vncHooksScreen = vncHooksScreenPrivate(pScreen);
+  DrawablePtr pDrawable;
 
   int i;
 
-  vncHooksScreen->ignoreHooks++;
+  if (vncGetScreenImageDirect(pScreen, x, y, width, height,
+                              buffer, strideBytes))
+    return;
 
-  // We do one line at a time since GetImage() cannot handle stride
-  for (i = y; i < y + height; i++) {
-    DrawablePtr pDrawable;
 #if XORG < 19
-    pDrawable = (DrawablePtr) WindowTable[scrIdx];
+  pDrawable = (DrawablePtr) WindowTable[scrIdx];
 #else
-    pDrawable = (DrawablePtr) pScreen->root;
+  pDrawable = (DrawablePtr) pScreen->root;
 #endif
 
-    (*pScreen->GetImage) (pDrawable, x, i, width, 1,
+  vncHooksScreen->ignoreHooks++;
+
+  if (strideBytes == PixmapBytePad(width, pDrawable->depth)) {
+    // The destination is packed the way GetImage() writes it
+    (*pScreen->GetImage) (pDrawable, x, y, width, height,
                           ZPixmap, (unsigned long)~0L, buffer);
+  } else {
+    // Otherwise one line at a time, since GetImage() cannot handle stride
+    for (i = y; i < y + height; i++) {
+      (*pScreen->GetImage) (pDrawable, x, i, width, 1,
+                            ZPixmap, (unsigned long)~0L, buffer);
 
-    buffer += strideBytes;
+      buffer += strideBytes;
+    }
   }
 
   vncHooksScreen->ignoreHooks--;